@@ -0,0 +1,126 @@
+#pragma once
+
+#include "Filesystem.hpp"
+#include "NameArena.hpp"
+#include "Bam.hpp"
+
+using ghc::filesystem::path;
+
+#include <functional>
+#include <iostream>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <atomic>
+
+using std::shared_ptr;
+using std::function;
+using std::istream;
+using std::ostream;
+using std::string;
+using std::vector;
+using std::atomic;
+
+
+namespace gfase {
+
+
+/// Per-alignment summaries, unique by (reference, start, end, matches, nonmatches, query name). Summaries are
+/// kept in a vector of fixed size records with their query names in an arena (no per-record allocation), and
+/// duplicates are found with an open addressing table of 64-bit hashes (confirmed by comparing the fields and the
+/// name, so a hash collision never merges two alignments). Summaries are only sorted when they are read back.
+/// When the stores sharing a Budget use more than its limit, the store that is adding a record sorts its records and
+/// spills them to a run file on disk, and reading back becomes a k-way merge of the runs and the records in memory.
+class AlignmentSummaryStore {
+public:
+    using AlignmentSummary = Bam::AlignmentSummary;
+
+    /// Memory shared by several stores (e.g. all the samples of a manifest), limit <= 0 means unlimited
+    struct Budget {
+        int64_t limit;
+        atomic<int64_t> used;
+
+        Budget(int64_t limit);
+    };
+
+private:
+    vector<string> ref_names;
+    path spill_dir;
+    shared_ptr<Budget> budget;
+
+    // See AlignmentSummary::name_offset
+    NameArena names;
+
+    // Unique, in insertion order until sorted (lazily, hence mutable)
+    mutable vector<AlignmentSummary> summaries;
+
+    // Power of 2 number of slots, each 0 (empty) or the high bits of a hash and 1 + the index of a summary in the
+    // low bits. Rebuilt whenever the summaries are sorted.
+    mutable vector<uint64_t> table;
+
+    // Oldest first
+    vector<path> runs;
+
+    // The first runs, which the last checkpoint refers to. They are not deleted with the store, since an interrupted
+    // run is resumed from them.
+    size_t n_checkpointed_runs;
+
+    // Bytes of this store currently counted in the budget
+    int64_t accounted;
+
+    void update_budget();
+    void spill();
+    void sort_summaries() const;
+    void rebuild_table(size_t n_slots) const;
+    void write_row(ostream& o, const AlignmentSummary& s, const string& query_name) const;
+
+public:
+    AlignmentSummaryStore(const vector<string>& ref_names, path spill_dir, shared_ptr<Budget> budget);
+    AlignmentSummaryStore(AlignmentSummaryStore&& other) noexcept;
+    AlignmentSummaryStore(const AlignmentSummaryStore& other) = delete;
+    ~AlignmentSummaryStore();
+
+    /// The name offset/length of the summary are set by the store. A summary of an alignment that is in memory
+    /// already replaces it, so of several summaries of the same alignment the last one added is kept.
+    void add(AlignmentSummary summary, const string& query_name);
+
+    /// Summaries of the other store are added after this store's, so they win for duplicate alignments
+    void operator+=(const AlignmentSummaryStore& other);
+
+    /// Every unique summary, sorted by reference (in header order), start, end, query name, matches, nonmatches
+    void for_each_summary(const function<void(const AlignmentSummary& summary, const string& query_name)>& f) const;
+
+    size_t get_n_runs() const;
+
+    /// TSV/bedGraph with one line per unique summary, in the order of for_each_summary(). If bed_path is not empty
+    /// the same lines are also written there without the headers, as a plain BED sorted by reference and start.
+    void write_tsv(path output_path, path bed_path="") const;
+
+    /// Same lines (without the track line) as bgzipped BED, sorted by reference in header order, with a tabix index
+    /// built while writing (<output_path>.tbi). Blocks are compressed by the pool if it is not null.
+    void write_bed_gz(path output_path, htsThreadPool* pool) const;
+
+    /// Same fields as an Arrow IPC file in batches of batch_size rows, with the reference names dictionary encoded and
+    /// the query name instead of the unique alignment name (which can be rebuilt from the other columns)
+    void write_arrow(path output_path, size_t batch_size=65536) const;
+
+    void write_binary(ostream& o) const;
+    void read_binary(istream& i);
+
+    /// Spill the summaries in memory and write the names of the runs rather than the summaries themselves, so that
+    /// a checkpoint only costs the alignments added since the previous one. The runs are kept until
+    /// discard_checkpoint().
+    void write_checkpoint(ostream& o);
+
+    /// Adopt the runs of a checkpoint (into an empty store), any other run in the spill directory is deleted
+    void read_checkpoint(istream& i);
+
+    /// The checkpoint was removed, so its runs are deleted with the store like any other run
+    void discard_checkpoint();
+
+    /// Delete the run files in a directory (e.g. left by an interrupted run), except the ones given
+    static void remove_runs(path directory, const vector<path>& keep={});
+};
+
+}
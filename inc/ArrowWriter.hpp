@@ -0,0 +1,96 @@
+#pragma once
+
+#include "AsyncWriter.hpp"
+#include "Filesystem.hpp"
+
+using ghc::filesystem::path;
+
+#include <cstdint>
+#include <utility>
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+using std::pair;
+
+
+namespace gfase {
+
+
+/// Writes a table as an Arrow IPC file (also known as Feather V2), which pandas, polars, R arrow, DuckDB etc. can
+/// memory map instead of parsing text. Rows are buffered column by column and written as one record batch every
+/// batch_size rows, so memory does not grow with the table. Only the few types needed here are supported, without
+/// nulls. The flatbuffers metadata is built by hand (see the Arrow columnar format spec), so there is no dependency on
+/// the Arrow libraries.
+class ArrowWriter {
+public:
+    enum class Type {
+        int32,
+        uint32,
+        uint8,
+        float64,
+        utf8,
+        // Int32 indexes into the column's dictionary of strings, which is written once before the batches
+        dictionary
+    };
+
+    struct Column {
+        string name;
+        Type type;
+        vector<string> dictionary;
+    };
+
+    // Where each encapsulated message starts, as listed in the footer
+    struct Block {
+        int64_t offset;
+        int32_t metadata_length;
+        int64_t body_length;
+    };
+
+private:
+    struct ColumnData {
+        // Fixed width values, or the characters of the strings
+        string values;
+        // Start of each string in values, and the end of the last one
+        vector<int32_t> offsets;
+    };
+
+    path output_path;
+    vector<Column> columns;
+    size_t batch_size;
+    AsyncWriter file;
+
+    vector<ColumnData> data;
+    int64_t n_rows;
+
+    vector<Block> dictionary_blocks;
+    vector<Block> batch_blocks;
+
+    bool closed;
+
+    /// Body buffers are padded to 8 bytes each
+    Block write_message(const string& metadata, const vector<pair<const char*,size_t> >& body);
+    void write_dictionaries();
+    void write_batch();
+
+public:
+    ArrowWriter(path output_path, const vector<Column>& columns, size_t batch_size=65536);
+
+    ArrowWriter(const ArrowWriter&) = delete;
+    ArrowWriter& operator=(const ArrowWriter&) = delete;
+
+    /// Values of the current row, one call per column. Integer types include dictionary indexes.
+    void append_int(size_t column, int64_t value);
+    void append_float(size_t column, double value);
+    void append_string(size_t column, const string& value);
+
+    /// Once every column of the row has been appended
+    void end_row();
+
+    /// Writes the last batch and the footer
+    void close();
+};
+
+
+}
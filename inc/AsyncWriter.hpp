@@ -0,0 +1,97 @@
+#pragma once
+
+#include "Filesystem.hpp"
+
+using ghc::filesystem::path;
+
+#include <condition_variable>
+#include <streambuf>
+#include <iostream>
+#include <cstdint>
+#include <utility>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <mutex>
+#include <deque>
+
+using std::condition_variable;
+using std::unique_ptr;
+using std::streambuf;
+using std::ostream;
+using std::thread;
+using std::vector;
+using std::atomic;
+using std::deque;
+using std::mutex;
+using std::pair;
+
+
+namespace gfase {
+
+
+/// Output file stream whose bytes are written to disk by a dedicated thread, so that formatting (or compressing) the
+/// next buffer overlaps with writing the previous one. Buffers are handed over through a bounded queue (triple
+/// buffering by default: one being filled, up to two waiting or being written), and each is written with a single
+/// large write(). Like ofstream, a file that cannot be opened leaves is_open() false, and a failed write sets the
+/// badbit. Everything is only guaranteed to be on disk (or rather, in the page cache) after close().
+class AsyncWriter: public ostream {
+    class OutputBuffer: public streambuf {
+        AsyncWriter& writer;
+
+    protected:
+        int_type overflow(int_type c) override;
+        std::streamsize xsputn(const char* s, std::streamsize n) override;
+        int sync() override;
+        pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override;
+
+    public:
+        explicit OutputBuffer(AsyncWriter& writer);
+        void set_buffer(char* begin, size_t size);
+        size_t get_size() const;
+    };
+
+    path output_path;
+    int fd;
+    size_t buffer_size;
+
+    vector<unique_ptr<char[]> > storage;
+    OutputBuffer buffer;
+
+    // Filled buffers in order, and the empty ones
+    deque<pair<char*,size_t> > queue;
+    vector<char*> free_buffers;
+    char* current;
+
+    // Bytes handed to the writer so far
+    int64_t n_submitted;
+
+    mutex m;
+    condition_variable cv;
+    bool closing;
+    // errno of the first failed write, the writer only drains the queue after that
+    atomic<int> error;
+    thread writer;
+
+    /// Hands the current buffer over to the writer and waits for an empty one, false after a write error
+    bool submit();
+    void run();
+
+public:
+    AsyncWriter(path output_path, size_t buffer_size=4*1024*1024, size_t n_buffers=3);
+
+    /// Closes the file if close() was not called, without reporting errors
+    ~AsyncWriter() override;
+
+    AsyncWriter(const AsyncWriter&) = delete;
+    AsyncWriter& operator=(const AsyncWriter&) = delete;
+
+    bool is_open() const;
+
+    /// Writes the rest and waits for the writer, sets the badbit if anything could not be written
+    void close();
+};
+
+
+}
@@ -3,15 +3,18 @@
 #include "htslib/include/htslib/hts.h"
 #include "htslib/include/htslib/sam.h"
 #include "Filesystem.hpp"
+#include "RunStats.hpp"
 #include "Sam.hpp"
 
 using ghc::filesystem::path;
 
 #include <functional>
 #include <string>
+#include <vector>
 
 using std::function;
 using std::string;
+using std::vector;
 
 namespace gfase {
 
@@ -24,19 +27,69 @@ class Bam {
     hts_itr_t* bam_iterator;
     bam1_t* alignment;
 
+    // Aux tags copied into each SamElement (as strings, empty if absent), in this order
+    vector<string> tags_to_load;
+
+    // Virtual offset at which iteration stops, -1 to read until the end of the file
+    int64_t end_offset;
+
+    // Set when iteration stopped at a truncated or corrupt record rather than at the end of the file
+    bool read_error;
+
+    // Optional, times reading (including waiting for decompression) and decoding into SamElements
+    RunStats* stats;
+
+    // BAM records are parsed straight from the decompressed BGZF blocks by read_next_fields() rather than copied
+    // whole by sam_read1. False for SAM/CRAM, and on big endian machines (BAM is little endian).
+    bool decode_fields;
+
+    // Aux fields of the last record read by read_next_fields(), only filled if they are needed
+    vector<uint8_t> aux_buffer;
+
+    // See set_detail_filter()
+    bool filter_details;
+    uint8_t detail_min_mapq;
+
+    bool has_next_record() const;
+    bool needs_details(uint16_t flag, uint8_t mapq) const;
+    bool read_next_record();
+
+    /// Only the core fields, name, and the CIGAR and qualities if requested, of the next record. The sequence, and
+    /// the aux fields unless tags are loaded (or the CIGAR is stored in a CG tag), are skipped by length without
+    /// being copied. Same as read_next_record() otherwise.
+    bool read_next_fields(SamElement& e, bool get_cigar, bool get_qualities);
+
+    /// Move forward in the decompressed stream without copying, false if it ends first
+    bool skip_bytes(int64_t n);
+
 public:
-    // Define AlignmentSummary struct
+    /// Per-alignment summary, packed since one is kept for every alignment. The reference name is looked up from
+    /// ref_id when writing outputs, and the query name is stored in an arena (e.g. by AlignmentSummaryStore) at
+    /// name_offset.
     struct AlignmentSummary {
-        string ref_name;
-        int64_t start;
-        int64_t end;
-        int64_t matches;
-        int64_t nonmatches;
-        int64_t indels;
-        int64_t indel_length;
-        int64_t inferred_length;
-        double identity;
-        int64_t mapq;
+        uint64_t name_offset;
+        int32_t ref_id;
+        int32_t start;
+        int32_t end;
+        uint32_t matches;
+        uint32_t nonmatches;
+        uint32_t indels;
+        uint32_t indel_length;
+        uint32_t inferred_length;
+        // Identity rounded to 7 decimals (see SampleMetrics::add_alignment) in units of 1e-7, which is exact where a
+        // float is not, and half the size of a double
+        uint32_t scaled_identity;
+        uint8_t mapq;
+        // BAM query names are at most 254 characters
+        uint8_t name_length;
+        // Explicit so that records written to disk have no uninitialized bytes
+        uint16_t padding;
+
+        static constexpr double identity_scale = 10000000;
+
+        double get_identity() const{
+            return double(scaled_identity)/identity_scale;
+        }
     };
 
 
@@ -44,15 +97,47 @@ public:
     ~Bam();
     void for_alignment_in_bam(const function<void(const string& ref_name, const string& query_name, int32_t query_length, uint8_t map_quality, uint16_t flag)>& f);
     void for_alignment_in_bam(bool get_cigar, const function<void(SamElement& alignment)>& f);
+    void for_alignment_in_bam(bool get_cigar, bool get_qualities, const function<void(SamElement& alignment)>& f);
+
+    /// Length and base qualities (null if the record has none) of each primary record, without decoding anything
+    /// else, e.g. to summarize an unaligned BAM
+    void for_read_in_bam(const function<void(int64_t length, const uint8_t* qualities)>& f);
+    void set_tags_to_load(const vector<string>& tags);
+
+    /// Only copy the CIGAR and base qualities of primary and supplementary records with a mapping quality of at
+    /// least min_mapq. The others (e.g. records that are only counted) are iterated with both left empty.
+    void set_detail_filter(uint8_t min_mapq);
+
+    /// Time the "read" and "decode" stages of each record in stats (null to disable), which must outlive iteration
+    void set_run_stats(RunStats* stats);
+
+    /// Decompress using a (possibly shared) htslib thread pool
+    void set_thread_pool(htsThreadPool* pool);
+
+    /// Only iterate the records in [begin, end) given as BGZF virtual offsets of record starts (see ShardPlan).
+    /// An end of -1 reads until the end of the file, a begin of -1 reads nothing. Set the thread pool first.
+    void set_virtual_offset_range(int64_t begin, int64_t end);
+
+    /// Virtual offset of the next record, e.g. to restart from there later
+    int64_t get_virtual_offset() const;
+
+    /// Whether the last iteration stopped at an incomplete record (e.g. the BAM is still being written)
+    bool had_read_error() const;
+
+    /// Whether the file ends with the empty BGZF block that marks a BAM that was closed properly
+    bool has_eof_marker() const;
+    vector<string> get_ref_names() const;
+    vector<int64_t> get_ref_lengths() const;
+    bool is_coordinate_sorted() const;
     static bool is_first_mate(uint16_t flag);
     static bool is_second_mate(uint16_t flag);
     static bool is_not_primary(uint16_t flag);
     static bool is_primary(uint16_t flag);
     static bool is_supplementary(uint16_t flag);
-
-    // Helper function to generate unique key for an alignment
-    string createUniqueKey(const string& ref_name, int start, int end, int matches, int nonmatches, string qname);
 };
 
+
+static_assert(sizeof(Bam::AlignmentSummary) == 48, "AlignmentSummary is expected to be packed");
+
 }
 
@@ -0,0 +1,82 @@
+#pragma once
+
+#include "Filesystem.hpp"
+#include "Sam.hpp"
+
+using ghc::filesystem::path;
+
+#include <unordered_map>
+#include <unordered_set>
+#include <functional>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using std::unordered_map;
+using std::unordered_set;
+using std::function;
+using std::string;
+using std::vector;
+
+
+namespace gfase {
+
+
+/// Incrementally reads BAMs that are still being written: either one growing BAM, or every BAM that appears in a
+/// directory (recursively, e.g. the bam_pass directory of a sequencing run). Each file is read from where it was
+/// left, and only complete records are read, so a record that is being written is picked up by a later poll.
+class BamFollower {
+    struct FollowedFile {
+        // Virtual offset of the next record to read, -1 before the header could be read
+        int64_t next_offset = -1;
+        // Size at the last read, the file is only reopened when it changes
+        int64_t size = -1;
+        // Closed properly (EOF marker) and read to the end, or skipped
+        bool done = false;
+    };
+
+    path watch_path;
+    vector<string> tags_to_load;
+
+    // Passed on to each Bam, see Bam::set_detail_filter()
+    bool filter_details;
+    uint8_t detail_min_mapq;
+
+    // Keyed by path
+    unordered_map<string, FollowedFile> files;
+
+    // References of the first BAM read, every other BAM must have the same
+    vector<string> ref_names;
+    vector<int64_t> ref_lengths;
+
+    // inotify descriptor (-1 if unavailable, then wait() just sleeps) and the directories it watches
+    int notify_fd;
+    unordered_set<string> watched_directories;
+
+    void watch(path p);
+    int64_t read_file(path bam_path, FollowedFile& file, const function<void(SamElement& alignment)>& f);
+
+public:
+    BamFollower(path watch_path, const vector<string>& tags_to_load);
+    ~BamFollower();
+
+    /// See Bam::set_detail_filter()
+    void set_detail_filter(uint8_t min_mapq);
+
+    /// Read every record that was completed since the last poll, returns the number of records
+    int64_t poll(const function<void(SamElement& alignment)>& f);
+
+    /// Block until something changes in the watched file/directory, or the timeout expires
+    void wait(int64_t milliseconds);
+
+    /// Empty until a BAM header was read
+    const vector<string>& get_ref_names() const;
+    const vector<int64_t>& get_ref_lengths() const;
+
+    /// Number of files seen and how many are done (closed and fully read)
+    size_t get_n_files() const;
+    size_t get_n_done() const;
+};
+
+
+}
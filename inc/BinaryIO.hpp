@@ -0,0 +1,154 @@
+#pragma once
+
+#include <unordered_map>
+#include <type_traits>
+#include <algorithm>
+#include <stdexcept>
+#include <iostream>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <array>
+
+using std::unordered_map;
+using std::runtime_error;
+using std::istream;
+using std::ostream;
+using std::string;
+using std::vector;
+using std::array;
+
+
+namespace gfase {
+
+
+/// Helpers for the binary state files. Values are written in host byte order, the file header stores a
+/// known constant so that a reader on a different architecture fails loudly instead of misreading.
+
+template<class T> void write_value(ostream& o, const T& value){
+    static_assert(std::is_trivially_copyable<T>::value, "write_value requires a trivially copyable type");
+    o.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+
+template<class T> void read_value(istream& i, T& value){
+    static_assert(std::is_trivially_copyable<T>::value, "read_value requires a trivially copyable type");
+    i.read(reinterpret_cast<char*>(&value), sizeof(T));
+
+    if (not i.good()){
+        throw runtime_error("ERROR: unexpected end of binary file");
+    }
+}
+
+
+inline void write_string(ostream& o, const string& s){
+    write_value(o, uint64_t(s.size()));
+    o.write(s.data(), std::streamsize(s.size()));
+}
+
+
+inline void read_string(istream& i, string& s){
+    uint64_t size;
+    read_value(i, size);
+    s.resize(size);
+    i.read(&s[0], std::streamsize(size));
+
+    if (not i.good()){
+        throw runtime_error("ERROR: unexpected end of binary file");
+    }
+}
+
+
+inline void write_strings(ostream& o, const vector<string>& strings){
+    write_value(o, uint64_t(strings.size()));
+    for (auto& s: strings){
+        write_string(o, s);
+    }
+}
+
+
+inline void read_strings(istream& i, vector<string>& strings){
+    uint64_t size;
+    read_value(i, size);
+    strings.resize(size);
+    for (auto& s: strings){
+        read_string(i, s);
+    }
+}
+
+
+template<class T> void write_vector(ostream& o, const vector<T>& v){
+    static_assert(std::is_trivially_copyable<T>::value, "write_vector requires a trivially copyable type");
+    write_value(o, uint64_t(v.size()));
+    o.write(reinterpret_cast<const char*>(v.data()), std::streamsize(v.size()*sizeof(T)));
+}
+
+
+template<class T> void read_vector(istream& i, vector<T>& v){
+    static_assert(std::is_trivially_copyable<T>::value, "read_vector requires a trivially copyable type");
+    uint64_t size;
+    read_value(i, size);
+    v.resize(size);
+    i.read(reinterpret_cast<char*>(v.data()), std::streamsize(size*sizeof(T)));
+
+    if (not i.good() and size > 0){
+        throw runtime_error("ERROR: unexpected end of binary file");
+    }
+}
+
+
+template<class T, size_t N> void write_array(ostream& o, const array<T,N>& a){
+    o.write(reinterpret_cast<const char*>(a.data()), std::streamsize(N*sizeof(T)));
+}
+
+
+template<class T, size_t N> void read_array(istream& i, array<T,N>& a){
+    i.read(reinterpret_cast<char*>(a.data()), std::streamsize(N*sizeof(T)));
+
+    if (not i.good()){
+        throw runtime_error("ERROR: unexpected end of binary file");
+    }
+}
+
+
+/// Written sorted by key so that the same content always gives the same bytes
+template<class K, class V> void write_map(ostream& o, const unordered_map<K,V>& m){
+    vector<std::pair<K,V> > items(m.begin(), m.end());
+    std::sort(items.begin(), items.end(), [](const std::pair<K,V>& a, const std::pair<K,V>& b){
+        return a.first < b.first;
+    });
+
+    write_value(o, uint64_t(items.size()));
+    for (auto& [key, value]: items){
+        write_value(o, key);
+        write_value(o, value);
+    }
+}
+
+
+template<class K, class V> void read_map(istream& i, unordered_map<K,V>& m){
+    uint64_t size;
+    read_value(i, size);
+
+    m.clear();
+    m.reserve(size);
+
+    for (uint64_t n=0; n<size; n++){
+        K key;
+        V value;
+        read_value(i, key);
+        read_value(i, value);
+        m.emplace(key, value);
+    }
+}
+
+
+/// Add the counts of one histogram to another
+template<class K, class V> void add_counts(unordered_map<K,V>& a, const unordered_map<K,V>& b){
+    for (auto& [key, count]: b){
+        a[key] += count;
+    }
+}
+
+
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include "htslib/include/htslib/bgzf.h"
+#include "AlignmentSummaryStore.hpp"
+#include "Filesystem.hpp"
+
+using ghc::filesystem::path;
+
+#include <functional>
+#include <iostream>
+#include <cstdint>
+#include <utility>
+#include <memory>
+#include <string>
+#include <vector>
+#include <queue>
+
+using std::priority_queue;
+using std::shared_ptr;
+using std::unique_ptr;
+using std::greater;
+using std::istream;
+using std::ostream;
+using std::string;
+using std::vector;
+using std::pair;
+
+
+namespace gfase {
+
+
+/// Read depth over the reference, written as a bgzipped bedGraph (zero depth intervals are omitted).
+///
+/// For coordinate sorted input the depth is computed with a sweep line: intervals are emitted as soon as
+/// no later alignment can overlap them, so memory only depends on the number of overlapping alignments.
+/// For unsorted input a difference array is allocated per contig (4 bytes per base) the first time the
+/// contig is touched, and the whole track is emitted at the end. The arrays are counted in the memory budget (if
+/// any) that the alignment summaries share, so that the summaries spill earlier to make room for them.
+class CoverageTrack {
+    vector<string> ref_names;
+    vector<int64_t> ref_lengths;
+    bool sorted;
+
+    path output_path;
+    BGZF* file;
+    string buffer;
+
+    // Sweep line state (sorted input)
+    int32_t current_ref_id;
+    int64_t position;
+    int64_t depth;
+    // End positions of the active intervals and the depth they contribute, earliest end on top
+    priority_queue<pair<int64_t,int64_t>, vector<pair<int64_t,int64_t> >, greater<pair<int64_t,int64_t> > > ends;
+
+    // Difference arrays (unsorted input) and the bytes of them counted in the budget
+    vector<vector<int32_t> > differences;
+    shared_ptr<AlignmentSummaryStore::Budget> budget;
+    int64_t accounted;
+
+    // Pending interval, extended while consecutive intervals have the same depth
+    int32_t pending_ref_id;
+    int64_t pending_start;
+    int64_t pending_end;
+    int64_t pending_depth;
+
+    void emit(int32_t ref_id, int64_t start, int64_t end, int64_t d);
+    void flush_pending();
+    void flush_buffer();
+    void advance_to(int64_t stop);
+    void finish_contig();
+    void release_budget();
+
+    // Append to an existing track instead of starting a new one
+    CoverageTrack(const vector<string>& ref_names, const vector<int64_t>& ref_lengths, bool sorted, path output_path,
+                  bool append, shared_ptr<AlignmentSummaryStore::Budget> budget);
+
+public:
+    CoverageTrack(const vector<string>& ref_names, const vector<int64_t>& ref_lengths, bool sorted, path output_path,
+                  shared_ptr<AlignmentSummaryStore::Budget> budget=nullptr);
+    ~CoverageTrack();
+
+    /// Add the reference interval [start, end) covered by one alignment (or by `weight` alignments)
+    void add_interval(int32_t ref_id, int64_t start, int64_t end, int64_t weight=1);
+
+    /// Emit everything that remains and close the file
+    void close();
+
+    bool is_sorted() const;
+
+    /// Bytes the difference arrays of unsorted input take if every contig has alignments
+    static int64_t get_max_unsorted_bytes(const vector<int64_t>& ref_lengths);
+
+    /// Flush the file and write the sweep line state, so that the track can be continued with resume() after a
+    /// restart. Only possible for sorted input, the difference arrays are as large as the genome.
+    void write_checkpoint(ostream& o);
+
+    /// Continue a track from a checkpoint: the file is truncated to its size at the time of the checkpoint
+    static unique_ptr<CoverageTrack> resume(istream& i, const vector<string>& ref_names, const vector<int64_t>& ref_lengths,
+                                            path output_path);
+
+    /// Sum coverage tracks written by this class (e.g. for shards of one BAM) into a new one. Since every track
+    /// is sorted and canonical (maximal runs, no zeros), the result is identical to a track computed in one go.
+    static void merge_files(const vector<path>& input_paths, const vector<string>& ref_names,
+                            const vector<int64_t>& ref_lengths, path output_path);
+};
+
+
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <unordered_map>
+#include <iostream>
+#include <cstdint>
+#include <utility>
+#include <string>
+#include <vector>
+#include <map>
+
+using std::unordered_map;
+using std::ostream;
+using std::string;
+using std::vector;
+using std::pair;
+using std::map;
+
+
+namespace gfase {
+
+
+/// Summary statistics of the identity and read length histograms, and the curves plotted from them. Identity is
+/// binned in 0.001 bins and read length in 0.01 bins of log10(length) (as in make_plots.R), so that the curves of
+/// several samples fall on the same bins and can be overlaid directly.
+class DistributionSummary {
+public:
+    static const size_t n_identity_bins;
+
+    int64_t n_reads;
+    int64_t yield;
+    double mean_length;
+    int64_t median_length;
+    int64_t n50;
+    double long_fraction;
+
+    int64_t n_alignments;
+    double mean_identity;
+    double median_identity;
+    double peak_identity;
+    double high_identity_fraction;
+
+    vector<int64_t> identity_bins;
+    // Bin b holds the lengths in [10^(b/100), 10^((b+1)/100))
+    map<int64_t,int64_t> log_length_bins;
+
+    // Fraction of the yield in reads at least as long, from the longest read
+    vector<pair<double,double> > nx_curve;
+
+    DistributionSummary(const unordered_map<double,int64_t>& identity_distribution,
+                        const unordered_map<size_t,int64_t>& length_distribution);
+
+    /// Phred scaled mean error rate (1 - mean identity), capped at 60
+    double get_qv() const;
+
+    /// Lowest identity bin of the top (1 - fraction) of the alignments
+    double get_identity_quantile_start(double fraction) const;
+
+    /// Proportion of the alignments in each identity bin, at the center of the bin
+    vector<pair<double,double> > get_identity_curve() const;
+    vector<pair<double,double> > get_cumulative_identity_curve() const;
+
+    /// Proportion of the reads in each log10(length) bin from first_bin to last_bin, including the empty ones
+    vector<pair<double,double> > get_log_length_curve(int64_t first_bin, int64_t last_bin) const;
+    vector<pair<double,double> > get_log_length_curve() const;
+
+    /// Longest read length on the Nx curve at or after this fraction of the yield
+    double get_max_nx_length(double from) const;
+
+    /// Rows of the report table, and the same numbers as CSV
+    vector<pair<string,string> > get_table() const;
+    static const string csv_header;
+    void write_csv(ostream& o) const;
+};
+
+
+}
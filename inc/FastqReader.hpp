@@ -0,0 +1,53 @@
+#pragma once
+
+#include "htslib/include/htslib/bgzf.h"
+#include "htslib/include/htslib/hts.h"
+#include "Filesystem.hpp"
+
+using ghc::filesystem::path;
+
+#include <functional>
+#include <cstdint>
+#include <vector>
+
+using std::function;
+using std::vector;
+
+
+namespace gfase {
+
+
+/// Reads of a FASTQ file, plain, gzipped or bgzipped (detected from the content). Decompression of a bgzipped file
+/// can be spread over a thread pool, a plain gzip stream can only be decompressed on the calling thread. Sequences
+/// and qualities may be wrapped over several lines.
+class FastqReader {
+    path fastq_path;
+    BGZF* file;
+    kstring_t line;
+    int64_t line_number;
+
+    // Phred scores of the current record
+    vector<uint8_t> qualities;
+
+    /// Next line without its line ending, false at the end of the file
+    bool next_line();
+
+public:
+    explicit FastqReader(path fastq_path);
+    ~FastqReader();
+
+    FastqReader(const FastqReader&) = delete;
+    FastqReader& operator=(const FastqReader&) = delete;
+
+    /// Decompress using a (possibly shared) htslib thread pool, only used if the file is bgzipped
+    void set_thread_pool(htsThreadPool* pool);
+
+    /// Length and Phred scores (not ASCII) of each record, throws if the file is not a well formed FASTQ
+    void for_read_in_fastq(const function<void(int64_t length, const uint8_t* qualities)>& f);
+
+    /// Whether the (decompressed) file starts like a FASTQ rather than a SAM header, BAM or anything else
+    static bool is_fastq(path file_path);
+};
+
+
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include "Filesystem.hpp"
+#include "Sam.hpp"
+
+using ghc::filesystem::path;
+
+#include <unordered_map>
+#include <iostream>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using std::unordered_map;
+using std::istream;
+using std::ostream;
+using std::string;
+using std::vector;
+
+
+namespace gfase {
+
+
+/// Identity/length histograms and summary stats broken down by a grouping key, which is either the contig
+/// ("contig") or the value of a 2 letter aux tag (e.g. "RG", "BC"). Groups are identified by small integer ids:
+/// contigs use the BAM target id directly, tag values are interned the first time they are seen.
+class GroupedMetrics {
+public:
+    struct Group {
+        unordered_map<double, int64_t> identity_distribution;
+        unordered_map<size_t, int64_t> length_distribution;
+        int64_t matches = 0;
+        int64_t nonmatches = 0;
+    };
+
+    /// Name used for reads without a contig. Reads without the tag are grouped under the empty name, which no tag
+    /// value has, so that they stay apart from reads whose tag is literally "*".
+    static const string missing_name;
+
+private:
+    string key;
+    bool by_contig;
+
+    // Index of the tag in SamElement::tags (unused when grouping by contig)
+    size_t tag_index;
+
+    vector<string> names;
+    vector<Group> groups;
+
+    // Tag value -> group id, only consulted when the value differs from the previous read
+    unordered_map<string, int32_t> ids;
+    string last_value;
+    int32_t last_id;
+
+    int32_t get_group_id(const SamElement& e);
+    int32_t get_group_id(const string& name);
+
+public:
+    /// key is "contig" or a 2 letter aux tag, in which case tag_index is where Bam places its value
+    GroupedMetrics(const string& key, const vector<string>& ref_names, size_t tag_index);
+
+    const string& get_key() const;
+
+    /// Count a read in the length distribution of its group
+    void add_read(const SamElement& e);
+
+    /// Count an alignment in the identity distribution and summary stats of its group
+    void add_alignment(const SamElement& e, double identity, int64_t matches, int64_t nonmatches);
+
+    /// One file per metric, each row prefixed with the group name:
+    ///     identity_distribution_by_<key>.csv, length_distribution_by_<key>.csv, summary_by_<key>.csv
+    void write_to_files(path output_dir) const;
+
+    /// Groups of the other instance are matched by name, since tag values may be interned in a different order
+    void operator+=(const GroupedMetrics& other);
+
+    void write_binary(ostream& o) const;
+    void read_binary(istream& i);
+};
+
+
+}
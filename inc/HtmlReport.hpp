@@ -0,0 +1,96 @@
+#pragma once
+
+#include "Filesystem.hpp"
+
+using ghc::filesystem::path;
+
+#include <utility>
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+using std::pair;
+
+
+namespace gfase {
+
+
+/// Line chart drawn as inline SVG. Each line is reduced to the first, last, lowest and highest point of every pixel
+/// column, so the size of the SVG depends on the width of the plot rather than on the number of points while the
+/// shape (including spikes) is unchanged. Labelled lines get their own color (and dash pattern, after the first 10)
+/// and a legend below the plot, unlabelled ones are all drawn in the first color.
+class SvgPlot {
+public:
+    static const int width;
+    // Without the legend
+    static const int height;
+
+private:
+    struct Marker {
+        double x;
+        string label;
+        // SVG stroke-dasharray, empty for a solid line
+        string dash;
+    };
+
+    struct Line {
+        vector<pair<double,double> > points;
+        string label;
+    };
+
+    string title;
+    string x_label;
+    string y_label;
+
+    vector<Line> lines;
+    vector<Marker> markers;
+
+    bool has_x_range;
+    double x_min;
+    double x_max;
+    bool has_y_range;
+    double y_min;
+    double y_max;
+
+public:
+    SvgPlot(const string& title, const string& x_label, const string& y_label);
+
+    /// Points in increasing order of x
+    void add_line(const vector<pair<double,double> >& points, const string& label="");
+
+    /// Vertical line across the plot, e.g. the mean, or the start of a contig
+    void add_marker(double x, const string& label, const string& dash="");
+
+    /// Otherwise the ranges are those of the data
+    void set_x_range(double min, double max);
+    void set_y_range(double min, double max);
+
+    /// The id is that of the clip path, which must be unique within a page
+    string to_svg(const string& id="plot") const;
+};
+
+
+/// Self-contained HTML page (no scripts or external resources) with a summary table and plots, one after another
+class HtmlReport {
+    string title;
+    string body;
+    size_t n_plots;
+
+public:
+    explicit HtmlReport(const string& title);
+
+    static string escape(const string& text);
+
+    void add_heading(const string& text);
+    void add_table(const vector<pair<string,string> >& rows);
+
+    /// Table with a header, the first column of each row is its name
+    void add_table(const vector<string>& header, const vector<vector<string> >& rows);
+    void add_plot(const SvgPlot& plot);
+
+    void write(path output_path) const;
+};
+
+
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+using std::unique_ptr;
+using std::vector;
+
+
+namespace gfase {
+
+
+/// Bump allocator for short strings (e.g. query names). Strings are copied back to back into fixed size chunks, so
+/// adding one is a memcpy, growing never moves what was added before, and everything is freed at once. Strings
+/// are not null terminated, callers keep their length.
+class NameArena {
+    vector<unique_ptr<char[]> > chunks;
+    uint64_t chunk_size;
+
+    // Bytes used in the last chunk
+    uint64_t position;
+
+public:
+    /// Strings must be shorter than the chunk size
+    NameArena(uint64_t chunk_size=1024*1024);
+
+    /// Returns the offset of the copy, which stays valid until clear()
+    uint64_t add(const char* s, uint64_t length);
+
+    const char* get(uint64_t offset) const;
+
+    /// Free every chunk
+    void clear();
+
+    uint64_t get_allocated_bytes() const;
+};
+
+
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <array>
+
+using std::string;
+using std::array;
+
+
+namespace gfase {
+
+
+/// Hardware counters (cycles, instructions, cache misses, branch misses) of the calling thread, user space only,
+/// through Linux perf_event_open. The events are opened as one group so that they are counted over the same
+/// intervals. Where the kernel allows it, counters are read with rdpmc from the mmapped event pages, which takes a few
+/// dozen cycles instead of a system call, so they can be read around every record.
+class PerfCounters {
+public:
+    static constexpr size_t n_events = 4;
+    static const array<string, n_events> event_names;
+
+    using Values = array<int64_t, n_events>;
+
+private:
+    array<int, n_events> fds;
+    array<void*, n_events> pages;
+
+    /// With rdpmc, false if the kernel does not allow it (or the event is not scheduled) right now
+    bool read_event(size_t i, int64_t& value) const;
+    void close_all();
+
+public:
+    /// Throws if the events cannot be opened (no PMU, e.g. in a VM, or kernel.perf_event_paranoid too high)
+    PerfCounters();
+    ~PerfCounters();
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    /// Running totals, only meaningful as differences. Must be called from the thread that created this. False if
+    /// the counters could not be read, in which case values are not meaningful and must not be used.
+    bool read(Values& values) const;
+};
+
+
+}
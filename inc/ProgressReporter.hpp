@@ -0,0 +1,70 @@
+#pragma once
+
+#include "Filesystem.hpp"
+
+using ghc::filesystem::path;
+
+#include <condition_variable>
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <mutex>
+
+using std::chrono::steady_clock;
+using std::condition_variable;
+using std::atomic;
+using std::thread;
+using std::mutex;
+
+
+namespace gfase {
+
+
+/// Background thread that periodically prints the records processed, the compressed MB/s, and an ETA to stderr, and
+/// optionally rewrites a small JSON status file (e.g. for a job scheduler). Progress is measured in compressed bytes,
+/// i.e. the BGZF block offset of the readers against the size of their input. Readers add what they did since their
+/// last call every so often, so the read loop only pays for a couple of relaxed atomic additions.
+class ProgressReporter {
+    int64_t total_bytes;
+    int64_t interval_ms;
+    path status_path;
+
+    atomic<int64_t> n_records;
+    atomic<int64_t> n_bytes;
+    // Done before this run (e.g. resumed from a checkpoint), not counted in the rate
+    atomic<int64_t> n_skipped_bytes;
+
+    steady_clock::time_point start;
+
+    mutex m;
+    condition_variable cv;
+    bool stopping;
+    thread reporter;
+
+    void run();
+    void report(bool done);
+    void stop();
+
+public:
+    /// Starts reporting right away, total_bytes is the compressed size of everything that will be read
+    ProgressReporter(int64_t total_bytes, int64_t interval_seconds, path status_path);
+
+    /// Stops the thread without a last report, e.g. when the run failed
+    ~ProgressReporter();
+
+    ProgressReporter(const ProgressReporter&) = delete;
+    ProgressReporter& operator=(const ProgressReporter&) = delete;
+
+    /// Thread safe, called by the readers
+    void add(int64_t records, int64_t bytes);
+
+    /// Bytes that will not be read in this run but count as done
+    void skip(int64_t bytes);
+
+    /// Stops the thread, with a last report that marks the status as done
+    void finish();
+};
+
+
+}
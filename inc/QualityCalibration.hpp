@@ -0,0 +1,46 @@
+#pragma once
+
+#include "Filesystem.hpp"
+#include "Sam.hpp"
+
+using ghc::filesystem::path;
+
+#include <iostream>
+#include <cstdint>
+#include <array>
+
+using std::istream;
+using std::ostream;
+using std::array;
+
+
+namespace gfase {
+
+
+/// Empirical base quality calibration: for each reported phred score, how many aligned bases were
+/// matches, mismatches or insertions. Counts are kept in flat fixed size arrays so that one instance
+/// can be kept per thread and combined with += at the end.
+class QualityCalibration {
+public:
+    /// One bin per possible byte value, so a raw BAM quality can index directly without clamping
+    static constexpr size_t n_bins = 256;
+
+    array<int64_t, n_bins> matches;
+    array<int64_t, n_bins> mismatches;
+    array<int64_t, n_bins> insertions;
+
+    QualityCalibration();
+
+    /// Walk the cigar alongside the base qualities, requires the element to have been loaded with qualities
+    void add_alignment(const SamElement& e);
+
+    void operator+=(const QualityCalibration& other);
+
+    void write_to_csv(path output_path) const;
+
+    void write_binary(ostream& o) const;
+    void read_binary(istream& i);
+};
+
+
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "Filesystem.hpp"
+
+using ghc::filesystem::path;
+
+#include <unordered_map>
+#include <cstdint>
+#include <map>
+
+using std::unordered_map;
+using std::map;
+
+
+namespace gfase {
+
+
+/// What can be said about reads before they are aligned (from an unaligned BAM or a FASTQ): lengths and base
+/// qualities only. A read's quality is the Phred scaled mean of its per-base error probabilities (as reported by
+/// basecallers), not the mean of its Phred scores.
+class ReadMetrics {
+    unordered_map<size_t, int64_t> length_distribution;
+
+    // Reads by mean quality, in bins of 0.1 (key 123 is [12.3, 12.4))
+    map<int64_t, int64_t> read_quality_distribution;
+
+    int64_t n_reads_with_qualities;
+    int64_t n_bases_with_qualities;
+    double error_sum;
+
+public:
+    ReadMetrics();
+
+    /// Phred scores (not ASCII), null if the read has none
+    void add_read(int64_t length, const uint8_t* qualities);
+
+    void operator+=(const ReadMetrics& other);
+
+    /// length_distribution.csv, read_quality_distribution.csv, summary.csv and report.html, in an existing directory
+    void write_outputs(path output_dir) const;
+};
+
+
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "SampleMetrics.hpp"
+#include "Filesystem.hpp"
+#include "ShardPlan.hpp"
+#include "Bam.hpp"
+
+using ghc::filesystem::path;
+
+#include <iostream>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using std::istream;
+using std::string;
+using std::vector;
+
+
+namespace gfase {
+
+
+/// Everything needed to restart an interrupted run: the BAM it was for, the range of records it covers, where to
+/// continue reading, and the state of every output directory (just the run's own unless demultiplexing, one per
+/// value of the split tag). The range is checked when resuming, so that a checkpoint is never continued over
+/// another BAM or shard.
+class RunCheckpoint {
+public:
+    /// Written to the output directory of the run
+    static const string filename;
+
+    int64_t bam_size;
+
+    // Records [begin_offset, end_offset) as BGZF virtual offsets, see ShardPlan::Shard. The whole BAM starts at its
+    // first record and ends at -1 (the end of the file), and an empty shard starts at -1.
+    int64_t begin_offset;
+    int64_t end_offset;
+
+    // Next record to read, -1 if there is nothing (more) to read
+    int64_t next_offset;
+
+    // Split tag value of each output directory, in the order of the metrics that follow
+    vector<string> values;
+
+    /// A new run over the whole BAM or one shard of it (if not null). The reader is moved to the start of the range.
+    static RunCheckpoint start(Bam& bam_reader, int64_t bam_size, const ShardPlan::Shard* shard);
+
+    /// Continue from where the reader is now
+    void update(const Bam& bam_reader);
+
+    /// Move the reader to where the run stopped, only the rest of the range is read
+    void seek(Bam& bam_reader) const;
+
+    /// Whether this checkpoint can be continued by a run over the other's BAM and range
+    bool is_same_range(const RunCheckpoint& other) const;
+
+    /// Written to a temporary file and renamed, so a preemption while writing leaves the previous checkpoint intact
+    void write(path output_dir, vector<SampleMetrics>& metrics) const;
+
+    /// The metrics follow in the stream, see SampleMetrics::read_checkpoint()
+    static RunCheckpoint read(istream& i, path checkpoint_path);
+};
+
+
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "PerfCounters.hpp"
+#include "Filesystem.hpp"
+
+using ghc::filesystem::path;
+
+#include <cstdint>
+#include <chrono>
+#include <memory>
+#include <utility>
+#include <string>
+#include <vector>
+#include <deque>
+
+using std::chrono::steady_clock;
+using std::unique_ptr;
+using std::string;
+using std::pair;
+using std::vector;
+using std::deque;
+
+
+namespace gfase {
+
+
+/// Wall/CPU time per named stage of a run, plus counters, written as JSON (run_stats.json) when the run is done.
+/// Not thread safe: each thread that processes a BAM keeps its own.
+class RunStats {
+public:
+    struct Stage {
+        string name;
+        int64_t wall_ns = 0;
+        int64_t cpu_ns = 0;
+        int64_t n_calls = 0;
+        // Per-record stages only look at the wall clock, CPU time of the process is a system call
+        bool has_cpu = false;
+
+        // Hardware counters of the thread, if enabled, summed over the calls where they could be read at both ends
+        const PerfCounters* perf = nullptr;
+        PerfCounters::Values counters = {};
+        int64_t n_calls_without_counters = 0;
+    };
+
+private:
+    // Deque so that references to stages stay valid as more are added
+    deque<Stage> stages;
+    vector<pair<string, int64_t> > counts;
+
+    steady_clock::time_point start;
+    int64_t start_cpu_ns;
+
+    unique_ptr<PerfCounters> perf;
+
+public:
+    RunStats();
+
+    /// Count cycles, instructions, cache misses and branch misses in every stage, from the calling thread (which
+    /// must be the one that runs the timed code). Throws if the counters are not available.
+    void enable_perf_counters();
+
+    /// Created on first use, stages are written in that order
+    Stage& get_stage(const string& name);
+
+    void set_count(const string& name, int64_t value);
+
+    double get_wall_seconds() const;
+
+    /// User + system time of the whole process (i.e. including decompression threads and, with --manifest, the
+    /// other samples)
+    static int64_t get_process_cpu_ns();
+    static int64_t get_peak_rss_bytes();
+
+    /// Totals since construction, peak RSS, each count and its rate per wall second, and every stage (with its
+    /// hardware counters, their IPC, and per million of the "records" count if there is one)
+    void write_json(path output_path) const;
+};
+
+
+/// Adds the time from construction to destruction to a stage, does nothing if the stage is null (stats disabled)
+class ScopedTimer {
+    RunStats::Stage* stage;
+    bool measure_cpu;
+    steady_clock::time_point start;
+    int64_t start_cpu_ns;
+    PerfCounters::Values start_counters;
+    bool has_start_counters;
+
+public:
+    explicit ScopedTimer(RunStats::Stage* stage, bool measure_cpu=false);
+    ~ScopedTimer();
+
+    /// Add the time so far and stop, e.g. before the end of the scope
+    void stop();
+
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+};
+
+
+}
@@ -25,9 +25,12 @@ public:
     string query_name;
     string ref_name;
     vector<uint32_t> cigars;
+    vector<uint8_t> qualities;
+    vector<string> tags;
     int32_t query_length;
     uint16_t flag;
     uint8_t mapq;
+    int32_t ref_id;
     int32_t start_pos;
 
     SamElement();
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "DistributionSummary.hpp"
+#include "Filesystem.hpp"
+
+using ghc::filesystem::path;
+
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+
+namespace gfase {
+
+
+/// Side by side statistics and overlaid distributions of several samples (e.g. flow cells, or basecaller versions),
+/// replacing make_plots_multisamples.R. The first sample is the baseline of the difference in QV.
+class SampleComparison {
+    vector<string> names;
+    vector<DistributionSummary> summaries;
+
+public:
+    SampleComparison();
+
+    void add_sample(const string& name, const DistributionSummary& summary);
+
+    /// comparison.csv and compare.html, in an existing directory
+    void write(path output_dir) const;
+};
+
+
+}
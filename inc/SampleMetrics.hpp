@@ -0,0 +1,171 @@
+#pragma once
+
+#include "AlignmentSummaryStore.hpp"
+#include "QualityCalibration.hpp"
+#include "WindowedIdentity.hpp"
+#include "GroupedMetrics.hpp"
+#include "CoverageTrack.hpp"
+#include "Filesystem.hpp"
+#include "RunStats.hpp"
+#include "Bam.hpp"
+
+using ghc::filesystem::path;
+
+#include <unordered_map>
+#include <iostream>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+using std::unordered_map;
+using std::unique_ptr;
+using std::shared_ptr;
+using std::istream;
+using std::ostream;
+using std::string;
+using std::vector;
+
+
+namespace gfase {
+
+
+/// Everything wam accumulates for one set of reads (a BAM, or one barcode of a BAM) and the files it writes
+class SampleMetrics {
+public:
+    struct Options {
+        int64_t max_indel_length = 50;
+        bool write_coverage = false;
+        int64_t window_size = 10000;
+        vector<string> group_keys;
+
+        // Memory for the alignment summaries, shared with every other SampleMetrics given the same budget. Not
+        // part of the state, since it is a property of the process rather than of the results.
+        shared_ptr<AlignmentSummaryStore::Budget> summary_budget;
+
+        // Compresses the bgzipped outputs if not null, not part of the state either
+        htsThreadPool* thread_pool = nullptr;
+
+        // Optional copies of the alignment summary TSV (bgzipped BED with a tabix index, and Arrow), each of which
+        // writes every alignment once more. Not part of the state, 'wam merge' chooses them again.
+        bool write_bed_gz = false;
+        bool write_arrow = false;
+    };
+
+    using AlignmentSummary = Bam::AlignmentSummary;
+
+    /// Every run writes its full state in this file in the output directory, see write_state()
+    static const string state_filename;
+
+    /// Alignments below this mapping quality (and secondary ones) are only counted as reads, so their CIGAR and
+    /// qualities need not be loaded (see Bam::set_detail_filter)
+    static const uint8_t min_mapq;
+
+private:
+    Options options;
+    vector<string> ref_names;
+    vector<int64_t> ref_lengths;
+    path output_dir;
+
+    unordered_map<double, int64_t> identity_distribution;
+    unordered_map<size_t, int64_t> length_distribution;
+    // Alignment summaries by unique key, spilled to disk (in the output directory) when over the budget
+    AlignmentSummaryStore alignment_summaries;
+    QualityCalibration quality_calibration;
+    vector<GroupedMetrics> grouped_metrics;
+    unique_ptr<WindowedIdentity> windowed_identity;
+
+    // Optional depth track, streamed out as we go if the BAM is sorted
+    unique_ptr<CoverageTrack> coverage;
+
+    // Coverage tracks of the runs this was loaded/merged from, summed into a new track by write_outputs()
+    vector<path> coverage_sources;
+
+    // Optional timing, with the per-record stages looked up once
+    RunStats* stats;
+    RunStats::Stage* cigar_stage;
+    RunStats::Stage* aggregate_stage;
+
+    /// report.html (plots of the distributions and the genome-wide identity) and summary.csv
+    void write_report(path directory) const;
+
+    /// Magic, version and everything needed to construct the metrics, throws if the state cannot be read
+    static void read_header(istream& i, Options& options, vector<string>& ref_names, vector<int64_t>& ref_lengths);
+
+    /// The state up to the alignment summaries, which states and checkpoints store differently
+    void write_accumulators(ostream& o) const;
+    static SampleMetrics read_accumulators(istream& i, path output_dir,
+                                           shared_ptr<AlignmentSummaryStore::Budget> summary_budget);
+
+public:
+    /// The output directory must exist already, the coverage track (if any) is opened immediately
+    SampleMetrics(const Options& options, const vector<string>& ref_names, const vector<int64_t>& ref_lengths,
+                  bool sorted, path output_dir);
+
+    /// Aux tags that Bam needs to load for the group keys, GroupedMetrics expects them first and in this order
+    static vector<string> get_required_tags(const Options& options);
+
+    /// Time the "cigar" and "aggregate" stages of add_alignment() and the "write" and "bed_gz" stages of the outputs
+    /// in stats (null to disable), which must outlive this
+    void set_run_stats(RunStats* stats);
+
+    /// Compress the bgzipped outputs with this pool (null to compress on the calling thread), which must outlive this.
+    /// Needed after loading a state or checkpoint, which do not include the pool.
+    void set_thread_pool(htsThreadPool* pool);
+
+    void add_alignment(const SamElement& e);
+
+    /// Writes every output file, plus the binary state
+    void write_outputs();
+
+    /// Which optional copies of the alignment summary to write, see Options. Needed after loading a state or
+    /// checkpoint, which do not include them.
+    void set_summary_formats(bool write_bed_gz, bool write_arrow);
+
+    /// Every output except the coverage track (which is only complete at the end). Without the alignments, only the
+    /// outputs whose size does not grow with the number of alignments are written: not the alignment summaries or
+    /// the state.
+    void write_summaries(path directory, bool with_alignments=true) const;
+
+    /// Write the outputs that do not grow with the number of alignments to a temporary directory and move them over
+    /// the previous ones one by one, so that the outputs of a run that is still going can be read at any time. The
+    /// alignment summaries and the state are only written by write_outputs(), since rewriting them with every
+    /// snapshot would cost as much as all the snapshots so far.
+    void write_snapshot() const;
+
+    /// Combine with the results of another run over the same references with the same options. Duplicate
+    /// alignments (same unique key) are only kept once, as within a single run. Coverage is only kept if both
+    /// runs wrote it.
+    void operator+=(const SampleMetrics& other);
+
+    /// Versioned binary dump of all the accumulators (the coverage track is streamed to its own file and is not
+    /// included), from which the text outputs can be regenerated or combined with other runs
+    void write_state(path state_path) const;
+    void write_state(ostream& o) const;
+
+    /// Read a state file written by write_state(), outputs will go to output_dir. If the run wrote coverage, its
+    /// track is expected next to the state file.
+    static SampleMetrics load_state(path state_path, path output_dir,
+                                    shared_ptr<AlignmentSummaryStore::Budget> summary_budget=nullptr);
+    static SampleMetrics read_state(istream& i, path output_dir,
+                                    shared_ptr<AlignmentSummaryStore::Budget> summary_budget=nullptr);
+
+    /// Only the identity and read length histograms of a state file, e.g. to compare samples without loading
+    /// their alignment summaries
+    static void load_distributions(path state_path, unordered_map<double,int64_t>& identity_distribution,
+                                   unordered_map<size_t,int64_t>& length_distribution);
+
+    /// State plus the position in the coverage track, so that an interrupted run can continue where it was. The
+    /// alignment summaries are spilled and referred to by their run files in the output directory (see
+    /// AlignmentSummaryStore::write_checkpoint), which are kept until discard_checkpoint().
+    bool can_checkpoint() const;
+    void write_checkpoint(ostream& o);
+    static SampleMetrics read_checkpoint(istream& i, path output_dir,
+                                         shared_ptr<AlignmentSummaryStore::Budget> summary_budget=nullptr);
+
+    /// Call once the checkpoint file is removed (the run completed), so its spill files are deleted with the metrics
+    void discard_checkpoint();
+};
+
+
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "Filesystem.hpp"
+
+using ghc::filesystem::path;
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+
+namespace gfase {
+
+
+/// Split of one BAM into contiguous ranges of records given as BGZF virtual offsets, so that independent processes
+/// (e.g. on different nodes) can each read one range and their states can be merged afterwards. Every record
+/// belongs to exactly one shard, in file order.
+class ShardPlan {
+public:
+    /// Records in [begin, end). An end of -1 means the end of the file, a begin of -1 an empty shard at the end
+    struct Shard {
+        int64_t begin;
+        int64_t end;
+    };
+
+private:
+    path bam_path;
+    int64_t bam_size;
+    vector<Shard> shards;
+
+    /// Virtual offset of the first record starting in the first BGZF block at or after a compressed offset that has
+    /// one, or -1 if there is none before the end of the file. Candidate positions are accepted if they parse as a
+    /// chain of plausible records. Throws if the blocks cannot be read.
+    static int64_t find_record_start(path bam_path, int64_t compressed_offset, int32_t n_targets);
+
+public:
+    ShardPlan();
+
+    /// Shards of about the same number of records if the BAM is indexed (using the index statistics and the
+    /// offsets of the bins), otherwise of about the same compressed size. Some shards may be empty.
+    static ShardPlan create(path bam_path, size_t n_shards);
+
+    static ShardPlan load(path plan_path);
+    void write(path plan_path) const;
+
+    size_t size() const;
+
+    /// Throws if the BAM is not (by size) the one the plan was made for
+    const Shard& get_shard(size_t index, path bam_path) const;
+};
+
+
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "htslib/include/htslib/thread_pool.h"
+#include "htslib/include/htslib/hts.h"
+#include "AsyncWriter.hpp"
+#include "Filesystem.hpp"
+
+using ghc::filesystem::path;
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+using std::unique_ptr;
+using std::string;
+using std::vector;
+
+
+namespace gfase {
+
+
+/// Writes sorted BED-like lines to a bgzipped file and builds its tabix index (<path>.tbi) as it goes, without a
+/// second pass over the file. Blocks are compressed by the htslib thread pool (if given) and written in order, and
+/// the index entries of a block are pushed once its compressed address is known. Lines never span two blocks.
+class TabixWriter {
+    struct Entry {
+        int32_t ref_id;
+        int32_t start;
+        int32_t end;
+        // End of the line within the uncompressed block
+        uint32_t block_offset;
+    };
+
+    struct Block {
+        string data;
+        vector<Entry> entries;
+        string compressed;
+        int compression_level;
+        bool failed;
+    };
+
+    path output_path;
+    vector<string> ref_names;
+    int compression_level;
+    AsyncWriter file;
+
+    hts_tpool* pool;
+    hts_tpool_process* queue;
+    int64_t queue_size;
+    int64_t n_in_flight;
+
+    // Being filled
+    unique_ptr<Block> block;
+
+    // Bytes written so far, i.e. the address of the next block
+    int64_t address;
+
+    hts_idx_t* index;
+    bool has_records;
+    bool closed;
+
+    static void* compress(void* block);
+    void dispatch();
+    void write_next_result(bool wait);
+    void write_block(Block& b);
+    void set_index_meta();
+
+public:
+    /// Records refer to references by their index in ref_names. The pool may be null to compress on this thread.
+    TabixWriter(path output_path, const vector<string>& ref_names, htsThreadPool* pool, int compression_level=6);
+    ~TabixWriter();
+
+    TabixWriter(const TabixWriter&) = delete;
+    TabixWriter& operator=(const TabixWriter&) = delete;
+
+    /// Header line, must start with '#' and come before any record
+    void write_meta(const string& line);
+
+    /// One line (without its newline) covering [start, end) of a reference, in order of reference then start
+    void write_record(int32_t ref_id, int32_t start, int32_t end, const string& line);
+
+    /// Writes the last blocks, the EOF marker and the index
+    void close();
+};
+
+
+}
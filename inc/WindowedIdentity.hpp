@@ -0,0 +1,64 @@
+#pragma once
+
+#include "Filesystem.hpp"
+#include "Sam.hpp"
+
+using ghc::filesystem::path;
+
+#include <functional>
+#include <iostream>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using std::function;
+using std::istream;
+using std::ostream;
+using std::string;
+using std::vector;
+
+
+namespace gfase {
+
+
+/// Matches, nonmatches and aligned bases pooled over fixed size windows of the reference. Gives a genome
+/// wide identity/depth track whose size depends on the genome and window size rather than the number of reads.
+class WindowedIdentity {
+public:
+    struct Window {
+        int64_t matches = 0;
+        int64_t nonmatches = 0;
+        // Reference bases covered by =, X or D operations, divided by the window length this is the mean depth
+        int64_t covered_bases = 0;
+    };
+
+private:
+    vector<string> ref_names;
+    vector<int64_t> ref_lengths;
+    int64_t window_size;
+
+    // Windows of each contig, allocated the first time an alignment lands on the contig
+    vector<vector<Window> > windows;
+
+    vector<Window>& get_contig(int32_t ref_id);
+
+public:
+    WindowedIdentity(const vector<string>& ref_names, const vector<int64_t>& ref_lengths, int64_t window_size);
+
+    /// Walk the cigar of one alignment, using the same indel length threshold as the per alignment identity
+    void add_alignment(const SamElement& e, int64_t max_indel_length);
+
+    void operator+=(const WindowedIdentity& other);
+
+    /// Windows with coverage, in order of reference and position
+    void for_each_window(const function<void(int32_t ref_id, int64_t start, int64_t end, const Window& window)>& f) const;
+
+    void write_to_bedgraph(path output_path) const;
+
+    /// Only the windows are stored, the references and window size must match the instance being read into
+    void write_binary(ostream& o) const;
+    void read_binary(istream& i);
+};
+
+
+}
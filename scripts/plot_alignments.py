@@ -10,7 +10,13 @@ def main(input_path, output_dir):
 	if not os.path.exists(output_dir):
 		os.makedirs(output_dir)
 
-	alnSummary = pd.read_csv(input_path, sep="\t", skiprows=[1])
+	if input_path.endswith(".arrow"):
+		# columnar output, memory mapped instead of parsed
+		alnSummary = pd.read_feather(input_path, columns=["chr", "start_pos", "end_pos", "identity"])
+		alnSummary = alnSummary.rename(columns={"chr": "#chr"})
+		alnSummary["#chr"] = alnSummary["#chr"].astype(str)
+	else:
+		alnSummary = pd.read_csv(input_path, sep="\t", skiprows=[1])
 
 	# plot alignment positions colored by idy
 	plt.figure(figsize=(16, 8))
@@ -20,11 +26,10 @@ def main(input_path, output_dir):
 	chromosomes = sorted(alnSummary['#chr'].unique(), key=lambda x: (int(x[3:]) if x[3:].isdigit() else float('inf')))
 	chrom_map = {chrom: i+1 for i, chrom in enumerate(chromosomes)}
 
-	# plot lines for each position
-	for _, row in alnSummary.iterrows():
-	    plt.plot([row['start_pos'], row['end_pos']],
-	             [chrom_map[row['#chr']], chrom_map[row['#chr']]], 
-	             color=plt.cm.viridis(row['identity']), linewidth=10, alpha=1)
+	# plot lines for each position, in a single call so that large inputs stay fast
+	plt.hlines(y=alnSummary['#chr'].map(chrom_map),
+	           xmin=alnSummary['start_pos'], xmax=alnSummary['end_pos'],
+	           colors=plt.cm.viridis(alnSummary['identity'].to_numpy()), linewidth=10, alpha=1)
 
 	# labels
 	plt.gca().invert_yaxis()
@@ -45,7 +50,8 @@ if __name__ == "__main__":
         "-a","--alignment_summary",
         required=True,
         type=str,
-        help="Input file of alignment_summary.tsv"
+        help="Input file of alignment_summary.tsv or alignment_summary.arrow (much faster to load), or "
+             "windowed_identity.bedGraph for a binned genome-wide view"
     )
 
     parser.add_argument(
@@ -0,0 +1,645 @@
+#include "AlignmentSummaryStore.hpp"
+#include "AsyncWriter.hpp"
+#include "TabixWriter.hpp"
+#include "ArrowWriter.hpp"
+#include "BinaryIO.hpp"
+
+using ghc::filesystem::directory_iterator;
+using ghc::filesystem::exists;
+using ghc::filesystem::remove;
+
+#include <algorithm>
+#include <stdexcept>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <utility>
+#include <queue>
+
+#include <unistd.h>
+
+using std::priority_queue;
+using std::runtime_error;
+using std::stringstream;
+using std::to_string;
+using std::ifstream;
+using std::sort;
+
+
+namespace gfase {
+
+
+// Unique across all the stores of the process, several of them may spill into the same directory
+static atomic<uint64_t> n_spilled_runs(0);
+
+static const string run_prefix = ".alignment_summaries.";
+static const string run_suffix = ".spill";
+
+// A store that goes over the budget only spills once it holds at least this much, so that small stores sharing a
+// budget with large ones don't spill a handful of records at a time
+static const int64_t min_spill_size = 16*1024*1024;
+
+
+AlignmentSummaryStore::Budget::Budget(int64_t limit):
+        limit(limit),
+        used(0)
+{}
+
+
+AlignmentSummaryStore::AlignmentSummaryStore(const vector<string>& ref_names, path spill_dir, shared_ptr<Budget> budget):
+        ref_names(ref_names),
+        spill_dir(spill_dir),
+        budget(budget),
+        names(),
+        summaries(),
+        table(),
+        runs(),
+        n_checkpointed_runs(0),
+        accounted(0)
+{}
+
+
+AlignmentSummaryStore::AlignmentSummaryStore(AlignmentSummaryStore&& other) noexcept:
+        ref_names(std::move(other.ref_names)),
+        spill_dir(std::move(other.spill_dir)),
+        budget(std::move(other.budget)),
+        names(std::move(other.names)),
+        summaries(std::move(other.summaries)),
+        table(std::move(other.table)),
+        runs(std::move(other.runs)),
+        n_checkpointed_runs(other.n_checkpointed_runs),
+        accounted(other.accounted)
+{
+    other.runs.clear();
+    other.n_checkpointed_runs = 0;
+    other.accounted = 0;
+}
+
+
+AlignmentSummaryStore::~AlignmentSummaryStore(){
+    if (budget){
+        budget->used -= accounted;
+    }
+
+    for (size_t i=n_checkpointed_runs; i<runs.size(); i++){
+        std::error_code error;
+        remove(runs[i], error);
+    }
+}
+
+
+using AlignmentSummary = AlignmentSummaryStore::AlignmentSummary;
+
+
+/// Comparison in the output order, returns 0 for two summaries of the same alignment
+static int compare(const AlignmentSummary& a, const char* a_name, const AlignmentSummary& b, const char* b_name){
+    // Unmapped (-1) sorts last
+    if (a.ref_id != b.ref_id) return (uint32_t(a.ref_id) < uint32_t(b.ref_id)) ? -1 : 1;
+    if (a.start != b.start) return (a.start < b.start) ? -1 : 1;
+    if (a.end != b.end) return (a.end < b.end) ? -1 : 1;
+
+    int c = memcmp(a_name, b_name, std::min(a.name_length, b.name_length));
+    if (c != 0) return c;
+    if (a.name_length != b.name_length) return (a.name_length < b.name_length) ? -1 : 1;
+
+    if (a.matches != b.matches) return (a.matches < b.matches) ? -1 : 1;
+    if (a.nonmatches != b.nonmatches) return (a.nonmatches < b.nonmatches) ? -1 : 1;
+
+    return 0;
+}
+
+
+// Slots hold the summary index + 1 in these bits, and the high bits of the hash in the others
+static const uint64_t index_mask = (uint64_t(1) << 40) - 1;
+
+
+static uint64_t mix(uint64_t x){
+    // splitmix64 finalizer
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111eb;
+    x ^= x >> 31;
+    return x;
+}
+
+
+/// Hash of the fields that identify an alignment, consistent with compare()
+static uint64_t hash_summary(const AlignmentSummary& s, const char* name){
+    uint64_t h = mix(uint64_t(uint32_t(s.ref_id)) << 32 | uint32_t(s.start));
+    h = mix(h ^ (uint64_t(uint32_t(s.end)) << 32 | s.matches));
+    h = mix(h ^ (uint64_t(s.nonmatches) << 8 | s.name_length));
+
+    for (uint64_t i=0; i<s.name_length; i+=8){
+        uint64_t x = 0;
+        memcpy(&x, name + i, std::min(uint64_t(8), uint64_t(s.name_length) - i));
+        h = mix(h ^ x);
+    }
+
+    return h;
+}
+
+
+void AlignmentSummaryStore::rebuild_table(size_t n_slots) const{
+    table.assign(n_slots, 0);
+    uint64_t slot_mask = n_slots - 1;
+
+    for (uint64_t i=0; i<summaries.size(); i++){
+        auto& s = summaries[i];
+        uint64_t h = hash_summary(s, names.get(s.name_offset));
+
+        uint64_t slot = h & slot_mask;
+        while (table[slot] != 0){
+            slot = (slot + 1) & slot_mask;
+        }
+
+        table[slot] = (h & ~index_mask) | (i + 1);
+    }
+}
+
+
+void AlignmentSummaryStore::sort_summaries() const{
+    sort(summaries.begin(), summaries.end(), [&](const AlignmentSummary& a, const AlignmentSummary& b){
+        return compare(a, names.get(a.name_offset), b, names.get(b.name_offset)) < 0;
+    });
+
+    if (not table.empty()){
+        rebuild_table(table.size());
+    }
+}
+
+
+void AlignmentSummaryStore::update_budget(){
+    // Capacity rather than size, that is what is actually allocated
+    int64_t used = int64_t(names.get_allocated_bytes() + summaries.capacity()*sizeof(AlignmentSummary) +
+                           table.capacity()*sizeof(uint64_t));
+
+    if (not budget){
+        accounted = used;
+        return;
+    }
+
+    budget->used += used - accounted;
+    accounted = used;
+
+    if (budget->limit > 0 and budget->used > budget->limit and accounted >= min_spill_size){
+        spill();
+    }
+}
+
+
+void AlignmentSummaryStore::add(AlignmentSummary summary, const string& query_name){
+    if (query_name.size() > 255){
+        throw runtime_error("ERROR: query name longer than 255 characters: " + query_name);
+    }
+
+    if (summaries.size() >= index_mask){
+        throw runtime_error("ERROR: too many alignment summaries in memory, use a memory budget to spill them");
+    }
+
+    summary.name_length = uint8_t(query_name.size());
+    summary.padding = 0;
+
+    // At most half full
+    if (2*(summaries.size() + 1) > table.size()){
+        rebuild_table(std::max(size_t(1024), 2*table.size()));
+    }
+
+    uint64_t h = hash_summary(summary, query_name.data());
+    uint64_t slot_mask = table.size() - 1;
+    uint64_t slot = h & slot_mask;
+
+    while (table[slot] != 0){
+        if ((table[slot] & ~index_mask) == (h & ~index_mask)){
+            auto& existing = summaries[(table[slot] & index_mask) - 1];
+
+            if (compare(existing, names.get(existing.name_offset), summary, query_name.data()) == 0){
+                summary.name_offset = existing.name_offset;
+                existing = summary;
+                return;
+            }
+        }
+
+        slot = (slot + 1) & slot_mask;
+    }
+
+    summary.name_offset = names.add(query_name.data(), query_name.size());
+    summaries.emplace_back(summary);
+    table[slot] = (h & ~index_mask) | summaries.size();
+
+    update_budget();
+}
+
+
+void AlignmentSummaryStore::spill(){
+    if (summaries.empty()){
+        return;
+    }
+
+    // Runs adopted from a checkpoint may have been written by an earlier process with the same pid
+    path run_path;
+    do {
+        run_path = spill_dir / (run_prefix + to_string(getpid()) + "." + to_string(n_spilled_runs++) + run_suffix);
+    } while (exists(run_path));
+
+    // Spilling happens in the middle of the read loop, so the writes overlap with copying the records out
+    AsyncWriter file(run_path);
+
+    if (not (file.is_open() and file.good())){
+        throw runtime_error("ERROR: could not write spill file: " + run_path.string());
+    }
+
+    runs.emplace_back(run_path);
+
+    sort_summaries();
+
+    for (auto summary: summaries){
+        const char* name = names.get(summary.name_offset);
+        summary.name_offset = 0;
+        file.write(reinterpret_cast<const char*>(&summary), sizeof(summary));
+        file.write(name, summary.name_length);
+    }
+
+    file.close();
+
+    if (not file.good()){
+        throw runtime_error("ERROR: could not write spill file: " + run_path.string());
+    }
+
+    // Release the memory, not just the contents
+    names.clear();
+    vector<AlignmentSummary>().swap(summaries);
+    vector<uint64_t>().swap(table);
+
+    update_budget();
+}
+
+
+/// Reads sorted unique summaries one at a time, either from a run file or from the sorted summaries of a store
+class SummarySource {
+    ifstream file;
+    const vector<AlignmentSummary>* summaries;
+    const NameArena* names;
+    size_t index;
+
+public:
+    AlignmentSummary summary;
+    string name;
+
+    SummarySource(path run_path):
+            file(run_path, std::ios::binary),
+            summaries(nullptr),
+            names(nullptr),
+            index(0),
+            summary(),
+            name()
+    {
+        if (not (file.is_open() and file.good())){
+            throw runtime_error("ERROR: could not read spill file: " + run_path.string());
+        }
+    }
+
+    SummarySource(const vector<AlignmentSummary>& summaries, const NameArena& names):
+            file(),
+            summaries(&summaries),
+            names(&names),
+            index(0),
+            summary(),
+            name()
+    {}
+
+    bool next(){
+        if (summaries != nullptr){
+            if (index == summaries->size()){
+                return false;
+            }
+
+            summary = (*summaries)[index++];
+            name.assign(names->get(summary.name_offset), summary.name_length);
+            return true;
+        }
+
+        // The name length is only known from the summary, so the name comes after it
+        file.read(reinterpret_cast<char*>(&summary), sizeof(summary));
+        if (file.gcount() == 0 and file.eof()){
+            return false;
+        }
+
+        name.resize(summary.name_length);
+        file.read(&name[0], summary.name_length);
+
+        if (not file.good()){
+            throw runtime_error("ERROR: truncated spill file");
+        }
+
+        return true;
+    }
+};
+
+
+void AlignmentSummaryStore::for_each_summary(const function<void(const AlignmentSummary& summary, const string& query_name)>& f) const{
+    sort_summaries();
+
+    // Runs are oldest first and the summaries in memory are the most recent
+    vector<std::unique_ptr<SummarySource> > sources;
+    for (auto& run: runs){
+        sources.emplace_back(std::make_unique<SummarySource>(run));
+    }
+    sources.emplace_back(std::make_unique<SummarySource>(summaries, names));
+
+    auto later = [&](size_t a, size_t b){
+        int c = compare(sources[a]->summary, sources[a]->name.data(), sources[b]->summary, sources[b]->name.data());
+        return (c != 0) ? c > 0 : a < b;
+    };
+
+    priority_queue<size_t, vector<size_t>, decltype(later)> queue(later);
+
+    for (size_t i=0; i<sources.size(); i++){
+        if (sources[i]->next()){
+            queue.emplace(i);
+        }
+    }
+
+    // The most recent summary of each alignment comes first, the others are skipped
+    bool has_previous = false;
+    AlignmentSummary previous;
+    string previous_name;
+
+    while (not queue.empty()){
+        auto i = queue.top();
+        queue.pop();
+
+        auto& source = *sources[i];
+
+        if (not (has_previous and compare(source.summary, source.name.data(), previous, previous_name.data()) == 0)){
+            f(source.summary, source.name);
+
+            has_previous = true;
+            previous = source.summary;
+            previous_name = source.name;
+        }
+
+        if (source.next()){
+            queue.emplace(i);
+        }
+    }
+}
+
+
+void AlignmentSummaryStore::operator+=(const AlignmentSummaryStore& other){
+    other.for_each_summary([&](const AlignmentSummary& summary, const string& query_name){
+        add(summary, query_name);
+    });
+}
+
+
+size_t AlignmentSummaryStore::get_n_runs() const{
+    return runs.size();
+}
+
+
+void AlignmentSummaryStore::write_tsv(path output_path, path bed_path) const{
+    AsyncWriter file(output_path);
+    if (!(file.is_open() && file.good())) {
+        throw runtime_error("ERROR: file could not be written: " + output_path.string());
+    }
+
+    // Written in the same pass, since reading the summaries back may mean merging spilled runs
+    std::unique_ptr<AsyncWriter> bed_file;
+    if (not bed_path.empty()){
+        bed_file = std::make_unique<AsyncWriter>(bed_path);
+        if (not (bed_file->is_open() and bed_file->good())){
+            throw runtime_error("ERROR: file could not be written: " + bed_path.string());
+        }
+    }
+
+    // write the header to the csv
+    file << "#chr" << "\tstart_pos" << "\tend_pos" << "\tidentity" << "\tmatches" << "\tnonmatches" << "\tlargeINDELs" << "\tlargeINDEL_total_length"
+                                                                << "\tinferred_len" << "\tmapq" << "\talignmentName" << "\n";
+
+    // add bedGraph header
+    file << "track type=bedGraph name=\"identity\" autoScale=on\n";
+
+    for_each_summary([&](const AlignmentSummary& s, const string& query_name){
+        write_row(file, s, query_name);
+        file << '\n';
+
+        if (bed_file){
+            write_row(*bed_file, s, query_name);
+            *bed_file << '\n';
+        }
+    });
+
+    file.close();
+
+    if (not file.good()){
+        throw runtime_error("ERROR: could not write alignment summary: " + output_path.string());
+    }
+
+    if (bed_file){
+        bed_file->close();
+
+        if (not bed_file->good()){
+            throw runtime_error("ERROR: could not write alignment summary: " + bed_path.string());
+        }
+    }
+}
+
+
+void AlignmentSummaryStore::write_row(ostream& o, const AlignmentSummary& s, const string& query_name) const{
+    static const string unknown_ref = "*";
+
+    auto& ref_name = (s.ref_id >= 0 and size_t(s.ref_id) < ref_names.size()) ? ref_names[s.ref_id] : unknown_ref;
+
+    o << ref_name << '\t'
+      << s.start << '\t'
+      << s.end << '\t'
+      << s.get_identity() << '\t'
+      << s.matches << '\t'
+      << s.nonmatches << '\t'
+      << s.indels << '\t'
+      << s.indel_length << '\t'
+      << s.inferred_length << '\t'
+      << int(s.mapq) << '\t';
+
+    // Unique alignment name: qname_ref_start_end_matches_nonmatches
+    o << query_name << '_' << ref_name << '_' << s.start << '_' << s.end << '_'
+      << s.matches << '_' << s.nonmatches;
+}
+
+
+void AlignmentSummaryStore::write_bed_gz(path output_path, htsThreadPool* pool) const{
+    // Summaries of unplaced references (none are expected) get their own name at the end of the index
+    vector<string> index_names = ref_names;
+    index_names.emplace_back("*");
+    int32_t unknown_ref_id = int32_t(ref_names.size());
+
+    TabixWriter writer(output_path, index_names, pool);
+
+    writer.write_meta("#chr\tstart_pos\tend_pos\tidentity\tmatches\tnonmatches\tlargeINDELs\tlargeINDEL_total_length"
+                      "\tinferred_len\tmapq\talignmentName");
+
+    // Same order as the index: reference in header order, then start
+    stringstream line;
+
+    for_each_summary([&](const AlignmentSummary& s, const string& query_name){
+        line.str("");
+        write_row(line, s, query_name);
+
+        bool placed = (s.ref_id >= 0 and size_t(s.ref_id) < ref_names.size());
+        writer.write_record(placed ? s.ref_id : unknown_ref_id, s.start, s.end, line.str());
+    });
+
+    writer.close();
+}
+
+
+void AlignmentSummaryStore::write_arrow(path output_path, size_t batch_size) const{
+    using Type = ArrowWriter::Type;
+
+    vector<string> dictionary = ref_names;
+    dictionary.emplace_back("*");
+    int64_t unknown_ref_id = int64_t(ref_names.size());
+
+    ArrowWriter writer(output_path, {
+            {"chr", Type::dictionary, dictionary},
+            {"start_pos", Type::int32, {}},
+            {"end_pos", Type::int32, {}},
+            {"identity", Type::float64, {}},
+            {"matches", Type::uint32, {}},
+            {"nonmatches", Type::uint32, {}},
+            {"largeINDELs", Type::uint32, {}},
+            {"largeINDEL_total_length", Type::uint32, {}},
+            {"inferred_len", Type::uint32, {}},
+            {"mapq", Type::uint8, {}},
+            {"query_name", Type::utf8, {}}
+    }, batch_size);
+
+    for_each_summary([&](const AlignmentSummary& s, const string& query_name){
+        bool placed = (s.ref_id >= 0 and size_t(s.ref_id) < ref_names.size());
+
+        writer.append_int(0, placed ? s.ref_id : unknown_ref_id);
+        writer.append_int(1, s.start);
+        writer.append_int(2, s.end);
+        writer.append_float(3, s.get_identity());
+        writer.append_int(4, s.matches);
+        writer.append_int(5, s.nonmatches);
+        writer.append_int(6, s.indels);
+        writer.append_int(7, s.indel_length);
+        writer.append_int(8, s.inferred_length);
+        writer.append_int(9, s.mapq);
+        writer.append_string(10, query_name);
+        writer.end_row();
+    });
+
+    writer.close();
+}
+
+
+void AlignmentSummaryStore::write_binary(ostream& o) const{
+    // The number of unique summaries is only known after the merge, so each one is preceded by a flag instead
+    for_each_summary([&](AlignmentSummary summary, const string& query_name){
+        // Offsets only mean something within a store, and identical results must give identical files
+        summary.name_offset = 0;
+
+        write_value(o, true);
+        write_value(o, summary);
+        o.write(query_name.data(), std::streamsize(query_name.size()));
+    });
+
+    write_value(o, false);
+}
+
+
+void AlignmentSummaryStore::read_binary(istream& i){
+    AlignmentSummary summary;
+    string query_name;
+
+    bool has_next;
+    read_value(i, has_next);
+
+    while (has_next){
+        read_value(i, summary);
+        query_name.resize(summary.name_length);
+        i.read(&query_name[0], summary.name_length);
+
+        if (not i.good()){
+            throw runtime_error("ERROR: unexpected end of binary file");
+        }
+
+        add(summary, query_name);
+
+        read_value(i, has_next);
+    }
+}
+
+
+void AlignmentSummaryStore::write_checkpoint(ostream& o){
+    spill();
+
+    // Names only, the runs stay in the spill directory
+    vector<string> run_names;
+    for (auto& run: runs){
+        run_names.emplace_back(run.filename().string());
+    }
+
+    write_strings(o, run_names);
+    n_checkpointed_runs = runs.size();
+}
+
+
+void AlignmentSummaryStore::read_checkpoint(istream& i){
+    if (not (summaries.empty() and runs.empty())){
+        throw runtime_error("ERROR: checkpoint can only be read into an empty alignment summary store");
+    }
+
+    vector<string> run_names;
+    read_strings(i, run_names);
+
+    for (auto& name: run_names){
+        path run_path = spill_dir / name;
+
+        if (not exists(run_path)){
+            throw runtime_error("ERROR: spill file of checkpoint is missing: " + run_path.string());
+        }
+
+        runs.emplace_back(run_path);
+    }
+
+    n_checkpointed_runs = runs.size();
+
+    remove_runs(spill_dir, runs);
+}
+
+
+void AlignmentSummaryStore::discard_checkpoint(){
+    n_checkpointed_runs = 0;
+}
+
+
+void AlignmentSummaryStore::remove_runs(path directory, const vector<path>& keep){
+    if (not exists(directory)){
+        return;
+    }
+
+    vector<path> stale;
+
+    for (auto& item: directory_iterator(directory)){
+        string name = item.path().filename().string();
+
+        bool is_run = name.size() > run_prefix.size() + run_suffix.size() and
+                      name.compare(0, run_prefix.size(), run_prefix) == 0 and
+                      name.compare(name.size() - run_suffix.size(), run_suffix.size(), run_suffix) == 0;
+
+        if (is_run and std::find(keep.begin(), keep.end(), item.path()) == keep.end()){
+            stale.emplace_back(item.path());
+        }
+    }
+
+    for (auto& run: stale){
+        remove(run);
+    }
+}
+
+
+}
@@ -0,0 +1,494 @@
+#include "ArrowWriter.hpp"
+
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+
+using std::runtime_error;
+
+
+namespace gfase {
+
+
+// Flatbuffers (and Arrow buffers) are little endian, and so is everything this is built for
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "ArrowWriter assumes a little endian host");
+
+static const char arrow_magic[8] = {'A','R','R','O','W','1','\0','\0'};
+static const uint32_t continuation_marker = 0xFFFFFFFF;
+
+// Enums of Schema.fbs, Message.fbs and File.fbs
+static const int16_t metadata_version_v5 = 4;
+static const uint8_t type_int = 2;
+static const uint8_t type_floating_point = 3;
+static const uint8_t type_utf8 = 5;
+static const int16_t precision_double = 2;
+static const uint8_t header_schema = 1;
+static const uint8_t header_dictionary_batch = 2;
+static const uint8_t header_record_batch = 3;
+
+
+static int64_t padded(int64_t n){
+    return (n + 7) & ~int64_t(7);
+}
+
+
+/// Minimal flatbuffers builder. As in the flatbuffers library the buffer is built back to front, children before
+/// their parents, and objects are referred to by their distance from the end of the buffer. Scalars are aligned
+/// relative to the end, which finish() pads to a multiple of 8 so that they are also aligned relative to the start.
+class FlatBufferBuilder {
+    string data;
+    uint32_t table_start;
+    vector<pair<uint16_t,uint32_t> > fields;
+
+    void pad(size_t n){
+        data.insert(0, n, '\0');
+    }
+
+    void align(size_t additional, size_t alignment){
+        pad((alignment - (data.size() + additional) % alignment) % alignment);
+    }
+
+    template <class T> void prepend(T value){
+        align(sizeof(T), sizeof(T));
+        data.insert(0, reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    void prepend_offset(uint32_t ref){
+        align(sizeof(uint32_t), sizeof(uint32_t));
+        prepend(uint32_t(data.size() + sizeof(uint32_t) - ref));
+    }
+
+public:
+    FlatBufferBuilder():
+            data(),
+            table_start(0),
+            fields()
+    {}
+
+    uint32_t size() const{
+        return uint32_t(data.size());
+    }
+
+    uint32_t add_string(const string& s){
+        align(s.size() + 1, sizeof(uint32_t));
+        data.insert(0, s.c_str(), s.size() + 1);
+        prepend(uint32_t(s.size()));
+        return size();
+    }
+
+    uint32_t add_offset_vector(const vector<uint32_t>& refs){
+        align(refs.size()*sizeof(uint32_t), sizeof(uint32_t));
+        for (auto r = refs.rbegin(); r != refs.rend(); ++r){
+            prepend_offset(*r);
+        }
+        prepend(uint32_t(refs.size()));
+        return size();
+    }
+
+    /// Structs of 8 byte aligned fields, already laid out in bytes
+    uint32_t add_struct_vector(const string& bytes, size_t n){
+        align(bytes.size(), 8);
+        data.insert(0, bytes);
+        prepend(uint32_t(n));
+        return size();
+    }
+
+    void start_table(){
+        table_start = size();
+        fields.clear();
+    }
+
+    template <class T> void add_field(uint16_t id, T value){
+        prepend(value);
+        fields.emplace_back(id, size());
+    }
+
+    void add_offset_field(uint16_t id, uint32_t ref){
+        prepend_offset(ref);
+        fields.emplace_back(id, size());
+    }
+
+    uint32_t end_table(){
+        // Placeholder for the offset to the vtable
+        prepend(int32_t(0));
+        uint32_t table = size();
+
+        uint16_t n_fields = 0;
+        for (auto& [id, ref]: fields){
+            n_fields = std::max(n_fields, uint16_t(id + 1));
+        }
+
+        // Offsets of the fields from the start of the table, 0 for absent ones (default value)
+        vector<uint16_t> vtable(2 + n_fields, 0);
+        vtable[0] = uint16_t(sizeof(uint16_t)*vtable.size());
+        vtable[1] = uint16_t(table - table_start);
+        for (auto& [id, ref]: fields){
+            vtable[2 + id] = uint16_t(table - ref);
+        }
+
+        for (auto v = vtable.rbegin(); v != vtable.rend(); ++v){
+            prepend(*v);
+        }
+
+        // The vtable precedes the table, at table - offset
+        int32_t vtable_offset = int32_t(size() - table);
+        memcpy(&data[size() - table], &vtable_offset, sizeof(vtable_offset));
+
+        return table;
+    }
+
+    string finish(uint32_t root){
+        align(sizeof(uint32_t), 8);
+        prepend_offset(root);
+        return data;
+    }
+};
+
+
+static uint32_t add_int_type(FlatBufferBuilder& b, int32_t bit_width, bool is_signed){
+    b.start_table();
+    b.add_field<int32_t>(0, bit_width);
+    b.add_field<uint8_t>(1, is_signed);
+    return b.end_table();
+}
+
+
+static uint32_t add_schema(FlatBufferBuilder& b, const vector<ArrowWriter::Column>& columns){
+    vector<uint32_t> fields;
+
+    for (auto& c: columns){
+        uint32_t name = b.add_string(c.name);
+        uint32_t children = b.add_offset_vector({});
+
+        uint8_t type_type;
+        uint32_t type;
+        uint32_t dictionary = 0;
+
+        switch (c.type){
+            case ArrowWriter::Type::int32: type_type = type_int; type = add_int_type(b, 32, true); break;
+            case ArrowWriter::Type::uint32: type_type = type_int; type = add_int_type(b, 32, false); break;
+            case ArrowWriter::Type::uint8: type_type = type_int; type = add_int_type(b, 8, false); break;
+            case ArrowWriter::Type::float64:
+                b.start_table();
+                b.add_field<int16_t>(0, precision_double);
+                type_type = type_floating_point;
+                type = b.end_table();
+                break;
+            case ArrowWriter::Type::utf8:
+            case ArrowWriter::Type::dictionary:
+                b.start_table();
+                type_type = type_utf8;
+                type = b.end_table();
+                break;
+        }
+
+        if (c.type == ArrowWriter::Type::dictionary){
+            uint32_t index_type = add_int_type(b, 32, true);
+
+            // Dictionaries are identified by the index of their column
+            b.start_table();
+            b.add_field<int64_t>(0, int64_t(fields.size()));
+            b.add_offset_field(1, index_type);
+            dictionary = b.end_table();
+        }
+
+        b.start_table();
+        b.add_offset_field(0, name);
+        b.add_field<uint8_t>(1, false);
+        b.add_field<uint8_t>(2, type_type);
+        b.add_offset_field(3, type);
+        if (dictionary != 0){
+            b.add_offset_field(4, dictionary);
+        }
+        b.add_offset_field(5, children);
+        fields.push_back(b.end_table());
+    }
+
+    uint32_t field_vector = b.add_offset_vector(fields);
+
+    b.start_table();
+    b.add_field<int16_t>(0, 0);
+    b.add_offset_field(1, field_vector);
+    return b.end_table();
+}
+
+
+/// Nodes are (length, null count) per column, buffers (offset in the body, length)
+static uint32_t add_record_batch(FlatBufferBuilder& b, int64_t length, const vector<pair<int64_t,int64_t> >& nodes,
+                                 const vector<pair<int64_t,int64_t> >& buffers){
+    auto to_bytes = [](const vector<pair<int64_t,int64_t> >& pairs){
+        string bytes(pairs.size()*2*sizeof(int64_t), '\0');
+        memcpy(&bytes[0], pairs.data(), bytes.size());
+        return bytes;
+    };
+
+    uint32_t node_vector = b.add_struct_vector(to_bytes(nodes), nodes.size());
+    uint32_t buffer_vector = b.add_struct_vector(to_bytes(buffers), buffers.size());
+
+    b.start_table();
+    b.add_field<int64_t>(0, length);
+    b.add_offset_field(1, node_vector);
+    b.add_offset_field(2, buffer_vector);
+    return b.end_table();
+}
+
+
+static string finish_message(FlatBufferBuilder& b, uint8_t header_type, uint32_t header, int64_t body_length){
+    b.start_table();
+    b.add_field<int16_t>(0, metadata_version_v5);
+    b.add_field<uint8_t>(1, header_type);
+    b.add_offset_field(2, header);
+    b.add_field<int64_t>(3, body_length);
+    return b.finish(b.end_table());
+}
+
+
+/// Lays out the buffers of one column in the body: validity (empty, there are no nulls), then the offsets of the
+/// strings if any, then the values
+static void add_column_buffers(const string& values, const vector<int32_t>* offsets,
+                               vector<pair<const char*,size_t> >& body, vector<pair<int64_t,int64_t> >& buffers,
+                               int64_t& body_length){
+    buffers.emplace_back(body_length, 0);
+
+    if (offsets != nullptr){
+        auto size = offsets->size()*sizeof(int32_t);
+        body.emplace_back(reinterpret_cast<const char*>(offsets->data()), size);
+        buffers.emplace_back(body_length, size);
+        body_length += padded(int64_t(size));
+    }
+
+    body.emplace_back(values.data(), values.size());
+    buffers.emplace_back(body_length, values.size());
+    body_length += padded(int64_t(values.size()));
+}
+
+
+ArrowWriter::ArrowWriter(path output_path, const vector<Column>& columns, size_t batch_size):
+        output_path(output_path),
+        columns(columns),
+        batch_size(batch_size),
+        file(output_path),
+        data(columns.size()),
+        n_rows(0),
+        dictionary_blocks(),
+        batch_blocks(),
+        closed(false)
+{
+    if (not (file.is_open() and file.good())){
+        throw runtime_error("ERROR: file could not be written: " + output_path.string());
+    }
+
+    for (size_t i=0; i<columns.size(); i++){
+        if (columns[i].type == Type::utf8){
+            data[i].offsets.push_back(0);
+        }
+    }
+
+    file.write(arrow_magic, sizeof(arrow_magic));
+
+    FlatBufferBuilder b;
+    uint32_t header = add_schema(b, columns);
+    write_message(finish_message(b, header_schema, header, 0), {});
+
+    write_dictionaries();
+}
+
+
+ArrowWriter::Block ArrowWriter::write_message(const string& metadata, const vector<pair<const char*,size_t> >& body){
+    static const char zeros[8] = {};
+
+    // Continuation marker and length, then the metadata padded so that the body starts 8 byte aligned
+    int32_t metadata_size = int32_t(padded(int64_t(metadata.size())));
+
+    Block block = {int64_t(file.tellp()), int32_t(2*sizeof(int32_t)) + metadata_size, 0};
+
+    file.write(reinterpret_cast<const char*>(&continuation_marker), sizeof(continuation_marker));
+    file.write(reinterpret_cast<const char*>(&metadata_size), sizeof(metadata_size));
+    file.write(metadata.data(), std::streamsize(metadata.size()));
+    file.write(zeros, metadata_size - std::streamsize(metadata.size()));
+
+    for (auto& [buffer, size]: body){
+        file.write(buffer, std::streamsize(size));
+        file.write(zeros, padded(int64_t(size)) - int64_t(size));
+        block.body_length += padded(int64_t(size));
+    }
+
+    if (not file.good()){
+        throw runtime_error("ERROR: could not write to file: " + output_path.string());
+    }
+
+    return block;
+}
+
+
+void ArrowWriter::write_dictionaries(){
+    for (size_t i=0; i<columns.size(); i++){
+        if (columns[i].type != Type::dictionary){
+            continue;
+        }
+
+        string values;
+        vector<int32_t> offsets = {0};
+        for (auto& s: columns[i].dictionary){
+            values += s;
+            offsets.push_back(int32_t(values.size()));
+        }
+
+        vector<pair<const char*,size_t> > body;
+        vector<pair<int64_t,int64_t> > buffers;
+        int64_t body_length = 0;
+        add_column_buffers(values, &offsets, body, buffers, body_length);
+
+        int64_t length = int64_t(columns[i].dictionary.size());
+
+        FlatBufferBuilder b;
+        uint32_t batch = add_record_batch(b, length, {{length, 0}}, buffers);
+
+        b.start_table();
+        b.add_field<int64_t>(0, int64_t(i));
+        b.add_offset_field(1, batch);
+        uint32_t header = b.end_table();
+
+        dictionary_blocks.push_back(write_message(finish_message(b, header_dictionary_batch, header, body_length), body));
+    }
+}
+
+
+void ArrowWriter::write_batch(){
+    vector<pair<const char*,size_t> > body;
+    vector<pair<int64_t,int64_t> > nodes;
+    vector<pair<int64_t,int64_t> > buffers;
+    int64_t body_length = 0;
+
+    for (size_t i=0; i<columns.size(); i++){
+        nodes.emplace_back(n_rows, 0);
+        add_column_buffers(data[i].values, columns[i].type == Type::utf8 ? &data[i].offsets : nullptr, body, buffers,
+                           body_length);
+    }
+
+    FlatBufferBuilder b;
+    uint32_t header = add_record_batch(b, n_rows, nodes, buffers);
+    batch_blocks.push_back(write_message(finish_message(b, header_record_batch, header, body_length), body));
+
+    for (size_t i=0; i<columns.size(); i++){
+        data[i].values.clear();
+        if (columns[i].type == Type::utf8){
+            data[i].offsets.resize(1);
+        }
+    }
+
+    n_rows = 0;
+}
+
+
+void ArrowWriter::append_int(size_t column, int64_t value){
+    auto& values = data[column].values;
+
+    switch (columns[column].type){
+        case Type::int32: {
+            int32_t v = int32_t(value);
+            values.append(reinterpret_cast<const char*>(&v), sizeof(v));
+            break;
+        }
+        case Type::uint32: {
+            uint32_t v = uint32_t(value);
+            values.append(reinterpret_cast<const char*>(&v), sizeof(v));
+            break;
+        }
+        case Type::uint8:
+            values += char(uint8_t(value));
+            break;
+        case Type::dictionary: {
+            if (value < 0 or size_t(value) >= columns[column].dictionary.size()){
+                throw runtime_error("ERROR: dictionary index out of range for column: " + columns[column].name);
+            }
+            int32_t v = int32_t(value);
+            values.append(reinterpret_cast<const char*>(&v), sizeof(v));
+            break;
+        }
+        default:
+            throw runtime_error("ERROR: column is not an integer column: " + columns[column].name);
+    }
+}
+
+
+void ArrowWriter::append_float(size_t column, double value){
+    if (columns[column].type != Type::float64){
+        throw runtime_error("ERROR: column is not a float column: " + columns[column].name);
+    }
+
+    data[column].values.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+
+void ArrowWriter::append_string(size_t column, const string& value){
+    if (columns[column].type != Type::utf8){
+        throw runtime_error("ERROR: column is not a string column: " + columns[column].name);
+    }
+
+    auto& d = data[column];
+    d.values += value;
+    d.offsets.push_back(int32_t(d.values.size()));
+}
+
+
+void ArrowWriter::end_row(){
+    n_rows++;
+
+    if (size_t(n_rows) >= batch_size){
+        write_batch();
+    }
+}
+
+
+void ArrowWriter::close(){
+    if (closed){
+        return;
+    }
+
+    if (n_rows > 0){
+        write_batch();
+    }
+
+    // End of stream, for readers that treat the file as a stream
+    int32_t eos[2] = {int32_t(continuation_marker), 0};
+    file.write(reinterpret_cast<const char*>(eos), sizeof(eos));
+
+    auto to_bytes = [](const vector<Block>& blocks){
+        // offset, metadata length, 4 bytes of padding, body length
+        string bytes(blocks.size()*24, '\0');
+        for (size_t i=0; i<blocks.size(); i++){
+            memcpy(&bytes[24*i], &blocks[i].offset, 8);
+            memcpy(&bytes[24*i + 8], &blocks[i].metadata_length, 4);
+            memcpy(&bytes[24*i + 16], &blocks[i].body_length, 8);
+        }
+        return bytes;
+    };
+
+    FlatBufferBuilder b;
+    uint32_t schema_table = add_schema(b, columns);
+    uint32_t dictionaries = b.add_struct_vector(to_bytes(dictionary_blocks), dictionary_blocks.size());
+    uint32_t batches = b.add_struct_vector(to_bytes(batch_blocks), batch_blocks.size());
+
+    b.start_table();
+    b.add_field<int16_t>(0, metadata_version_v5);
+    b.add_offset_field(1, schema_table);
+    b.add_offset_field(2, dictionaries);
+    b.add_offset_field(3, batches);
+    string footer = b.finish(b.end_table());
+
+    int32_t footer_size = int32_t(footer.size());
+    file.write(footer.data(), std::streamsize(footer.size()));
+    file.write(reinterpret_cast<const char*>(&footer_size), sizeof(footer_size));
+    file.write(arrow_magic, 6);
+    file.close();
+
+    if (not file.good()){
+        throw runtime_error("ERROR: could not write to file: " + output_path.string());
+    }
+
+    closed = true;
+}
+
+
+}
@@ -0,0 +1,223 @@
+#include "AsyncWriter.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+using std::unique_lock;
+using std::lock_guard;
+
+
+namespace gfase {
+
+
+AsyncWriter::OutputBuffer::OutputBuffer(AsyncWriter& writer):
+        writer(writer)
+{}
+
+
+void AsyncWriter::OutputBuffer::set_buffer(char* begin, size_t size){
+    setp(begin, begin + size);
+}
+
+
+size_t AsyncWriter::OutputBuffer::get_size() const{
+    return size_t(pptr() - pbase());
+}
+
+
+AsyncWriter::OutputBuffer::int_type AsyncWriter::OutputBuffer::overflow(int_type c){
+    if (not writer.submit()){
+        return traits_type::eof();
+    }
+
+    if (not traits_type::eq_int_type(c, traits_type::eof())){
+        *pptr() = traits_type::to_char_type(c);
+        pbump(1);
+    }
+
+    return traits_type::not_eof(c);
+}
+
+
+std::streamsize AsyncWriter::OutputBuffer::xsputn(const char* s, std::streamsize n){
+    std::streamsize n_written = 0;
+
+    while (n_written < n){
+        auto available = epptr() - pptr();
+
+        if (available == 0){
+            if (not writer.submit()){
+                break;
+            }
+            continue;
+        }
+
+        auto length = std::min(available, n - n_written);
+        memcpy(pptr(), s + n_written, size_t(length));
+        pbump(int(length));
+        n_written += length;
+    }
+
+    return n_written;
+}
+
+
+int AsyncWriter::OutputBuffer::sync(){
+    return writer.submit() ? 0 : -1;
+}
+
+
+AsyncWriter::OutputBuffer::pos_type AsyncWriter::OutputBuffer::seekoff(off_type off, std::ios_base::seekdir dir,
+                                                                       std::ios_base::openmode which){
+    // Only tellp() is supported
+    if (off != 0 or dir != std::ios_base::cur or not (which & std::ios_base::out)){
+        return pos_type(off_type(-1));
+    }
+
+    return pos_type(off_type(writer.n_submitted + int64_t(get_size())));
+}
+
+
+AsyncWriter::AsyncWriter(path output_path, size_t buffer_size, size_t n_buffers):
+        ostream(nullptr),
+        output_path(output_path),
+        fd(-1),
+        buffer_size(buffer_size),
+        storage(),
+        buffer(*this),
+        queue(),
+        free_buffers(),
+        current(nullptr),
+        n_submitted(0),
+        m(),
+        cv(),
+        closing(false),
+        error(0),
+        writer()
+{
+    rdbuf(&buffer);
+
+    fd = ::open(output_path.string().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0){
+        setstate(std::ios_base::badbit);
+        return;
+    }
+
+    for (size_t i=0; i<std::max(n_buffers, size_t(2)); i++){
+        storage.emplace_back(new char[buffer_size]);
+        free_buffers.push_back(storage.back().get());
+    }
+
+    current = free_buffers.back();
+    free_buffers.pop_back();
+    buffer.set_buffer(current, buffer_size);
+
+    writer = thread(&AsyncWriter::run, this);
+}
+
+
+AsyncWriter::~AsyncWriter(){
+    close();
+}
+
+
+bool AsyncWriter::is_open() const{
+    return fd >= 0;
+}
+
+
+bool AsyncWriter::submit(){
+    if (fd < 0 or error != 0){
+        return false;
+    }
+
+    size_t size = buffer.get_size();
+    if (size == 0){
+        return true;
+    }
+
+    {
+        unique_lock<mutex> lock(m);
+        queue.emplace_back(current, size);
+        cv.notify_all();
+
+        cv.wait(lock, [&]{ return not free_buffers.empty(); });
+        current = free_buffers.back();
+        free_buffers.pop_back();
+    }
+
+    n_submitted += int64_t(size);
+    buffer.set_buffer(current, buffer_size);
+
+    return error == 0;
+}
+
+
+void AsyncWriter::run(){
+    while (true){
+        pair<char*,size_t> b;
+        {
+            unique_lock<mutex> lock(m);
+            cv.wait(lock, [&]{ return closing or not queue.empty(); });
+
+            if (queue.empty()){
+                return;
+            }
+
+            b = queue.front();
+            queue.pop_front();
+        }
+
+        size_t n_written = 0;
+        while (error == 0 and n_written < b.second){
+            ssize_t n = ::write(fd, b.first + n_written, b.second - n_written);
+
+            if (n < 0){
+                if (errno != EINTR){
+                    error = errno;
+                }
+                continue;
+            }
+
+            n_written += size_t(n);
+        }
+
+        lock_guard<mutex> lock(m);
+        free_buffers.push_back(b.first);
+        cv.notify_all();
+    }
+}
+
+
+void AsyncWriter::close(){
+    if (fd < 0){
+        return;
+    }
+
+    bool submitted = submit();
+
+    {
+        lock_guard<mutex> lock(m);
+        closing = true;
+        cv.notify_all();
+    }
+
+    writer.join();
+
+    if (::close(fd) != 0 and error == 0){
+        error = errno;
+    }
+    fd = -1;
+
+    if (not submitted or error != 0){
+        setstate(std::ios_base::badbit);
+    }
+}
+
+
+}
@@ -2,7 +2,7 @@
 
 #include <stdexcept>
 #include <iostream>
-#include <sstream>
+#include <cstring>
 #include <vector>
 
 using std::runtime_error;
@@ -18,7 +18,14 @@ Bam::Bam(path bam_path):
     bam_path(bam_path),
     bam_file(nullptr),
 //    bam_index(nullptr),
-    bam_iterator(nullptr)
+    bam_iterator(nullptr),
+    end_offset(-1),
+    read_error(false),
+    stats(nullptr),
+    decode_fields(false),
+    aux_buffer(),
+    filter_details(false),
+    detail_min_mapq(0)
 {
     if ((bam_file = hts_open(bam_path.string().c_str(), "r")) == 0) {
         throw runtime_error("ERROR: Cannot open bam file: " + bam_path.string());
@@ -31,15 +38,119 @@ Bam::Bam(path bam_path):
 
     // bam header
     if ((bam_header = sam_hdr_read(bam_file)) == 0){
+        hts_close(bam_file);
         throw runtime_error("ERROR: Cannot open header for bam file: " + bam_path.string() + "\n");
     }
 
     alignment = bam_init1();
+
+    uint16_t one = 1;
+    bool little_endian = (reinterpret_cast<uint8_t*>(&one)[0] == 1);
+
+    decode_fields = (bam_file->format.format == bam and little_endian);
+}
+
+
+/// Aux value as a string as in SamElement::tags, the pointer is that of the type byte (as from bam_aux_get)
+static string aux_to_string(const uint8_t* aux){
+    if (aux[0] == 'Z' or aux[0] == 'H') {
+        return bam_aux2Z(aux);
+    }
+    else if (aux[0] == 'A') {
+        return string(1, bam_aux2A(aux));
+    }
+    else if (aux[0] != 'f' and aux[0] != 'd' and aux[0] != 'B') {
+        return std::to_string(bam_aux2i(aux));
+    }
+
+    return "";
+}
+
+
+/// Size of a single aux value of this type, 0 if it is not a fixed size type
+static size_t get_aux_value_size(uint8_t type){
+    switch (type){
+        case 'A': case 'c': case 'C': return 1;
+        case 's': case 'S': return 2;
+        case 'i': case 'I': case 'f': return 4;
+        case 'd': return 8;
+        default: return 0;
+    }
+}
+
+
+/// Like bam_aux_get but on a raw aux block: the type byte of the tag, or null if it is absent (or the block is
+/// malformed before it)
+static const uint8_t* find_aux(const uint8_t* begin, const uint8_t* end, const char* tag){
+    const uint8_t* p = begin;
+
+    while (end - p >= 3){
+        const uint8_t* type = p + 2;
+        const uint8_t* value = p + 3;
+        const uint8_t* next;
+
+        if (*type == 'Z' or *type == 'H'){
+            auto terminator = static_cast<const uint8_t*>(memchr(value, '\0', size_t(end - value)));
+            if (terminator == nullptr){
+                return nullptr;
+            }
+            next = terminator + 1;
+        }
+        else if (*type == 'B'){
+            if (end - value < 5){
+                return nullptr;
+            }
+            uint32_t count;
+            memcpy(&count, value + 1, 4);
+            size_t size = get_aux_value_size(value[0]);
+            if (size == 0 or uint64_t(end - value - 5) < uint64_t(count)*size){
+                return nullptr;
+            }
+            next = value + 5 + size_t(count)*size;
+        }
+        else {
+            size_t size = get_aux_value_size(*type);
+            if (size == 0 or size_t(end - value) < size){
+                return nullptr;
+            }
+            next = value + size;
+        }
+
+        if (p[0] == tag[0] and p[1] == tag[1]){
+            return type;
+        }
+
+        p = next;
+    }
+
+    return nullptr;
+}
+
+
+bool Bam::has_next_record() const{
+    return end_offset < 0 or bgzf_tell(bam_file->fp.bgzf) < end_offset;
+}
+
+
+bool Bam::needs_details(uint16_t flag, uint8_t mapq) const{
+    return not filter_details or (not is_not_primary(flag) and mapq >= detail_min_mapq);
+}
+
+
+bool Bam::read_next_record(){
+    int result = sam_read1(bam_file, bam_header, alignment);
+
+    // -1 is the end of the file, anything lower a truncated or corrupt record
+    if (result < -1){
+        read_error = true;
+    }
+
+    return result >= 0;
 }
 
 
 void Bam::for_alignment_in_bam(const function<void(const string& ref_name, const string& query_name, int32_t query_length, uint8_t map_quality, uint16_t flag)>& f){
-    while (sam_read1(bam_file, bam_header, alignment) >= 0){
+    while (has_next_record() and read_next_record()){
         string query_name = bam_get_qname(alignment);
         int32_t query_length = alignment->core.l_qseq;
 
@@ -56,31 +167,283 @@ void Bam::for_alignment_in_bam(const function<void(const string& ref_name, const
 
 
 void Bam::for_alignment_in_bam(bool get_cigar, const function<void(SamElement& alignment)>& f){
-    while (sam_read1(bam_file, bam_header, alignment) >= 0){
+    for_alignment_in_bam(get_cigar, false, f);
+}
+
+
+void Bam::for_alignment_in_bam(bool get_cigar, bool get_qualities, const function<void(SamElement& alignment)>& f){
+    RunStats::Stage* read_stage = stats ? &stats->get_stage("read") : nullptr;
+    RunStats::Stage* decode_stage = stats ? &stats->get_stage("decode") : nullptr;
+
+    while (true){
         SamElement e;
-        e.query_name = bam_get_qname(alignment);
-        e.query_length = alignment->core.l_qseq;
 
-        // Ref name field might be empty if read is unmapped, in which case the target (aka ref) id might not be in range
-        if (alignment->core.tid < bam_header->n_targets and alignment->core.tid > -1) {
-            e.ref_name = bam_header->target_name[alignment->core.tid];
+        ScopedTimer read_timer(read_stage);
+        bool has_record;
+        if (decode_fields){
+            has_record = has_next_record() and read_next_fields(e, get_cigar, get_qualities);
+        }
+        else {
+            has_record = has_next_record() and read_next_record();
+        }
+        read_timer.stop();
+
+        if (not has_record){
+            break;
         }
 
-        e.mapq = alignment->core.qual;
-        e.flag = alignment->core.flag;
-        e.start_pos = alignment->core.pos;
+        ScopedTimer decode_timer(decode_stage);
+
+        if (not decode_fields){
+            e.query_name = bam_get_qname(alignment);
+            e.query_length = alignment->core.l_qseq;
+            e.mapq = alignment->core.qual;
+            e.flag = alignment->core.flag;
+            e.ref_id = alignment->core.tid;
+            e.start_pos = alignment->core.pos;
+
+            bool details = needs_details(e.flag, e.mapq);
+
+            if (get_cigar and details) {
+                auto n_cigar = alignment->core.n_cigar;
+                auto cigar_ptr = bam_get_cigar(alignment);
+                e.cigars.assign(cigar_ptr, cigar_ptr + n_cigar);
+            }
+
+            // Missing qualities are stored as a single 0xff followed by garbage, leave the vector empty in that case
+            if (get_qualities and details) {
+                auto qual_ptr = bam_get_qual(alignment);
+                if (alignment->core.l_qseq > 0 and qual_ptr[0] != 0xff) {
+                    e.qualities.assign(qual_ptr, qual_ptr + alignment->core.l_qseq);
+                }
+            }
+        }
 
-        if (get_cigar) {
-            auto n_cigar = alignment->core.n_cigar;
-            auto cigar_ptr = bam_get_cigar(alignment);
-            e.cigars.assign(cigar_ptr, cigar_ptr + n_cigar);
+        // Ref name field might be empty if read is unmapped, in which case the target (aka ref) id might not be in range
+        if (e.ref_id < bam_header->n_targets and e.ref_id > -1) {
+            e.ref_name = bam_header->target_name[e.ref_id];
         }
 
+        if (not tags_to_load.empty()) {
+            e.tags.resize(tags_to_load.size());
+
+            for (size_t i=0; i<tags_to_load.size(); i++) {
+                const uint8_t* aux;
+                if (decode_fields){
+                    aux = find_aux(aux_buffer.data(), aux_buffer.data() + aux_buffer.size(), tags_to_load[i].c_str());
+                }
+                else {
+                    aux = bam_aux_get(alignment, tags_to_load[i].c_str());
+                }
+
+                if (aux != nullptr) {
+                    e.tags[i] = aux_to_string(aux);
+                }
+            }
+        }
+
+        // The callback is timed by the caller
+        decode_timer.stop();
+
         f(e);
     }
 }
 
 
+bool Bam::skip_bytes(int64_t n){
+    BGZF* bgzf = bam_file->fp.bgzf;
+
+    while (n > 0){
+        int64_t available = bgzf->block_length - bgzf->block_offset;
+
+        // Within the current block, only the offset moves
+        if (available > n){
+            bgzf->block_offset += int(n);
+            bgzf->uncompressed_address += n;
+            return true;
+        }
+
+        // The last byte of a block (or the first of one that is not loaded yet) is read with bgzf_read, which moves
+        // on to the next block the same way as when a record is copied, so that bgzf_tell() stays consistent
+        if (available > 1){
+            bgzf->block_offset += int(available - 1);
+            bgzf->uncompressed_address += available - 1;
+            n -= available - 1;
+        }
+
+        uint8_t byte;
+        if (bgzf_read(bgzf, &byte, 1) != 1){
+            return false;
+        }
+        n--;
+    }
+
+    return true;
+}
+
+
+bool Bam::read_next_fields(SamElement& e, bool get_cigar, bool get_qualities){
+    BGZF* bgzf = bam_file->fp.bgzf;
+
+    // Layout of a record (all little endian): block size, 32 bytes of fixed fields, name (NUL terminated), CIGAR
+    // (n_cigar uint32), sequence (4 bits per base), qualities (l_seq bytes), then the aux fields to the end
+    int32_t block_size;
+    ssize_t n_read = bgzf_read(bgzf, &block_size, 4);
+    if (n_read != 4){
+        // 0 is the end of the file, anything else a truncated record
+        read_error = (n_read != 0);
+        return false;
+    }
+
+    uint8_t core[32];
+    if (block_size < 32 or bgzf_read(bgzf, core, 32) != 32){
+        read_error = true;
+        return false;
+    }
+
+    int32_t ref_id;
+    int32_t pos;
+    uint16_t n_cigar;
+    uint16_t flag;
+    int32_t l_seq;
+    int32_t mate_ref_id;
+
+    memcpy(&ref_id, core, 4);
+    memcpy(&pos, core + 4, 4);
+    uint8_t l_read_name = core[8];
+    uint8_t mapq = core[9];
+    memcpy(&n_cigar, core + 12, 2);
+    memcpy(&flag, core + 14, 2);
+    memcpy(&l_seq, core + 16, 4);
+    memcpy(&mate_ref_id, core + 20, 4);
+
+    if (not needs_details(flag, mapq)){
+        get_cigar = false;
+        get_qualities = false;
+    }
+
+    int64_t seq_length = (int64_t(l_seq) + 1)/2;
+    int64_t aux_length = int64_t(block_size) - 32 - l_read_name - 4*int64_t(n_cigar) - seq_length - l_seq;
+
+    // Same checks as sam_read1
+    if (l_read_name == 0 or l_seq < 0 or aux_length < 0 or
+        ref_id < -1 or ref_id >= bam_header->n_targets or mate_ref_id < -1 or mate_ref_id >= bam_header->n_targets){
+        read_error = true;
+        return false;
+    }
+
+    e.query_name.resize(l_read_name);
+    if (bgzf_read(bgzf, &e.query_name[0], l_read_name) != l_read_name){
+        read_error = true;
+        return false;
+    }
+    e.query_name.resize(strlen(e.query_name.c_str()));
+
+    bool ok = true;
+
+    if (get_cigar){
+        e.cigars.resize(n_cigar);
+        ok = (bgzf_read(bgzf, e.cigars.data(), 4*size_t(n_cigar)) == 4*ssize_t(n_cigar));
+    }
+    else {
+        ok = skip_bytes(4*int64_t(n_cigar));
+    }
+
+    ok = ok and skip_bytes(seq_length);
+
+    // Missing qualities are stored as a single 0xff followed by garbage, leave the vector empty in that case
+    if (ok and get_qualities and l_seq > 0){
+        e.qualities.resize(size_t(l_seq));
+        ok = (bgzf_read(bgzf, e.qualities.data(), size_t(l_seq)) == l_seq);
+        if (e.qualities[0] == 0xff){
+            e.qualities.clear();
+        }
+    }
+    else {
+        ok = ok and skip_bytes(l_seq);
+    }
+
+    // CIGARs of more than 65535 operations are stored in a CG tag, with a placeholder (the whole query soft clipped)
+    // in the record. sam_read1 swaps them back, and so do we.
+    bool cigar_in_tag = get_cigar and n_cigar > 0 and ref_id >= 0 and pos >= 0 and
+                        bam_cigar_op(e.cigars[0]) == BAM_CSOFT_CLIP and int64_t(bam_cigar_oplen(e.cigars[0])) == l_seq;
+
+    if (ok and (cigar_in_tag or not tags_to_load.empty())){
+        aux_buffer.resize(size_t(aux_length));
+        ok = (bgzf_read(bgzf, aux_buffer.data(), size_t(aux_length)) == aux_length);
+    }
+    else {
+        aux_buffer.clear();
+        ok = ok and skip_bytes(aux_length);
+    }
+
+    if (not ok){
+        read_error = true;
+        return false;
+    }
+
+    if (cigar_in_tag){
+        const uint8_t* cg = find_aux(aux_buffer.data(), aux_buffer.data() + aux_buffer.size(), "CG");
+
+        if (cg != nullptr and cg[0] == 'B' and cg[1] == 'I'){
+            uint32_t n;
+            memcpy(&n, cg + 2, 4);
+            e.cigars.resize(n);
+            memcpy(e.cigars.data(), cg + 6, 4*size_t(n));
+        }
+    }
+
+    e.query_length = l_seq;
+    e.mapq = mapq;
+    e.flag = flag;
+    e.ref_id = ref_id;
+    e.start_pos = pos;
+
+    return true;
+}
+
+
+void Bam::for_read_in_bam(const function<void(int64_t length, const uint8_t* qualities)>& f){
+    RunStats::Stage* read_stage = stats ? &stats->get_stage("read") : nullptr;
+
+    SamElement e;
+
+    while (true){
+        ScopedTimer read_timer(read_stage);
+        bool has_record;
+        if (decode_fields){
+            e.qualities.clear();
+            has_record = has_next_record() and read_next_fields(e, false, true);
+        }
+        else {
+            has_record = has_next_record() and read_next_record();
+        }
+        read_timer.stop();
+
+        if (not has_record){
+            break;
+        }
+
+        uint16_t flag = decode_fields ? e.flag : alignment->core.flag;
+
+        // Secondary alignments usually have no sequence, and neither kind is another read
+        if (is_not_primary(flag) or is_supplementary(flag)){
+            continue;
+        }
+
+        if (decode_fields){
+            f(e.query_length, e.qualities.empty() ? nullptr : e.qualities.data());
+        }
+        else {
+            auto qual_ptr = bam_get_qual(alignment);
+            bool has_qualities = alignment->core.l_qseq > 0 and qual_ptr[0] != 0xff;
+
+            f(alignment->core.l_qseq, has_qualities ? qual_ptr : nullptr);
+        }
+    }
+}
+
+
 Bam::~Bam() {
     hts_close(bam_file);
     bam_hdr_destroy(bam_header);
@@ -90,6 +453,104 @@ Bam::~Bam() {
 }
 
 
+void Bam::set_tags_to_load(const vector<string>& tags){
+    for (auto& tag: tags){
+        if (tag.size() != 2){
+            throw runtime_error("ERROR: aux tag must be 2 characters: " + tag);
+        }
+    }
+
+    tags_to_load = tags;
+}
+
+
+void Bam::set_detail_filter(uint8_t min_mapq){
+    filter_details = true;
+    detail_min_mapq = min_mapq;
+}
+
+
+void Bam::set_run_stats(RunStats* stats){
+    this->stats = stats;
+}
+
+
+void Bam::set_thread_pool(htsThreadPool* pool){
+    if (hts_set_thread_pool(bam_file, pool) != 0){
+        throw runtime_error("ERROR: could not attach thread pool to bam file: " + bam_path.string());
+    }
+}
+
+
+void Bam::set_virtual_offset_range(int64_t begin, int64_t end){
+    if (begin < 0){
+        // Stops before the first record
+        end_offset = 0;
+        return;
+    }
+
+    if (bgzf_seek(bam_file->fp.bgzf, begin, SEEK_SET) < 0){
+        throw runtime_error("ERROR: could not seek to virtual offset " + std::to_string(begin) + " in bam file: " + bam_path.string());
+    }
+
+    end_offset = end;
+}
+
+
+bool Bam::had_read_error() const{
+    return read_error;
+}
+
+
+bool Bam::has_eof_marker() const{
+    return bgzf_check_EOF(bam_file->fp.bgzf) == 1;
+}
+
+
+int64_t Bam::get_virtual_offset() const{
+    return bgzf_tell(bam_file->fp.bgzf);
+}
+
+
+vector<string> Bam::get_ref_names() const{
+    vector<string> names(bam_header->n_targets);
+
+    for (int32_t i=0; i<bam_header->n_targets; i++){
+        names[i] = bam_header->target_name[i];
+    }
+
+    return names;
+}
+
+
+vector<int64_t> Bam::get_ref_lengths() const{
+    vector<int64_t> lengths(bam_header->n_targets);
+
+    for (int32_t i=0; i<bam_header->n_targets; i++){
+        lengths[i] = bam_header->target_len[i];
+    }
+
+    return lengths;
+}
+
+
+bool Bam::is_coordinate_sorted() const{
+    if (bam_header->text == nullptr){
+        return false;
+    }
+
+    // Only the @HD line (always first if present) carries the sort order
+    string text(bam_header->text, bam_header->l_text);
+    if (text.compare(0, 3, "@HD") != 0){
+        return false;
+    }
+
+    string hd_line = text.substr(0, text.find('\n'));
+
+    return hd_line.find("\tSO:coordinate") != string::npos;
+}
+
+
 bool Bam::is_first_mate(uint16_t flag){
     return (uint16_t(flag) >> 6) & uint16_t(1);
 }
@@ -114,13 +575,5 @@ bool Bam::is_supplementary(uint16_t flag){
     return (uint16_t(flag) >> 11) & uint16_t(1);
 }
 
-string Bam::createUniqueKey(const string& ref_name, int start, int end, int matches, int nonmatches, string qname) {
-    std::stringstream oss;
-    oss << qname << "_" << ref_name << "_" << start << "_" << end << "_"
-        << matches << "_" << nonmatches;
-    return oss.str();
-}
-
-
 
 }
@@ -0,0 +1,208 @@
+#include "BamFollower.hpp"
+#include "Bam.hpp"
+
+using ghc::filesystem::recursive_directory_iterator;
+using ghc::filesystem::is_directory;
+using ghc::filesystem::file_size;
+using ghc::filesystem::exists;
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include <unistd.h>
+#include <poll.h>
+
+#include <stdexcept>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <chrono>
+
+using std::runtime_error;
+using std::make_unique;
+using std::unique_ptr;
+using std::cerr;
+using std::this_thread::sleep_for;
+using std::chrono::milliseconds;
+
+
+namespace gfase {
+
+
+BamFollower::BamFollower(path watch_path, const vector<string>& tags_to_load):
+        watch_path(watch_path),
+        tags_to_load(tags_to_load),
+        filter_details(false),
+        detail_min_mapq(0),
+        files(),
+        ref_names(),
+        ref_lengths(),
+        notify_fd(-1),
+        watched_directories()
+{
+    if (not exists(watch_path)){
+        throw runtime_error("ERROR: path to follow does not exist: " + watch_path.string());
+    }
+
+#ifdef __linux__
+    notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+
+    watch(watch_path);
+}
+
+
+BamFollower::~BamFollower(){
+    if (notify_fd >= 0){
+        close(notify_fd);
+    }
+}
+
+
+void BamFollower::set_detail_filter(uint8_t min_mapq){
+    filter_details = true;
+    detail_min_mapq = min_mapq;
+}
+
+
+void BamFollower::watch(path p){
+#ifdef __linux__
+    if (notify_fd < 0 or not watched_directories.emplace(p.string()).second){
+        return;
+    }
+
+    // A failed watch (e.g. too many watches) only means we find out about changes at the next timeout
+    inotify_add_watch(notify_fd, p.string().c_str(), IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO);
+#endif
+}
+
+
+int64_t BamFollower::read_file(path bam_path, FollowedFile& file, const function<void(SamElement& alignment)>& f){
+    // Measured before reading, so that anything appended while we read triggers another read
+    int64_t size = int64_t(file_size(bam_path));
+    if (size == file.size){
+        return 0;
+    }
+
+    unique_ptr<Bam> bam;
+
+    // The header may not be complete yet
+    try {
+        bam = make_unique<Bam>(bam_path);
+    }
+    catch (const runtime_error& e){
+        return 0;
+    }
+
+    if (ref_names.empty()){
+        ref_names = bam->get_ref_names();
+        ref_lengths = bam->get_ref_lengths();
+    }
+    else if (bam->get_ref_names() != ref_names or bam->get_ref_lengths() != ref_lengths){
+        cerr << "WARNING: skipping " << bam_path.string() << ", it was aligned to a different reference" << '\n';
+        file.done = true;
+        return 0;
+    }
+
+    if (file.next_offset < 0){
+        file.next_offset = bam->get_virtual_offset();
+    }
+    else{
+        bam->set_virtual_offset_range(file.next_offset, -1);
+    }
+
+    bam->set_tags_to_load(tags_to_load);
+    if (filter_details){
+        bam->set_detail_filter(detail_min_mapq);
+    }
+
+    int64_t n = 0;
+    bam->for_alignment_in_bam(true, true, [&](SamElement& e){
+        f(e);
+        file.next_offset = bam->get_virtual_offset();
+        n++;
+    });
+
+    file.size = size;
+    file.done = (not bam->had_read_error() and bam->has_eof_marker());
+
+    return n;
+}
+
+
+int64_t BamFollower::poll(const function<void(SamElement& alignment)>& f){
+    int64_t n = 0;
+
+    if (not is_directory(watch_path)){
+        auto& file = files[watch_path.string()];
+        if (not file.done){
+            n += read_file(watch_path, file, f);
+        }
+        return n;
+    }
+
+    // Collect first, a directory iterator is not guaranteed to be stable while files are being added
+    vector<path> bam_paths;
+    for (auto& entry: recursive_directory_iterator(watch_path)){
+        if (entry.is_directory()){
+            watch(entry.path());
+        }
+        else if (entry.path().extension() == ".bam"){
+            bam_paths.emplace_back(entry.path());
+        }
+    }
+
+    for (auto& bam_path: bam_paths){
+        auto& file = files[bam_path.string()];
+        if (not file.done){
+            n += read_file(bam_path, file, f);
+        }
+    }
+
+    return n;
+}
+
+
+void BamFollower::wait(int64_t timeout){
+    if (notify_fd < 0){
+        sleep_for(milliseconds(timeout));
+        return;
+    }
+
+    struct pollfd p = {notify_fd, POLLIN, 0};
+
+    if (::poll(&p, 1, int(timeout)) > 0){
+        // Writers generate a burst of events, give them a moment and then drop all of them
+        sleep_for(milliseconds(500));
+
+        char buffer[4096];
+        while (read(notify_fd, buffer, sizeof(buffer)) > 0){}
+    }
+}
+
+
+const vector<string>& BamFollower::get_ref_names() const{
+    return ref_names;
+}
+
+
+const vector<int64_t>& BamFollower::get_ref_lengths() const{
+    return ref_lengths;
+}
+
+
+size_t BamFollower::get_n_files() const{
+    return files.size();
+}
+
+
+size_t BamFollower::get_n_done() const{
+    size_t n = 0;
+    for (auto& item: files){
+        n += item.second.done;
+    }
+    return n;
+}
+
+
+}
@@ -0,0 +1,440 @@
+#include "CoverageTrack.hpp"
+#include "BinaryIO.hpp"
+#include "htslib/include/htslib/kstring.h"
+
+using ghc::filesystem::resize_file;
+
+#include <unordered_map>
+#include <stdexcept>
+#include <algorithm>
+#include <sstream>
+
+using std::unordered_map;
+using std::runtime_error;
+using std::stringstream;
+using std::to_string;
+using std::min;
+
+
+namespace gfase {
+
+
+CoverageTrack::CoverageTrack(const vector<string>& ref_names, const vector<int64_t>& ref_lengths, bool sorted, path output_path,
+                             shared_ptr<AlignmentSummaryStore::Budget> budget):
+        CoverageTrack(ref_names, ref_lengths, sorted, output_path, false, budget)
+{}
+
+
+CoverageTrack::CoverageTrack(const vector<string>& ref_names, const vector<int64_t>& ref_lengths, bool sorted, path output_path,
+                             bool append, shared_ptr<AlignmentSummaryStore::Budget> budget):
+        ref_names(ref_names),
+        ref_lengths(ref_lengths),
+        sorted(sorted),
+        output_path(output_path),
+        file(nullptr),
+        buffer(append ? "" : "track type=bedGraph name=\"coverage\" autoScale=on\n"),
+        current_ref_id(-1),
+        position(0),
+        depth(0),
+        ends(),
+        differences(),
+        budget(budget),
+        accounted(0),
+        pending_ref_id(-1),
+        pending_start(0),
+        pending_end(0),
+        pending_depth(0)
+{
+    if ((file = bgzf_open(output_path.string().c_str(), append ? "a" : "w")) == nullptr){
+        throw runtime_error("ERROR: file could not be written: " + output_path.string());
+    }
+
+    if (not sorted){
+        differences.resize(ref_names.size());
+    }
+}
+
+
+CoverageTrack::~CoverageTrack(){
+    if (file != nullptr){
+        bgzf_close(file);
+    }
+
+    release_budget();
+}
+
+
+void CoverageTrack::release_budget(){
+    if (budget){
+        budget->used -= accounted;
+    }
+
+    accounted = 0;
+}
+
+
+int64_t CoverageTrack::get_max_unsorted_bytes(const vector<int64_t>& ref_lengths){
+    int64_t n_bytes = 0;
+
+    for (auto& length: ref_lengths){
+        n_bytes += (length + 1)*int64_t(sizeof(int32_t));
+    }
+
+    return n_bytes;
+}
+
+
+void CoverageTrack::flush_buffer(){
+    if (buffer.empty()){
+        return;
+    }
+
+    if (bgzf_write(file, buffer.data(), buffer.size()) < 0){
+        throw runtime_error("ERROR: could not write to file: " + output_path.string());
+    }
+
+    buffer.clear();
+}
+
+
+void CoverageTrack::flush_pending(){
+    if (pending_ref_id < 0){
+        return;
+    }
+
+    buffer += ref_names[pending_ref_id];
+    buffer += '\t';
+    buffer += to_string(pending_start);
+    buffer += '\t';
+    buffer += to_string(pending_end);
+    buffer += '\t';
+    buffer += to_string(pending_depth);
+    buffer += '\n';
+
+    pending_ref_id = -1;
+
+    if (buffer.size() > 1024*1024){
+        flush_buffer();
+    }
+}
+
+
+void CoverageTrack::emit(int32_t ref_id, int64_t start, int64_t end, int64_t d){
+    if (end <= start or d == 0){
+        return;
+    }
+
+    // Extend the previous interval if it is contiguous and has the same depth
+    if (ref_id == pending_ref_id and start == pending_end and d == pending_depth){
+        pending_end = end;
+        return;
+    }
+
+    flush_pending();
+
+    pending_ref_id = ref_id;
+    pending_start = start;
+    pending_end = end;
+    pending_depth = d;
+}
+
+
+void CoverageTrack::advance_to(int64_t stop){
+    // Every alignment ending before the stop point closes off an interval of constant depth
+    while (not ends.empty() and ends.top().first <= stop){
+        int64_t end = ends.top().first;
+
+        emit(current_ref_id, position, end, depth);
+        position = end;
+
+        while (not ends.empty() and ends.top().first == end){
+            depth -= ends.top().second;
+            ends.pop();
+        }
+    }
+
+    emit(current_ref_id, position, stop, depth);
+    position = stop;
+}
+
+
+void CoverageTrack::finish_contig(){
+    if (current_ref_id < 0){
+        return;
+    }
+
+    advance_to(ref_lengths[current_ref_id]);
+
+    current_ref_id = -1;
+    position = 0;
+    depth = 0;
+}
+
+
+void CoverageTrack::add_interval(int32_t ref_id, int64_t start, int64_t end, int64_t weight){
+    if (ref_id < 0 or size_t(ref_id) >= ref_names.size()){
+        return;
+    }
+
+    end = min(end, ref_lengths[ref_id]);
+
+    if (end <= start or start < 0){
+        return;
+    }
+
+    if (sorted){
+        if (ref_id != current_ref_id){
+            if (ref_id < current_ref_id){
+                throw runtime_error("ERROR: BAM header declares coordinate sorting but contigs are out of order");
+            }
+
+            finish_contig();
+            current_ref_id = ref_id;
+        }
+        else if (start < position){
+            throw runtime_error("ERROR: BAM header declares coordinate sorting but alignments are out of order at " +
+                                ref_names[ref_id] + ":" + to_string(start));
+        }
+
+        advance_to(start);
+
+        depth += weight;
+        ends.emplace(end, weight);
+    }
+    else{
+        auto& d = differences[ref_id];
+
+        if (d.empty()){
+            d.resize(ref_lengths[ref_id] + 1, 0);
+
+            int64_t n_bytes = int64_t(d.size()*sizeof(int32_t));
+            accounted += n_bytes;
+
+            if (budget){
+                budget->used += n_bytes;
+            }
+        }
+
+        d[start] += int32_t(weight);
+        d[end] -= int32_t(weight);
+    }
+}
+
+
+void CoverageTrack::close(){
+    if (file == nullptr){
+        return;
+    }
+
+    if (sorted){
+        finish_contig();
+    }
+    else{
+        for (size_t ref_id=0; ref_id<differences.size(); ref_id++){
+            auto& d = differences[ref_id];
+
+            if (d.empty()){
+                continue;
+            }
+
+            // Prefix sum over the difference array, emitting one interval per run of equal depth
+            int64_t run_start = 0;
+            int64_t run_depth = 0;
+            int64_t running_depth = 0;
+
+            for (size_t i=0; i<d.size(); i++){
+                running_depth += d[i];
+
+                if (running_depth != run_depth){
+                    emit(int32_t(ref_id), run_start, int64_t(i), run_depth);
+                    run_start = int64_t(i);
+                    run_depth = running_depth;
+                }
+            }
+
+            d.clear();
+            d.shrink_to_fit();
+        }
+
+        release_budget();
+    }
+
+    flush_pending();
+    flush_buffer();
+
+    if (bgzf_close(file) != 0){
+        file = nullptr;
+        throw runtime_error("ERROR: could not close file: " + output_path.string());
+    }
+
+    file = nullptr;
+}
+
+
+bool CoverageTrack::is_sorted() const{
+    return sorted;
+}
+
+
+void CoverageTrack::write_checkpoint(ostream& o){
+    if (not sorted){
+        throw runtime_error("ERROR: cannot checkpoint the coverage of an unsorted BAM");
+    }
+
+    // Complete BGZF blocks only, so the file can be cut back to exactly this point
+    flush_buffer();
+    if (bgzf_flush(file) != 0){
+        throw runtime_error("ERROR: could not write to file: " + output_path.string());
+    }
+
+    int64_t compressed_size = bgzf_tell(file) >> 16;
+
+    vector<int64_t> active_ends;
+    vector<int64_t> active_weights;
+    auto ends_copy = ends;
+    while (not ends_copy.empty()){
+        active_ends.emplace_back(ends_copy.top().first);
+        active_weights.emplace_back(ends_copy.top().second);
+        ends_copy.pop();
+    }
+
+    write_value(o, compressed_size);
+    write_value(o, current_ref_id);
+    write_value(o, position);
+    write_value(o, depth);
+    write_vector(o, active_ends);
+    write_vector(o, active_weights);
+    write_value(o, pending_ref_id);
+    write_value(o, pending_start);
+    write_value(o, pending_end);
+    write_value(o, pending_depth);
+}
+
+
+unique_ptr<CoverageTrack> CoverageTrack::resume(istream& i, const vector<string>& ref_names, const vector<int64_t>& ref_lengths,
+                                                path output_path){
+    int64_t compressed_size;
+    read_value(i, compressed_size);
+
+    // Anything written after the checkpoint is recomputed
+    resize_file(output_path, uintmax_t(compressed_size));
+
+    unique_ptr<CoverageTrack> track(new CoverageTrack(ref_names, ref_lengths, true, output_path, true, nullptr));
+
+    vector<int64_t> active_ends;
+    vector<int64_t> active_weights;
+
+    read_value(i, track->current_ref_id);
+    read_value(i, track->position);
+    read_value(i, track->depth);
+    read_vector(i, active_ends);
+    read_vector(i, active_weights);
+    read_value(i, track->pending_ref_id);
+    read_value(i, track->pending_start);
+    read_value(i, track->pending_end);
+    read_value(i, track->pending_depth);
+
+    for (size_t j=0; j<active_ends.size(); j++){
+        track->ends.emplace(active_ends[j], active_weights[j]);
+    }
+
+    return track;
+}
+
+
+void CoverageTrack::merge_files(const vector<path>& input_paths, const vector<string>& ref_names,
+                                const vector<int64_t>& ref_lengths, path output_path){
+    unordered_map<string,int32_t> ref_ids;
+    for (size_t i=0; i<ref_names.size(); i++){
+        ref_ids.emplace(ref_names[i], int32_t(i));
+    }
+
+    struct Interval {
+        int32_t ref_id;
+        int64_t start;
+        int64_t end;
+        int64_t depth;
+    };
+
+    // Inputs are closed and the line is freed however the merge ends, e.g. when a line cannot be read or parsed
+    struct BgzfCloser {
+        void operator()(BGZF* f) const{
+            bgzf_close(f);
+        }
+    };
+
+    struct LineBuffer {
+        kstring_t text = {0, 0, nullptr};
+
+        ~LineBuffer(){
+            free(text.s);
+        }
+    };
+
+    vector<unique_ptr<BGZF, BgzfCloser> > inputs;
+    vector<Interval> current(input_paths.size());
+    LineBuffer line_buffer;
+    kstring_t& line = line_buffer.text;
+
+    // Read the next interval of an input, returns false at the end of the file
+    auto next_interval = [&](size_t i){
+        int result;
+        while ((result = bgzf_getline(inputs[i].get(), '\n', &line)) >= 0){
+            if (line.l == 0 or line.s[0] == '#' or string(line.s, min(line.l, size_t(5))) == "track"){
+                continue;
+            }
+
+            stringstream s(string(line.s, line.l));
+            string name;
+            Interval& interval = current[i];
+            s >> name >> interval.start >> interval.end >> interval.depth;
+
+            auto id = ref_ids.find(name);
+            if (s.fail() or id == ref_ids.end()){
+                throw runtime_error("ERROR: unexpected line in coverage track " + input_paths[i].string() + ": " + string(line.s, line.l));
+            }
+            interval.ref_id = id->second;
+            return true;
+        }
+
+        // -1 is the end of the file
+        if (result < -1){
+            throw runtime_error("ERROR: could not read coverage track: " + input_paths[i].string());
+        }
+        return false;
+    };
+
+    CoverageTrack track(ref_names, ref_lengths, true, output_path);
+
+    // Inputs are sorted, so a k-way merge by (contig, start) gives a sorted stream for the sweep line
+    using Item = pair<pair<int32_t,int64_t>, size_t>;
+    priority_queue<Item, vector<Item>, greater<Item> > queue;
+
+    for (size_t i=0; i<input_paths.size(); i++){
+        inputs.emplace_back(bgzf_open(input_paths[i].string().c_str(), "r"));
+        if (not inputs.back()){
+            throw runtime_error("ERROR: could not read coverage track: " + input_paths[i].string());
+        }
+
+        if (next_interval(i)){
+            queue.push({{current[i].ref_id, current[i].start}, i});
+        }
+    }
+
+    while (not queue.empty()){
+        size_t i = queue.top().second;
+        queue.pop();
+
+        auto& interval = current[i];
+        track.add_interval(interval.ref_id, interval.start, interval.end, interval.depth);
+
+        if (next_interval(i)){
+            queue.push({{current[i].ref_id, current[i].start}, i});
+        }
+    }
+
+    track.close();
+}
+
+
+}
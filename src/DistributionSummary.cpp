@@ -0,0 +1,237 @@
+#include "DistributionSummary.hpp"
+
+#include <algorithm>
+#include <sstream>
+#include <cmath>
+
+using std::sort;
+
+
+namespace gfase {
+
+
+const size_t DistributionSummary::n_identity_bins = 1000;
+
+const string DistributionSummary::csv_header = "reads,yield,mean_length,median_length,read_n50,prop_length_geq_10kb,"
+                                               "alignments,mean_identity,median_identity,peak_identity,"
+                                               "prop_identity_geq_95";
+
+
+template<class T> vector<pair<T,int64_t> > get_sorted(const unordered_map<T,int64_t>& distribution){
+    vector<pair<T,int64_t> > sorted(distribution.begin(), distribution.end());
+
+    sort(sorted.begin(), sorted.end(), [](const pair<T,int64_t>& a, const pair<T,int64_t>& b){
+        return a.first < b.first;
+    });
+
+    return sorted;
+}
+
+
+DistributionSummary::DistributionSummary(const unordered_map<double,int64_t>& identity_distribution,
+                                         const unordered_map<size_t,int64_t>& length_distribution):
+        n_reads(0),
+        yield(0),
+        mean_length(0),
+        median_length(0),
+        n50(0),
+        long_fraction(0),
+        n_alignments(0),
+        mean_identity(0),
+        median_identity(0),
+        peak_identity(0),
+        high_identity_fraction(0),
+        identity_bins(n_identity_bins, 0),
+        log_length_bins(),
+        nx_curve()
+{
+    auto identities = get_sorted(identity_distribution);
+    auto lengths = get_sorted(length_distribution);
+
+    double identity_sum = 0;
+    int64_t n_high_identity = 0;
+
+    for (auto& [identity, count]: identities){
+        n_alignments += count;
+        identity_sum += identity*double(count);
+        n_high_identity += (identity >= 0.95) ? count : 0;
+
+        auto b = int64_t(identity*double(n_identity_bins));
+        identity_bins[size_t(std::clamp(b, int64_t(0), int64_t(n_identity_bins) - 1))] += count;
+    }
+
+    int64_t cumulative = 0;
+    for (auto& [identity, count]: identities){
+        cumulative += count;
+        if (2*cumulative >= n_alignments){
+            median_identity = identity;
+            break;
+        }
+    }
+
+    if (n_alignments > 0){
+        auto peak_bin = std::max_element(identity_bins.begin(), identity_bins.end()) - identity_bins.begin();
+        peak_identity = (double(peak_bin) + 0.5)/double(n_identity_bins);
+        mean_identity = identity_sum/double(n_alignments);
+        high_identity_fraction = double(n_high_identity)/double(n_alignments);
+    }
+
+    int64_t n_long_reads = 0;
+
+    for (auto& [length, count]: lengths){
+        n_reads += count;
+        yield += int64_t(length)*count;
+        n_long_reads += (length >= 10000) ? count : 0;
+
+        if (length > 0){
+            log_length_bins[int64_t(floor(log10(double(length))*100))] += count;
+        }
+    }
+
+    cumulative = 0;
+    for (auto& [length, count]: lengths){
+        cumulative += count;
+        if (2*cumulative >= n_reads){
+            median_length = int64_t(length);
+            break;
+        }
+    }
+
+    int64_t bases = 0;
+    for (auto l = lengths.rbegin(); l != lengths.rend() and yield > 0; ++l){
+        nx_curve.emplace_back(double(bases)/double(yield), double(l->first));
+        bases += int64_t(l->first)*l->second;
+        nx_curve.emplace_back(double(bases)/double(yield), double(l->first));
+
+        if (n50 == 0 and 2*bases >= yield){
+            n50 = int64_t(l->first);
+        }
+    }
+
+    if (n_reads > 0){
+        mean_length = double(yield)/double(n_reads);
+        long_fraction = double(n_long_reads)/double(n_reads);
+    }
+}
+
+
+double DistributionSummary::get_qv() const{
+    double error_rate = 1 - mean_identity;
+
+    if (n_alignments == 0 or error_rate <= 1e-6){
+        return 60;
+    }
+
+    return std::min(60.0, -10*log10(error_rate));
+}
+
+
+double DistributionSummary::get_identity_quantile_start(double fraction) const{
+    double start = 0;
+    int64_t cumulative = 0;
+
+    for (size_t i=0; i<identity_bins.size() and n_alignments > 0; i++){
+        if (double(cumulative) > fraction*double(n_alignments)){
+            break;
+        }
+        start = double(i)/double(n_identity_bins);
+        cumulative += identity_bins[i];
+    }
+
+    return start;
+}
+
+
+vector<pair<double,double> > DistributionSummary::get_identity_curve() const{
+    vector<pair<double,double> > curve;
+
+    for (size_t i=0; i<identity_bins.size(); i++){
+        double y = n_alignments > 0 ? double(identity_bins[i])/double(n_alignments) : 0;
+        curve.emplace_back((double(i) + 0.5)/double(n_identity_bins), y);
+    }
+
+    return curve;
+}
+
+
+vector<pair<double,double> > DistributionSummary::get_cumulative_identity_curve() const{
+    vector<pair<double,double> > curve;
+    int64_t cumulative = 0;
+
+    for (size_t i=0; i<identity_bins.size(); i++){
+        cumulative += identity_bins[i];
+        double y = n_alignments > 0 ? double(cumulative)/double(n_alignments) : 0;
+        curve.emplace_back((double(i) + 0.5)/double(n_identity_bins), y);
+    }
+
+    return curve;
+}
+
+
+vector<pair<double,double> > DistributionSummary::get_log_length_curve(int64_t first_bin, int64_t last_bin) const{
+    vector<pair<double,double> > curve;
+
+    for (int64_t b = first_bin; b <= last_bin and n_reads > 0; b++){
+        auto iter = log_length_bins.find(b);
+        int64_t count = (iter == log_length_bins.end()) ? 0 : iter->second;
+        curve.emplace_back((double(b) + 0.5)/100, double(count)/double(n_reads));
+    }
+
+    return curve;
+}
+
+
+vector<pair<double,double> > DistributionSummary::get_log_length_curve() const{
+    if (log_length_bins.empty()){
+        return {};
+    }
+
+    return get_log_length_curve(log_length_bins.begin()->first, log_length_bins.rbegin()->first);
+}
+
+
+double DistributionSummary::get_max_nx_length(double from) const{
+    double max_length = 0;
+
+    for (auto& [x, y]: nx_curve){
+        if (x >= from){
+            max_length = std::max(max_length, y);
+        }
+    }
+
+    return max_length;
+}
+
+
+vector<pair<string,string> > DistributionSummary::get_table() const{
+    auto format = [](double x){
+        std::stringstream s;
+        s.precision(6);
+        s << x;
+        return s.str();
+    };
+
+    return {
+            {"Reads", std::to_string(n_reads)},
+            {"Yield (Gbp)", format(double(yield)/1e9)},
+            {"Mean read length", format(mean_length)},
+            {"Median read length", std::to_string(median_length)},
+            {"Read N50", std::to_string(n50)},
+            {"Reads of 10 kb or more", format(long_fraction)},
+            {"Alignments", std::to_string(n_alignments)},
+            {"Mean identity", format(mean_identity)},
+            {"Median identity", format(median_identity)},
+            {"Peak identity", format(peak_identity)},
+            {"Alignments with identity of 0.95 or more", format(high_identity_fraction)}
+    };
+}
+
+
+void DistributionSummary::write_csv(ostream& o) const{
+    o << n_reads << ',' << yield << ',' << mean_length << ',' << median_length << ',' << n50 << ','
+      << long_fraction << ',' << n_alignments << ',' << mean_identity << ',' << median_identity << ','
+      << peak_identity << ',' << high_identity_fraction;
+}
+
+
+}
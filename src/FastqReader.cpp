@@ -0,0 +1,133 @@
+#include "FastqReader.hpp"
+
+#include <stdexcept>
+#include <cstdlib>
+#include <string>
+
+using std::runtime_error;
+using std::string;
+
+
+namespace gfase {
+
+
+FastqReader::FastqReader(path fastq_path):
+        fastq_path(fastq_path),
+        file(nullptr),
+        line({0, 0, nullptr}),
+        line_number(0),
+        qualities()
+{
+    if ((file = bgzf_open(fastq_path.string().c_str(), "r")) == nullptr){
+        throw runtime_error("ERROR: Cannot open fastq file: " + fastq_path.string());
+    }
+}
+
+
+FastqReader::~FastqReader(){
+    bgzf_close(file);
+    free(line.s);
+}
+
+
+void FastqReader::set_thread_pool(htsThreadPool* pool){
+    if (pool == nullptr or pool->pool == nullptr or bgzf_compression(file) != bgzf){
+        return;
+    }
+
+    if (bgzf_thread_pool(file, pool->pool, pool->qsize) != 0){
+        throw runtime_error("ERROR: could not attach thread pool to fastq file: " + fastq_path.string());
+    }
+}
+
+
+bool FastqReader::next_line(){
+    int result = bgzf_getline(file, '\n', &line);
+
+    if (result < -1){
+        throw runtime_error("ERROR: could not read fastq file (corrupt or truncated): " + fastq_path.string());
+    }
+    if (result == -1){
+        return false;
+    }
+
+    line_number++;
+
+    if (line.l > 0 and line.s[line.l - 1] == '\r'){
+        line.s[--line.l] = '\0';
+    }
+
+    return true;
+}
+
+
+void FastqReader::for_read_in_fastq(const function<void(int64_t length, const uint8_t* qualities)>& f){
+    auto error = [&](const string& message){
+        return runtime_error("ERROR: " + message + " at line " + std::to_string(line_number) + " of fastq file: " +
+                             fastq_path.string());
+    };
+
+    while (next_line()){
+        // Tolerate blank lines between records, e.g. at the end of the file
+        if (line.l == 0){
+            continue;
+        }
+
+        if (line.s[0] != '@'){
+            throw error("expected a record header (@)");
+        }
+
+        int64_t length = 0;
+        while (true){
+            if (not next_line()){
+                throw error("truncated record");
+            }
+            if (line.l > 0 and line.s[0] == '+'){
+                break;
+            }
+            length += int64_t(line.l);
+        }
+
+        // The quality string can start with '@' or '+', so it is read by length rather than by line
+        qualities.clear();
+        while (int64_t(qualities.size()) < length){
+            if (not next_line()){
+                throw error("truncated record");
+            }
+
+            size_t start = qualities.size();
+            qualities.resize(start + line.l);
+            for (size_t i=0; i<line.l; i++){
+                qualities[start + i] = uint8_t(line.s[i] - 33);
+            }
+        }
+
+        if (int64_t(qualities.size()) != length){
+            throw error("quality string is longer than the sequence");
+        }
+
+        f(length, length > 0 ? qualities.data() : nullptr);
+    }
+}
+
+
+bool FastqReader::is_fastq(path file_path){
+    BGZF* f = bgzf_open(file_path.string().c_str(), "r");
+    if (f == nullptr){
+        return false;
+    }
+
+    kstring_t first_line = {0, 0, nullptr};
+    int result = bgzf_getline(f, '\n', &first_line);
+
+    // A SAM header line is a 2 letter record type after the '@', then a tab
+    bool fastq = result > 0 and first_line.s[0] == '@' and not (first_line.l >= 4 and first_line.s[3] == '\t');
+
+    free(first_line.s);
+    bgzf_close(f);
+
+    return fastq;
+}
+
+
+}
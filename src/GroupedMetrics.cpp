@@ -0,0 +1,307 @@
+#include "GroupedMetrics.hpp"
+#include "BinaryIO.hpp"
+
+#include <stdexcept>
+#include <algorithm>
+#include <fstream>
+#include <utility>
+#include <cmath>
+
+using std::runtime_error;
+using std::ofstream;
+using std::sort;
+using std::pair;
+using std::sqrt;
+
+
+namespace gfase {
+
+
+const string GroupedMetrics::missing_name = "*";
+
+
+GroupedMetrics::GroupedMetrics(const string& key, const vector<string>& ref_names, size_t tag_index):
+        key(key),
+        by_contig(key == "contig"),
+        tag_index(tag_index),
+        names(),
+        groups(),
+        ids(),
+        last_value(),
+        last_id(-1)
+{
+    if (by_contig){
+        // Target ids map directly to group ids, with one extra group at the end for unplaced reads
+        names = ref_names;
+        names.emplace_back(missing_name);
+        groups.resize(names.size());
+    }
+    else if (key.size() != 2){
+        throw runtime_error("ERROR: group key must be 'contig' or a 2 letter aux tag: " + key);
+    }
+}
+
+
+const string& GroupedMetrics::get_key() const{
+    return key;
+}
+
+
+int32_t GroupedMetrics::get_group_id(const SamElement& e){
+    if (by_contig){
+        if (e.ref_id < 0 or size_t(e.ref_id) >= groups.size() - 1){
+            return int32_t(groups.size()) - 1;
+        }
+        return e.ref_id;
+    }
+
+    // Empty if the read has no such tag
+    return get_group_id(e.tags[tag_index]);
+}
+
+
+int32_t GroupedMetrics::get_group_id(const string& value){
+    if (by_contig){
+        auto result = std::find(names.begin(), names.end(), value);
+        if (result == names.end()){
+            throw runtime_error("ERROR: contig not found in references: " + value);
+        }
+        return int32_t(result - names.begin());
+    }
+
+    // Reads from the same group tend to come in runs, skip the hash lookup in that case
+    if (last_id >= 0 and value == last_value){
+        return last_id;
+    }
+
+    auto result = ids.find(value);
+
+    if (result == ids.end()){
+        int32_t id = int32_t(names.size());
+        ids.emplace(value, id);
+        names.emplace_back(value);
+        groups.emplace_back();
+        last_id = id;
+    }
+    else{
+        last_id = result->second;
+    }
+
+    last_value = value;
+
+    return last_id;
+}
+
+
+void GroupedMetrics::add_read(const SamElement& e){
+    groups[get_group_id(e)].length_distribution[e.query_length]++;
+}
+
+
+void GroupedMetrics::add_alignment(const SamElement& e, double identity, int64_t matches, int64_t nonmatches){
+    auto& group = groups[get_group_id(e)];
+
+    group.identity_distribution[identity]++;
+    group.matches += matches;
+    group.nonmatches += nonmatches;
+}
+
+
+/// Group name as a CSV field, quoted (with quotes doubled) if it contains a separator, quote or line break
+static string to_csv_field(const string& name){
+    if (name.find_first_of(",\"\r\n") == string::npos){
+        return name;
+    }
+
+    string field = "\"";
+    for (auto c: name){
+        field += c;
+        if (c == '"'){
+            field += '"';
+        }
+    }
+    field += '"';
+
+    return field;
+}
+
+
+template<class T> vector<pair<T,int64_t> > get_sorted_distribution(const unordered_map<T,int64_t>& distribution){
+    vector<pair<T,int64_t> > sorted_distribution(distribution.begin(), distribution.end());
+
+    sort(sorted_distribution.begin(), sorted_distribution.end(), [](const pair<T,int64_t>& a, const pair<T,int64_t>& b){
+        return a.first < b.first;
+    });
+
+    return sorted_distribution;
+}
+
+
+void GroupedMetrics::write_to_files(path output_dir) const{
+    // Contigs are written in header order, tag values alphabetically, empty groups are skipped
+    vector<int32_t> order;
+    for (size_t i=0; i<groups.size(); i++){
+        if (groups[i].identity_distribution.empty() and groups[i].length_distribution.empty()){
+            continue;
+        }
+        order.emplace_back(int32_t(i));
+    }
+
+    if (not by_contig){
+        sort(order.begin(), order.end(), [&](int32_t a, int32_t b){
+            return names[a] < names[b];
+        });
+    }
+
+    path identity_path = output_dir / ("identity_distribution_by_" + key + ".csv");
+    path length_path = output_dir / ("length_distribution_by_" + key + ".csv");
+    path summary_path = output_dir / ("summary_by_" + key + ".csv");
+
+    ofstream identity_file(identity_path);
+    ofstream length_file(length_path);
+    ofstream summary_file(summary_path);
+
+    auto check_file = [](ofstream& file, const path& p){
+        if (not (file.is_open() and file.good())){
+            throw runtime_error("ERROR: file could not be written: " + p.string());
+        }
+    };
+
+    check_file(identity_file, identity_path);
+    check_file(length_file, length_path);
+    check_file(summary_file, summary_path);
+
+    summary_file << "group,reads,yield,read_n50,alignments,mean_identity,stdev_identity,pooled_identity" << '\n';
+
+    for (auto id: order){
+        auto& group = groups[id];
+        string name = to_csv_field(names[id]);
+
+        for (auto& [identity, count]: get_sorted_distribution(group.identity_distribution)){
+            identity_file << name << ',' << identity << ',' << count << '\n';
+        }
+
+        auto lengths = get_sorted_distribution(group.length_distribution);
+
+        int64_t reads = 0;
+        int64_t yield = 0;
+        for (auto& [length, count]: lengths){
+            length_file << name << ',' << length << ',' << count << '\n';
+            reads += count;
+            yield += int64_t(length)*count;
+        }
+
+        // N50: length at which the cumulative yield of the longest reads reaches half the total
+        int64_t n50 = 0;
+        int64_t cumulative = 0;
+        for (auto iter = lengths.rbegin(); iter != lengths.rend(); ++iter){
+            cumulative += int64_t(iter->first)*iter->second;
+            if (2*cumulative >= yield){
+                n50 = int64_t(iter->first);
+                break;
+            }
+        }
+
+        // Mean and variance from the (sorted) histogram so the result doesn't depend on the order reads were added
+        int64_t alignments = 0;
+        double identity_sum = 0;
+        auto identities = get_sorted_distribution(group.identity_distribution);
+        for (auto& [identity, count]: identities){
+            alignments += count;
+            identity_sum += identity*double(count);
+        }
+
+        double mean_identity = (alignments > 0) ? identity_sum/double(alignments) : 0;
+        double identity_variance = 0;
+        if (alignments > 1){
+            for (auto& [identity, count]: identities){
+                identity_variance += (identity - mean_identity)*(identity - mean_identity)*double(count);
+            }
+            identity_variance /= double(alignments - 1);
+        }
+
+        double pooled_identity = 0;
+        if (group.matches + group.nonmatches > 0){
+            pooled_identity = double(group.matches) / double(group.matches + group.nonmatches);
+        }
+
+        summary_file << name << ','
+                     << reads << ','
+                     << yield << ','
+                     << n50 << ','
+                     << alignments << ','
+                     << mean_identity << ','
+                     << sqrt(identity_variance) << ','
+                     << pooled_identity << '\n';
+    }
+}
+
+
+void GroupedMetrics::operator+=(const GroupedMetrics& other){
+    if (other.key != key){
+        throw runtime_error("ERROR: cannot combine metrics grouped by different keys: " + key + " and " + other.key);
+    }
+
+    if (by_contig and other.names != names){
+        throw runtime_error("ERROR: cannot combine metrics grouped by contig with different references");
+    }
+
+    for (size_t i=0; i<other.groups.size(); i++){
+        auto& a = groups[by_contig ? int32_t(i) : get_group_id(other.names[i])];
+        auto& b = other.groups[i];
+
+        add_counts(a.identity_distribution, b.identity_distribution);
+        add_counts(a.length_distribution, b.length_distribution);
+        a.matches += b.matches;
+        a.nonmatches += b.nonmatches;
+    }
+}
+
+
+void GroupedMetrics::write_binary(ostream& o) const{
+    write_string(o, key);
+    write_strings(o, names);
+
+    for (auto& group: groups){
+        write_map(o, group.identity_distribution);
+        write_map(o, group.length_distribution);
+        write_value(o, group.matches);
+        write_value(o, group.nonmatches);
+    }
+}
+
+
+void GroupedMetrics::read_binary(istream& i){
+    string other_key;
+    vector<string> other_names;
+
+    read_string(i, other_key);
+    read_strings(i, other_names);
+
+    if (other_key != key){
+        throw runtime_error("ERROR: grouped metrics in binary file are grouped by " + other_key + ", expected " + key);
+    }
+
+    if (by_contig and other_names != names){
+        throw runtime_error("ERROR: grouped metrics in binary file have different contigs");
+    }
+
+    names = other_names;
+    groups.resize(names.size());
+    ids.clear();
+    last_id = -1;
+
+    for (size_t id=0; id<names.size(); id++){
+        if (not by_contig){
+            ids.emplace(names[id], int32_t(id));
+        }
+
+        read_map(i, groups[id].identity_distribution);
+        read_map(i, groups[id].length_distribution);
+        read_value(i, groups[id].matches);
+        read_value(i, groups[id].nonmatches);
+    }
+}
+
+
+}
@@ -0,0 +1,383 @@
+#include "HtmlReport.hpp"
+
+#include <stdexcept>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <limits>
+#include <cmath>
+
+using std::numeric_limits;
+using std::runtime_error;
+using std::stringstream;
+using std::ofstream;
+
+
+namespace gfase {
+
+
+const int SvgPlot::width = 900;
+const int SvgPlot::height = 360;
+
+// Space around the plotting area for the title, ticks and labels
+static const int margin_left = 75;
+static const int margin_right = 20;
+static const int margin_top = 30;
+static const int margin_bottom = 45;
+
+static const vector<string> palette = {
+        "#2b6cb0", "#dd6b20", "#38a169", "#e53e3e", "#805ad5",
+        "#b7791f", "#319795", "#d53f8c", "#4a5568", "#975a16"
+};
+static const vector<string> dashes = {"", "6,3", "2,2", "8,3,2,3"};
+
+static const int legend_entry_width = 220;
+static const int legend_row_height = 18;
+
+
+/// Round steps (1, 2 or 5 times a power of 10) giving about n ticks over the range
+static vector<double> get_ticks(double min, double max, int n){
+    vector<double> ticks;
+
+    double range = max - min;
+    if (not (range > 0)){
+        ticks.emplace_back(min);
+        return ticks;
+    }
+
+    double magnitude = pow(10, floor(log10(range/n)));
+    double step = magnitude;
+    for (double m: {2.0, 5.0, 10.0}){
+        if (range/step <= n){
+            break;
+        }
+        step = m*magnitude;
+    }
+
+    for (double t = ceil(min/step)*step; t <= max + step*1e-9; t += step){
+        // Avoid printing -0 or 0.30000000000000004
+        ticks.emplace_back(fabs(t) < step*1e-9 ? 0 : round(t/step)*step);
+    }
+
+    return ticks;
+}
+
+
+static string format_number(double x){
+    stringstream s;
+    s.precision(6);
+    s << x;
+    return s.str();
+}
+
+
+SvgPlot::SvgPlot(const string& title, const string& x_label, const string& y_label):
+        title(title),
+        x_label(x_label),
+        y_label(y_label),
+        lines(),
+        markers(),
+        has_x_range(false),
+        x_min(0),
+        x_max(0),
+        has_y_range(false),
+        y_min(0),
+        y_max(0)
+{}
+
+
+void SvgPlot::add_line(const vector<pair<double,double> >& points, const string& label){
+    lines.push_back({points, label});
+}
+
+
+void SvgPlot::add_marker(double x, const string& label, const string& dash){
+    markers.push_back({x, label, dash});
+}
+
+
+void SvgPlot::set_x_range(double min, double max){
+    has_x_range = true;
+    x_min = min;
+    x_max = max;
+}
+
+
+void SvgPlot::set_y_range(double min, double max){
+    has_y_range = true;
+    y_min = min;
+    y_max = max;
+}
+
+
+string SvgPlot::to_svg(const string& id) const{
+    double x0 = numeric_limits<double>::max();
+    double x1 = numeric_limits<double>::lowest();
+    double y0 = numeric_limits<double>::max();
+    double y1 = numeric_limits<double>::lowest();
+
+    for (auto& line: lines){
+        for (auto& [x,y]: line.points){
+            x0 = std::min(x0, x);
+            x1 = std::max(x1, x);
+            y0 = std::min(y0, y);
+            y1 = std::max(y1, y);
+        }
+    }
+
+    if (has_x_range){
+        x0 = x_min;
+        x1 = x_max;
+    }
+    if (has_y_range){
+        y0 = y_min;
+        y1 = y_max;
+    }
+
+    // No data, or a single value
+    if (x0 > x1){
+        x0 = 0;
+        x1 = 1;
+    }
+    if (y0 > y1){
+        y0 = 0;
+        y1 = 1;
+    }
+    if (x1 == x0){
+        x1 = x0 + 1;
+    }
+    if (y1 == y0){
+        y1 = y0 + 1;
+    }
+
+    int plot_width = width - margin_left - margin_right;
+    int plot_height = height - margin_top - margin_bottom;
+
+    // Color and dash pattern of each line
+    vector<pair<string,string> > styles;
+    size_t n_labels = 0;
+    for (auto& line: lines){
+        size_t i = line.label.empty() ? 0 : n_labels++;
+        styles.emplace_back(palette[i % palette.size()], dashes[(i / palette.size()) % dashes.size()]);
+    }
+
+    int legend_columns = std::max(1, (width - margin_left)/legend_entry_width);
+    int legend_rows = int(n_labels + size_t(legend_columns) - 1)/legend_columns;
+    int total_height = height + legend_rows*legend_row_height;
+
+    auto to_x = [&](double x){
+        return margin_left + (x - x0)/(x1 - x0)*plot_width;
+    };
+    auto to_y = [&](double y){
+        return margin_top + (1 - (y - y0)/(y1 - y0))*plot_height;
+    };
+
+    stringstream svg;
+    svg.setf(std::ios::fixed);
+    svg.precision(1);
+
+    svg << "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"" << width << "\" height=\"" << total_height << "\" "
+        << "font-family=\"sans-serif\" font-size=\"12\">\n";
+
+    svg << "<text x=\"" << width/2 << "\" y=\"18\" text-anchor=\"middle\" font-size=\"14\">"
+        << HtmlReport::escape(title) << "</text>\n";
+
+    // Grid and ticks
+    for (double t: get_ticks(x0, x1, 8)){
+        double x = to_x(t);
+        svg << "<line x1=\"" << x << "\" y1=\"" << margin_top << "\" x2=\"" << x << "\" y2=\"" << margin_top + plot_height
+            << "\" stroke=\"#e2e2e2\"/>\n";
+        svg << "<text x=\"" << x << "\" y=\"" << margin_top + plot_height + 15 << "\" text-anchor=\"middle\">"
+            << format_number(t) << "</text>\n";
+    }
+    for (double t: get_ticks(y0, y1, 6)){
+        double y = to_y(t);
+        svg << "<line x1=\"" << margin_left << "\" y1=\"" << y << "\" x2=\"" << margin_left + plot_width << "\" y2=\"" << y
+            << "\" stroke=\"#e2e2e2\"/>\n";
+        svg << "<text x=\"" << margin_left - 5 << "\" y=\"" << y + 4 << "\" text-anchor=\"end\">"
+            << format_number(t) << "</text>\n";
+    }
+
+    svg << "<rect x=\"" << margin_left << "\" y=\"" << margin_top << "\" width=\"" << plot_width << "\" height=\""
+        << plot_height << "\" fill=\"none\" stroke=\"#888\"/>\n";
+
+    svg << "<text x=\"" << margin_left + plot_width/2 << "\" y=\"" << height - 8 << "\" text-anchor=\"middle\">"
+        << HtmlReport::escape(x_label) << "</text>\n";
+    svg << "<text transform=\"translate(15," << margin_top + plot_height/2 << ") rotate(-90)\" text-anchor=\"middle\">"
+        << HtmlReport::escape(y_label) << "</text>\n";
+
+    // Everything drawn from the data stays within the plotting area, even if the range was set narrower
+    svg << "<clipPath id=\"" << id << "\"><rect x=\"" << margin_left << "\" y=\"" << margin_top << "\" width=\"" << plot_width
+        << "\" height=\"" << plot_height << "\"/></clipPath>\n";
+    svg << "<g clip-path=\"url(#" << id << ")\">\n";
+
+    for (auto& m: markers){
+        double x = to_x(m.x);
+        svg << "<line x1=\"" << x << "\" y1=\"" << margin_top << "\" x2=\"" << x << "\" y2=\"" << margin_top + plot_height
+            << "\" stroke=\"#555\"";
+        if (not m.dash.empty()){
+            svg << " stroke-dasharray=\"" << m.dash << "\"";
+        }
+        svg << "/>\n";
+        if (not m.label.empty()){
+            svg << "<text x=\"" << x + 3 << "\" y=\"" << margin_top + 12 << "\" fill=\"#555\">"
+                << HtmlReport::escape(m.label) << "</text>\n";
+        }
+    }
+
+    for (size_t l=0; l<lines.size(); l++){
+        auto& line = lines[l].points;
+        auto& [color, dash] = styles[l];
+
+        svg << "<polyline fill=\"none\" stroke=\"" << color << "\" stroke-width=\"1.5\"";
+        if (not dash.empty()){
+            svg << " stroke-dasharray=\"" << dash << "\"";
+        }
+        svg << " points=\"";
+
+        // First, lowest, highest and last point of each pixel column, in their original order
+        size_t i = 0;
+        while (i < line.size()){
+            long column = lround(to_x(line[i].first));
+
+            size_t first = i;
+            size_t lowest = i;
+            size_t highest = i;
+            for (; i < line.size() and lround(to_x(line[i].first)) == column; i++){
+                if (line[i].second < line[lowest].second){
+                    lowest = i;
+                }
+                if (line[i].second > line[highest].second){
+                    highest = i;
+                }
+            }
+            size_t last = i - 1;
+
+            vector<size_t> kept = {first, lowest, highest, last};
+            std::sort(kept.begin(), kept.end());
+            kept.erase(std::unique(kept.begin(), kept.end()), kept.end());
+
+            for (auto k: kept){
+                svg << to_x(line[k].first) << ',' << to_y(line[k].second) << ' ';
+            }
+        }
+
+        svg << "\"/>\n";
+    }
+
+    svg << "</g>\n";
+
+    // Legend below the axis label, in the order the lines were added
+    size_t n = 0;
+    for (size_t l=0; l<lines.size(); l++){
+        if (lines[l].label.empty()){
+            continue;
+        }
+
+        auto& [color, dash] = styles[l];
+        int x = margin_left + int(n % size_t(legend_columns))*legend_entry_width;
+        int y = height + int(n / size_t(legend_columns))*legend_row_height + 5;
+
+        svg << "<line x1=\"" << x << "\" y1=\"" << y << "\" x2=\"" << x + 25 << "\" y2=\"" << y << "\" stroke=\"" << color
+            << "\" stroke-width=\"2\"";
+        if (not dash.empty()){
+            svg << " stroke-dasharray=\"" << dash << "\"";
+        }
+        svg << "/>\n";
+        svg << "<text x=\"" << x + 30 << "\" y=\"" << y + 4 << "\">" << HtmlReport::escape(lines[l].label) << "</text>\n";
+        n++;
+    }
+
+    svg << "</svg>\n";
+
+    return svg.str();
+}
+
+
+HtmlReport::HtmlReport(const string& title):
+        title(title),
+        body(),
+        n_plots(0)
+{}
+
+
+string HtmlReport::escape(const string& text){
+    string result;
+
+    for (char c: text){
+        switch (c){
+            case '&': result += "&amp;"; break;
+            case '<': result += "&lt;"; break;
+            case '>': result += "&gt;"; break;
+            case '"': result += "&quot;"; break;
+            default: result += c;
+        }
+    }
+
+    return result;
+}
+
+
+void HtmlReport::add_heading(const string& text){
+    body += "<h2>" + escape(text) + "</h2>\n";
+}
+
+
+void HtmlReport::add_table(const vector<pair<string,string> >& rows){
+    body += "<table>\n";
+    for (auto& [name, value]: rows){
+        body += "<tr><th>" + escape(name) + "</th><td>" + escape(value) + "</td></tr>\n";
+    }
+    body += "</table>\n";
+}
+
+
+void HtmlReport::add_table(const vector<string>& header, const vector<vector<string> >& rows){
+    body += "<table>\n<tr>";
+    for (auto& name: header){
+        body += "<th>" + escape(name) + "</th>";
+    }
+    body += "</tr>\n";
+
+    for (auto& row: rows){
+        body += "<tr>";
+        for (size_t i=0; i<row.size(); i++){
+            body += (i == 0 ? "<th>" : "<td>") + escape(row[i]) + (i == 0 ? "</th>" : "</td>");
+        }
+        body += "</tr>\n";
+    }
+    body += "</table>\n";
+}
+
+
+void HtmlReport::add_plot(const SvgPlot& plot){
+    body += "<div>\n" + plot.to_svg("plot" + std::to_string(n_plots++)) + "</div>\n";
+}
+
+
+void HtmlReport::write(path output_path) const{
+    ofstream file(output_path);
+
+    if (not (file.is_open() and file.good())){
+        throw runtime_error("ERROR: file could not be written: " + output_path.string());
+    }
+
+    file << "<!DOCTYPE html>\n<html>\n<head>\n<meta charset=\"utf-8\">\n<title>" << escape(title) << "</title>\n"
+         << "<style>\n"
+         << "body { font-family: sans-serif; margin: 2em; color: #222; }\n"
+         << "table { border-collapse: collapse; }\n"
+         << "th, td { padding: 3px 12px; border-bottom: 1px solid #ddd; }\n"
+         << "th { text-align: left; font-weight: normal; color: #555; }\n"
+         << "td { text-align: right; font-variant-numeric: tabular-nums; }\n"
+         << "</style>\n</head>\n<body>\n"
+         << "<h1>" << escape(title) << "</h1>\n"
+         << body
+         << "</body>\n</html>\n";
+
+    if (not file.good()){
+        throw runtime_error("ERROR: could not write report: " + output_path.string());
+    }
+}
+
+
+}
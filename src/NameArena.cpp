@@ -0,0 +1,58 @@
+#include "NameArena.hpp"
+
+#include <stdexcept>
+#include <cstring>
+#include <string>
+
+using std::runtime_error;
+using std::to_string;
+
+
+namespace gfase {
+
+
+NameArena::NameArena(uint64_t chunk_size):
+        chunks(),
+        chunk_size(chunk_size),
+        position(chunk_size)
+{}
+
+
+uint64_t NameArena::add(const char* s, uint64_t length){
+    if (length >= chunk_size){
+        throw runtime_error("ERROR: string of length " + to_string(length) + " does not fit in an arena chunk");
+    }
+
+    // Strings never span two chunks, the end of a chunk that is too short is wasted. Starting a new chunk when
+    // this one would be exactly full keeps every offset (even of an empty string) within an allocated chunk.
+    if (position + length >= chunk_size){
+        chunks.emplace_back(new char[chunk_size]);
+        position = 0;
+    }
+
+    uint64_t offset = (chunks.size() - 1)*chunk_size + position;
+    memcpy(chunks.back().get() + position, s, length);
+    position += length;
+
+    return offset;
+}
+
+
+const char* NameArena::get(uint64_t offset) const{
+    return chunks[offset/chunk_size].get() + offset%chunk_size;
+}
+
+
+void NameArena::clear(){
+    chunks.clear();
+    chunks.shrink_to_fit();
+    position = chunk_size;
+}
+
+
+uint64_t NameArena::get_allocated_bytes() const{
+    return chunks.size()*chunk_size;
+}
+
+
+}
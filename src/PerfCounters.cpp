@@ -0,0 +1,165 @@
+#include "PerfCounters.hpp"
+
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+using std::runtime_error;
+
+
+namespace gfase {
+
+
+const array<string, PerfCounters::n_events> PerfCounters::event_names = {
+        "cycles",
+        "instructions",
+        "cache_misses",
+        "branch_misses"
+};
+
+static const uint64_t event_configs[PerfCounters::n_events] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES
+};
+
+
+PerfCounters::PerfCounters():
+        fds(),
+        pages()
+{
+    fds.fill(-1);
+    pages.fill(nullptr);
+
+    long page_size = sysconf(_SC_PAGESIZE);
+
+    for (size_t i=0; i<n_events; i++){
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = event_configs[i];
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        // Without rdpmc, the whole group is read with one system call
+        attr.read_format = PERF_FORMAT_GROUP;
+
+        // The group starts disabled and is enabled at once below
+        attr.disabled = (i == 0);
+
+        // This thread (on any CPU), the first event leads the group
+        int fd = int(syscall(SYS_perf_event_open, &attr, 0, -1, fds[0], 0));
+
+        if (fd < 0){
+            int error = errno;
+            close_all();
+            throw runtime_error("ERROR: could not open hardware counter " + event_names[i] + ": " + strerror(error));
+        }
+
+        fds[i] = fd;
+
+        // Only needed for rdpmc, without it counters are read with read()
+        void* page = mmap(nullptr, size_t(page_size), PROT_READ, MAP_SHARED, fd, 0);
+        pages[i] = (page == MAP_FAILED) ? nullptr : page;
+    }
+
+    ioctl(fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+
+PerfCounters::~PerfCounters(){
+    close_all();
+}
+
+
+void PerfCounters::close_all(){
+    long page_size = sysconf(_SC_PAGESIZE);
+
+    for (size_t i=0; i<n_events; i++){
+        if (pages[i] != nullptr){
+            munmap(pages[i], size_t(page_size));
+            pages[i] = nullptr;
+        }
+        if (fds[i] >= 0){
+            close(fds[i]);
+            fds[i] = -1;
+        }
+    }
+}
+
+
+bool PerfCounters::read_event(size_t i, int64_t& value) const{
+#if defined(__x86_64__)
+    // Self-monitoring as described in linux/perf_event.h: retry while the kernel updates the page
+    auto page = static_cast<volatile perf_event_mmap_page*>(pages[i]);
+
+    if (page == nullptr){
+        return false;
+    }
+
+    while (true){
+        uint32_t sequence = page->lock;
+        __asm__ __volatile__("" ::: "memory");
+
+        uint32_t index = page->index;
+        if (not page->cap_user_rdpmc or index == 0){
+            return false;
+        }
+
+        int64_t count = page->offset;
+        uint16_t width = page->pmc_width;
+
+        uint32_t low;
+        uint32_t high;
+        __asm__ __volatile__("rdpmc" : "=a"(low), "=d"(high) : "c"(index - 1));
+
+        // The counter is width bits wide, sign extend it
+        int64_t pmc = int64_t(uint64_t(high) << 32 | low);
+        pmc <<= 64 - width;
+        pmc >>= 64 - width;
+
+        __asm__ __volatile__("" ::: "memory");
+        if (page->lock == sequence){
+            value = count + pmc;
+            return true;
+        }
+    }
+#else
+    return false;
+#endif
+}
+
+
+bool PerfCounters::read(Values& values) const{
+    bool complete = true;
+    for (size_t i=0; i<n_events and complete; i++){
+        complete = read_event(i, values[i]);
+    }
+
+    if (complete){
+        return true;
+    }
+
+    // Number of events, then their values in the order they were added to the group
+    uint64_t buffer[1 + n_events] = {};
+    if (::read(fds[0], buffer, sizeof(buffer)) != ssize_t(sizeof(buffer)) or buffer[0] != n_events){
+        return false;
+    }
+
+    for (size_t i=0; i<n_events; i++){
+        values[i] = int64_t(buffer[1 + i]);
+    }
+
+    return true;
+}
+
+
+}
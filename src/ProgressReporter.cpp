@@ -0,0 +1,170 @@
+#include "ProgressReporter.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+
+using ghc::filesystem::rename;
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+using std::runtime_error;
+using std::stringstream;
+using std::unique_lock;
+using std::lock_guard;
+using std::ofstream;
+using std::string;
+using std::cerr;
+
+
+namespace gfase {
+
+
+string format_duration(int64_t seconds){
+    stringstream s;
+    s << seconds/3600 << ':' << std::setw(2) << std::setfill('0') << (seconds/60)%60 << ':' << std::setw(2) << seconds%60;
+    return s.str();
+}
+
+
+ProgressReporter::ProgressReporter(int64_t total_bytes, int64_t interval_seconds, path status_path):
+        total_bytes(total_bytes),
+        interval_ms(1000*interval_seconds),
+        status_path(status_path),
+        n_records(0),
+        n_bytes(0),
+        n_skipped_bytes(0),
+        start(steady_clock::now()),
+        m(),
+        cv(),
+        stopping(false),
+        reporter()
+{
+    if (interval_seconds <= 0){
+        throw runtime_error("ERROR: progress interval must be positive");
+    }
+
+    reporter = thread(&ProgressReporter::run, this);
+}
+
+
+ProgressReporter::~ProgressReporter(){
+    stop();
+}
+
+
+void ProgressReporter::stop(){
+    {
+        lock_guard<mutex> lock(m);
+        stopping = true;
+    }
+    cv.notify_all();
+
+    if (reporter.joinable()){
+        reporter.join();
+    }
+}
+
+
+void ProgressReporter::finish(){
+    stop();
+    report(true);
+}
+
+
+void ProgressReporter::add(int64_t records, int64_t bytes){
+    n_records.fetch_add(records, std::memory_order_relaxed);
+    n_bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+
+void ProgressReporter::skip(int64_t bytes){
+    n_skipped_bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+
+void ProgressReporter::run(){
+    unique_lock<mutex> lock(m);
+
+    while (not cv.wait_for(lock, milliseconds(interval_ms), [&]{ return stopping; })){
+        lock.unlock();
+
+        // A status file that cannot be written should not stop the run
+        try {
+            report(false);
+        }
+        catch (const std::exception& e){
+            cerr << e.what() << '\n';
+        }
+
+        lock.lock();
+    }
+}
+
+
+void ProgressReporter::report(bool done){
+    int64_t records = n_records.load(std::memory_order_relaxed);
+    int64_t bytes = n_bytes.load(std::memory_order_relaxed);
+    int64_t skipped_bytes = n_skipped_bytes.load(std::memory_order_relaxed);
+
+    double elapsed = double(duration_cast<milliseconds>(steady_clock::now() - start).count())/1000;
+    double bytes_per_second = (elapsed > 0) ? double(bytes)/elapsed : 0;
+
+    int64_t done_bytes = bytes + skipped_bytes;
+    double fraction = (total_bytes > 0) ? std::min(1.0, double(done_bytes)/double(total_bytes)) : 1;
+
+    // Unknown (-1) until something was read
+    int64_t eta = -1;
+    if (done){
+        eta = 0;
+    }
+    else if (bytes_per_second > 0){
+        eta = int64_t(double(std::max(int64_t(0), total_bytes - done_bytes))/bytes_per_second);
+    }
+
+    double mb = 1024*1024;
+
+    // Formatted separately so that the line is written at once and the format of cerr is left alone
+    stringstream line;
+    line << std::fixed << std::setprecision(1)
+         << (done ? "Done: " : "Progress: ") << 100*fraction << "% | " << records << " records | "
+         << double(done_bytes)/mb << " / " << double(total_bytes)/mb << " MB | " << bytes_per_second/mb << " MB/s | "
+         << (done ? "elapsed " + format_duration(int64_t(elapsed)) : "ETA " + (eta < 0 ? "?" : format_duration(eta)))
+         << '\n';
+
+    cerr << line.str();
+
+    if (status_path.empty()){
+        return;
+    }
+
+    // Replaced atomically, so the scheduler never reads a partial file
+    path temporary_path = status_path.string() + ".tmp";
+
+    {
+        ofstream file(temporary_path);
+
+        if (not (file.is_open() and file.good())){
+            throw runtime_error("ERROR: file could not be written: " + temporary_path.string());
+        }
+
+        file << "{\n";
+        file << "  \"done\": " << (done ? "true" : "false") << ",\n";
+        file << "  \"records\": " << records << ",\n";
+        file << "  \"bytes_done\": " << done_bytes << ",\n";
+        file << "  \"bytes_total\": " << total_bytes << ",\n";
+        file << "  \"fraction\": " << fraction << ",\n";
+        file << "  \"bytes_per_second\": " << bytes_per_second << ",\n";
+        file << "  \"elapsed_seconds\": " << elapsed << ",\n";
+        file << "  \"eta_seconds\": " << eta << "\n";
+        file << "}\n";
+    }
+
+    rename(temporary_path, status_path);
+}
+
+
+}
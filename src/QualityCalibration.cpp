@@ -0,0 +1,118 @@
+#include "QualityCalibration.hpp"
+#include "BinaryIO.hpp"
+
+#include <stdexcept>
+#include <algorithm>
+#include <fstream>
+#include <cmath>
+
+using std::runtime_error;
+using std::ofstream;
+using std::log10;
+
+
+namespace gfase {
+
+
+QualityCalibration::QualityCalibration():
+        matches(),
+        mismatches(),
+        insertions()
+{}
+
+
+void QualityCalibration::add_alignment(const SamElement& e){
+    // Qualities are absent from the record (stored as 0xff), nothing to calibrate against
+    if (e.qualities.empty()){
+        return;
+    }
+
+    const uint8_t* q = e.qualities.data();
+    size_t query_length = e.qualities.size();
+    size_t query_index = 0;
+
+    e.for_each_cigar([&](auto type, auto length){
+        size_t stop = std::min(query_index + length, query_length);
+
+        if (type == '='){
+            for (size_t i=query_index; i<stop; i++){
+                matches[q[i]]++;
+            }
+            query_index = stop;
+        }
+        else if (type == 'X'){
+            for (size_t i=query_index; i<stop; i++){
+                mismatches[q[i]]++;
+            }
+            query_index = stop;
+        }
+        else if (type == 'I'){
+            for (size_t i=query_index; i<stop; i++){
+                insertions[q[i]]++;
+            }
+            query_index = stop;
+        }
+        else if (type == 'S' or type == 'M'){
+            // Consumes query but can't be attributed (M is ambiguous)
+            query_index = stop;
+        }
+    });
+}
+
+
+void QualityCalibration::operator+=(const QualityCalibration& other){
+    for (size_t i=0; i<n_bins; i++){
+        matches[i] += other.matches[i];
+        mismatches[i] += other.mismatches[i];
+        insertions[i] += other.insertions[i];
+    }
+}
+
+
+void QualityCalibration::write_binary(ostream& o) const{
+    write_array(o, matches);
+    write_array(o, mismatches);
+    write_array(o, insertions);
+}
+
+
+void QualityCalibration::read_binary(istream& i){
+    read_array(i, matches);
+    read_array(i, mismatches);
+    read_array(i, insertions);
+}
+
+
+void QualityCalibration::write_to_csv(path output_path) const{
+    ofstream file(output_path);
+
+    if (not (file.is_open() and file.good())){
+        throw runtime_error("ERROR: file could not be written: " + output_path.string());
+    }
+
+    file << "quality,matches,mismatches,insertions,error_rate,empirical_quality" << '\n';
+
+    for (size_t i=0; i<n_bins; i++){
+        int64_t errors = mismatches[i] + insertions[i];
+        int64_t total = matches[i] + errors;
+
+        if (total == 0){
+            continue;
+        }
+
+        double error_rate = double(errors) / double(total);
+
+        // Add-one smoothing so that bins with no observed errors still get a finite score
+        double empirical_quality = -10*log10(double(errors + 1) / double(total + 2));
+
+        file << i << ','
+             << matches[i] << ','
+             << mismatches[i] << ','
+             << insertions[i] << ','
+             << error_rate << ','
+             << empirical_quality << '\n';
+    }
+}
+
+
+}
@@ -0,0 +1,191 @@
+#include "ReadMetrics.hpp"
+#include "DistributionSummary.hpp"
+#include "HtmlReport.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+#include <fstream>
+#include <sstream>
+#include <array>
+#include <cmath>
+
+using std::runtime_error;
+using std::ofstream;
+using std::array;
+
+
+namespace gfase {
+
+
+/// Error probability of each Phred score
+static const array<double,256> error_probabilities = [](){
+    array<double,256> p = {};
+    for (size_t q=0; q<p.size(); q++){
+        p[q] = pow(10, -double(q)/10);
+    }
+    return p;
+}();
+
+
+static double to_phred(double error_rate){
+    return error_rate > 0 ? -10*log10(error_rate) : 0;
+}
+
+
+static string format(double x){
+    std::stringstream s;
+    s.precision(6);
+    s << x;
+    return s.str();
+}
+
+
+ReadMetrics::ReadMetrics():
+        length_distribution(),
+        read_quality_distribution(),
+        n_reads_with_qualities(0),
+        n_bases_with_qualities(0),
+        error_sum(0)
+{}
+
+
+void ReadMetrics::add_read(int64_t length, const uint8_t* qualities){
+    length_distribution[size_t(length)]++;
+
+    if (qualities == nullptr or length == 0){
+        return;
+    }
+
+    double read_error_sum = 0;
+    for (int64_t i=0; i<length; i++){
+        read_error_sum += error_probabilities[qualities[i]];
+    }
+
+    error_sum += read_error_sum;
+    n_bases_with_qualities += length;
+    n_reads_with_qualities++;
+
+    read_quality_distribution[int64_t(floor(to_phred(read_error_sum/double(length))*10))]++;
+}
+
+
+void ReadMetrics::operator+=(const ReadMetrics& other){
+    for (auto& [length, count]: other.length_distribution){
+        length_distribution[length] += count;
+    }
+    for (auto& [bin, count]: other.read_quality_distribution){
+        read_quality_distribution[bin] += count;
+    }
+
+    n_reads_with_qualities += other.n_reads_with_qualities;
+    n_bases_with_qualities += other.n_bases_with_qualities;
+    error_sum += other.error_sum;
+}
+
+
+void ReadMetrics::write_outputs(path output_dir) const{
+    DistributionSummary summary({}, length_distribution);
+
+    double mean_qv = n_bases_with_qualities > 0 ? to_phred(error_sum/double(n_bases_with_qualities)) : 0;
+
+    double median_read_qv = 0;
+    int64_t n_high_quality = 0;
+    int64_t cumulative = 0;
+
+    for (auto& [bin, count]: read_quality_distribution){
+        if (2*cumulative < n_reads_with_qualities and 2*(cumulative + count) >= n_reads_with_qualities){
+            median_read_qv = double(bin)/10;
+        }
+        cumulative += count;
+        n_high_quality += (bin >= 100) ? count : 0;
+    }
+
+    double high_quality_fraction = n_reads_with_qualities > 0 ? double(n_high_quality)/double(n_reads_with_qualities) : 0;
+
+    auto open_file = [](path output_path){
+        ofstream file(output_path);
+        if (not (file.is_open() and file.good())){
+            throw runtime_error("ERROR: file could not be written: " + output_path.string());
+        }
+        return file;
+    };
+
+    {
+        vector<pair<size_t,int64_t> > lengths(length_distribution.begin(), length_distribution.end());
+        std::sort(lengths.begin(), lengths.end());
+
+        auto file = open_file(output_dir / "length_distribution.csv");
+        for (auto& [length, count]: lengths){
+            file << length << ',' << count << '\n';
+        }
+    }
+
+    {
+        auto file = open_file(output_dir / "read_quality_distribution.csv");
+        for (auto& [bin, count]: read_quality_distribution){
+            file << double(bin)/10 << ',' << count << '\n';
+        }
+    }
+
+    {
+        auto file = open_file(output_dir / "summary.csv");
+        file << "reads,yield,mean_length,median_length,read_n50,prop_length_geq_10kb,"
+             << "reads_with_qualities,mean_qv,median_read_qv,prop_read_qv_geq_10" << '\n';
+        file << summary.n_reads << ',' << summary.yield << ',' << summary.mean_length << ',' << summary.median_length
+             << ',' << summary.n50 << ',' << summary.long_fraction << ',' << n_reads_with_qualities << ',' << mean_qv
+             << ',' << median_read_qv << ',' << high_quality_fraction << '\n';
+    }
+
+    HtmlReport report("wam reads: " + output_dir.string());
+
+    report.add_table({
+            {"Reads", std::to_string(summary.n_reads)},
+            {"Yield (Gbp)", format(double(summary.yield)/1e9)},
+            {"Mean read length", format(summary.mean_length)},
+            {"Median read length", std::to_string(summary.median_length)},
+            {"Read N50", std::to_string(summary.n50)},
+            {"Reads of 10 kb or more", format(summary.long_fraction)},
+            {"Reads with base qualities", std::to_string(n_reads_with_qualities)},
+            {"Mean QV (all bases)", format(mean_qv)},
+            {"Median read QV", format(median_read_qv)},
+            {"Reads of QV 10 or more", format(high_quality_fraction)}
+    });
+
+    report.add_heading("Read length");
+
+    SvgPlot log_length_plot("Read length", "log10(read length)", "proportion of reads");
+    log_length_plot.add_line(summary.get_log_length_curve());
+    report.add_plot(log_length_plot);
+
+    for (bool zoom: {false, true}){
+        SvgPlot plot(zoom ? "Nx (without the top 5% of the yield)" : "Nx", "cumulative sequence proportion", "read length");
+        plot.add_line(summary.nx_curve);
+        plot.add_marker(0.5, "N50", "6,3");
+        plot.set_x_range(zoom ? 0.05 : 0, 1);
+        if (zoom){
+            plot.set_y_range(0, summary.get_max_nx_length(0.05));
+        }
+        report.add_plot(plot);
+    }
+
+    if (n_reads_with_qualities > 0){
+        report.add_heading("Read quality");
+
+        vector<pair<double,double> > curve;
+        for (int64_t b = read_quality_distribution.begin()->first; b <= read_quality_distribution.rbegin()->first; b++){
+            auto iter = read_quality_distribution.find(b);
+            int64_t count = (iter == read_quality_distribution.end()) ? 0 : iter->second;
+            curve.emplace_back((double(b) + 0.5)/10, double(count)/double(n_reads_with_qualities));
+        }
+
+        SvgPlot plot("Read quality", "mean QV of the read", "proportion of reads");
+        plot.add_line(curve);
+        plot.add_marker(median_read_qv, "median", "2,2");
+        report.add_plot(plot);
+    }
+
+    report.write(output_dir / "report.html");
+}
+
+
+}
@@ -0,0 +1,110 @@
+#include "RunCheckpoint.hpp"
+#include "AsyncWriter.hpp"
+#include "BinaryIO.hpp"
+
+using ghc::filesystem::rename;
+
+#include <stdexcept>
+#include <cstring>
+
+using std::runtime_error;
+
+
+namespace gfase {
+
+
+const string RunCheckpoint::filename = "wam_checkpoint.bin";
+
+// Bump the last character whenever the layout changes, older checkpoints are then rejected rather than misread
+static const char checkpoint_magic[8] = {'W','A','M','C','K','P','T','5'};
+
+
+RunCheckpoint RunCheckpoint::start(Bam& bam_reader, int64_t bam_size, const ShardPlan::Shard* shard){
+    RunCheckpoint checkpoint;
+    checkpoint.bam_size = bam_size;
+
+    if (shard != nullptr){
+        bam_reader.set_virtual_offset_range(shard->begin, shard->end);
+        checkpoint.begin_offset = shard->begin;
+        checkpoint.end_offset = shard->end;
+    }
+    else{
+        checkpoint.begin_offset = bam_reader.get_virtual_offset();
+        checkpoint.end_offset = -1;
+    }
+
+    checkpoint.update(bam_reader);
+
+    return checkpoint;
+}
+
+
+void RunCheckpoint::update(const Bam& bam_reader){
+    // The reader of an empty shard stays after the header, which must not become where a resumed run starts
+    next_offset = (begin_offset < 0) ? -1 : bam_reader.get_virtual_offset();
+}
+
+
+void RunCheckpoint::seek(Bam& bam_reader) const{
+    bam_reader.set_virtual_offset_range(next_offset, end_offset);
+}
+
+
+bool RunCheckpoint::is_same_range(const RunCheckpoint& other) const{
+    return bam_size == other.bam_size and begin_offset == other.begin_offset and end_offset == other.end_offset;
+}
+
+
+void RunCheckpoint::write(path output_dir, vector<SampleMetrics>& metrics) const{
+    path checkpoint_path = output_dir / filename;
+    path temporary_path = output_dir / (filename + ".tmp");
+
+    {
+        AsyncWriter file(temporary_path);
+
+        if (not (file.is_open() and file.good())){
+            throw runtime_error("ERROR: file could not be written: " + temporary_path.string());
+        }
+
+        file.write(checkpoint_magic, sizeof(checkpoint_magic));
+        write_value(file, bam_size);
+        write_value(file, begin_offset);
+        write_value(file, end_offset);
+        write_value(file, next_offset);
+        write_strings(file, values);
+
+        for (auto& m: metrics){
+            m.write_checkpoint(file);
+        }
+
+        file.close();
+
+        if (not file.good()){
+            throw runtime_error("ERROR: could not write checkpoint: " + temporary_path.string());
+        }
+    }
+
+    rename(temporary_path, checkpoint_path);
+}
+
+
+RunCheckpoint RunCheckpoint::read(istream& i, path checkpoint_path){
+    char magic[sizeof(checkpoint_magic)];
+
+    i.read(magic, sizeof(magic));
+    if (not i.good() or memcmp(magic, checkpoint_magic, sizeof(magic)) != 0){
+        throw runtime_error("ERROR: not a wam checkpoint (or one written by another version): " + checkpoint_path.string());
+    }
+
+    RunCheckpoint checkpoint;
+    read_value(i, checkpoint.bam_size);
+    read_value(i, checkpoint.begin_offset);
+    read_value(i, checkpoint.end_offset);
+    read_value(i, checkpoint.next_offset);
+    read_strings(i, checkpoint.values);
+
+    return checkpoint;
+}
+
+
+}
@@ -0,0 +1,224 @@
+#include "RunStats.hpp"
+
+#include <stdexcept>
+#include <fstream>
+
+#include <sys/resource.h>
+
+using std::chrono::duration_cast;
+using std::chrono::nanoseconds;
+using std::runtime_error;
+using std::ofstream;
+
+
+namespace gfase {
+
+
+RunStats::RunStats():
+        stages(),
+        counts(),
+        start(steady_clock::now()),
+        start_cpu_ns(get_process_cpu_ns()),
+        perf()
+{}
+
+
+void RunStats::enable_perf_counters(){
+    perf = std::make_unique<PerfCounters>();
+
+    for (auto& stage: stages){
+        stage.perf = perf.get();
+    }
+}
+
+
+RunStats::Stage& RunStats::get_stage(const string& name){
+    for (auto& stage: stages){
+        if (stage.name == name){
+            return stage;
+        }
+    }
+
+    stages.emplace_back();
+    stages.back().name = name;
+    stages.back().perf = perf.get();
+
+    return stages.back();
+}
+
+
+void RunStats::set_count(const string& name, int64_t value){
+    for (auto& [key, count]: counts){
+        if (key == name){
+            count = value;
+            return;
+        }
+    }
+
+    counts.emplace_back(name, value);
+}
+
+
+double RunStats::get_wall_seconds() const{
+    return double(duration_cast<nanoseconds>(steady_clock::now() - start).count())/1e9;
+}
+
+
+int64_t RunStats::get_process_cpu_ns(){
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) != 0){
+        return 0;
+    }
+
+    int64_t user = int64_t(usage.ru_utime.tv_sec)*1000000000 + int64_t(usage.ru_utime.tv_usec)*1000;
+    int64_t system = int64_t(usage.ru_stime.tv_sec)*1000000000 + int64_t(usage.ru_stime.tv_usec)*1000;
+
+    return user + system;
+}
+
+
+int64_t RunStats::get_peak_rss_bytes(){
+    struct rusage usage;
+
+    // Linux reports kilobytes
+    if (getrusage(RUSAGE_SELF, &usage) != 0){
+        return 0;
+    }
+
+    return int64_t(usage.ru_maxrss)*1024;
+}
+
+
+void RunStats::write_json(path output_path) const{
+    ofstream file(output_path);
+
+    if (not (file.is_open() and file.good())){
+        throw runtime_error("ERROR: file could not be written: " + output_path.string());
+    }
+
+    double wall_seconds = get_wall_seconds();
+    double cpu_seconds = double(get_process_cpu_ns() - start_cpu_ns)/1e9;
+
+    int64_t n_records = 0;
+    for (auto& [name, count]: counts){
+        if (name == "records"){
+            n_records = count;
+        }
+    }
+
+    // Names are fixed identifiers, so nothing needs escaping
+    file << "{\n";
+    file << "  \"wall_seconds\": " << wall_seconds << ",\n";
+    file << "  \"cpu_seconds\": " << cpu_seconds << ",\n";
+    file << "  \"peak_rss_bytes\": " << get_peak_rss_bytes() << ",\n";
+
+    for (auto& [name, count]: counts){
+        file << "  \"" << name << "\": " << count << ",\n";
+        file << "  \"" << name << "_per_second\": " << (wall_seconds > 0 ? double(count)/wall_seconds : 0) << ",\n";
+    }
+
+    file << "  \"stages\": {";
+
+    for (size_t i=0; i<stages.size(); i++){
+        auto& stage = stages[i];
+
+        file << (i > 0 ? "," : "") << "\n    \"" << stage.name << "\": {";
+        file << "\"calls\": " << stage.n_calls;
+        file << ", \"wall_seconds\": " << double(stage.wall_ns)/1e9;
+        if (stage.has_cpu){
+            file << ", \"cpu_seconds\": " << double(stage.cpu_ns)/1e9;
+        }
+        if (stage.perf != nullptr){
+            for (size_t e=0; e<PerfCounters::n_events; e++){
+                file << ", \"" << PerfCounters::event_names[e] << "\": " << stage.counters[e];
+            }
+
+            // Cycles and instructions come first
+            file << ", \"ipc\": " << (stage.counters[0] > 0 ? double(stage.counters[1])/double(stage.counters[0]) : 0);
+
+            if (n_records > 0){
+                for (size_t e=0; e<PerfCounters::n_events; e++){
+                    file << ", \"" << PerfCounters::event_names[e] << "_per_million_records\": "
+                         << double(stage.counters[e])*1e6/double(n_records);
+                }
+            }
+
+            // The counters above only cover the other calls
+            if (stage.n_calls_without_counters > 0){
+                file << ", \"calls_without_counters\": " << stage.n_calls_without_counters;
+            }
+        }
+        file << "}";
+    }
+
+    file << (stages.empty() ? "" : "\n  ") << "}\n";
+    file << "}\n";
+
+    if (not file.good()){
+        throw runtime_error("ERROR: could not write run stats: " + output_path.string());
+    }
+}
+
+
+ScopedTimer::ScopedTimer(RunStats::Stage* stage, bool measure_cpu):
+        stage(stage),
+        measure_cpu(measure_cpu),
+        start(),
+        start_cpu_ns(0),
+        start_counters(),
+        has_start_counters(false)
+{
+    if (stage == nullptr){
+        return;
+    }
+
+    if (measure_cpu){
+        start_cpu_ns = RunStats::get_process_cpu_ns();
+    }
+
+    start = steady_clock::now();
+
+    if (stage->perf != nullptr){
+        has_start_counters = stage->perf->read(start_counters);
+    }
+}
+
+
+ScopedTimer::~ScopedTimer(){
+    stop();
+}
+
+
+void ScopedTimer::stop(){
+    if (stage == nullptr){
+        return;
+    }
+
+    if (stage->perf != nullptr){
+        PerfCounters::Values counters;
+
+        // A failed read would make the difference meaningless, so the call is left out and counted instead
+        if (stage->perf->read(counters) and has_start_counters){
+            for (size_t i=0; i<PerfCounters::n_events; i++){
+                stage->counters[i] += counters[i] - start_counters[i];
+            }
+        }
+        else {
+            stage->n_calls_without_counters++;
+        }
+    }
+
+    stage->wall_ns += duration_cast<nanoseconds>(steady_clock::now() - start).count();
+    stage->n_calls++;
+
+    if (measure_cpu){
+        stage->cpu_ns += RunStats::get_process_cpu_ns() - start_cpu_ns;
+        stage->has_cpu = true;
+    }
+
+    stage = nullptr;
+}
+
+
+}
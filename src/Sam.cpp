@@ -21,6 +21,7 @@ SamElement::SamElement(string& read_name, string& ref_name, uint16_t flag, uint8
         ref_name(ref_name),
         flag(flag),
         mapq(mapq),
+        ref_id(-1),
         start_pos(start_pos)
 {}
 
@@ -47,7 +48,8 @@ SamElement::SamElement() :
         query_name(),
         ref_name(),
         flag(-1),
-        mapq(-1)
+        mapq(-1),
+        ref_id(-1)
 {}
 
 
@@ -0,0 +1,172 @@
+#include "SampleComparison.hpp"
+#include "HtmlReport.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+#include <fstream>
+#include <sstream>
+#include <limits>
+
+using std::numeric_limits;
+using std::runtime_error;
+using std::ofstream;
+
+
+namespace gfase {
+
+
+static string format(double x){
+    std::stringstream s;
+    s.precision(6);
+    s << x;
+    return s.str();
+}
+
+
+/// Sample names are the only free text of the CSV
+static string quote_csv(const string& field){
+    if (field.find_first_of(",\"\n") == string::npos){
+        return field;
+    }
+
+    string result = "\"";
+    for (char c: field){
+        result += c;
+        if (c == '"'){
+            result += '"';
+        }
+    }
+
+    return result + '"';
+}
+
+
+SampleComparison::SampleComparison():
+        names(),
+        summaries()
+{}
+
+
+void SampleComparison::add_sample(const string& name, const DistributionSummary& summary){
+    names.emplace_back(name);
+    summaries.emplace_back(summary);
+}
+
+
+void SampleComparison::write(path output_dir) const{
+    if (summaries.empty()){
+        throw runtime_error("ERROR: no samples to compare");
+    }
+
+    double baseline_qv = summaries[0].get_qv();
+
+    path csv_path = output_dir / "comparison.csv";
+    ofstream file(csv_path);
+
+    if (not (file.is_open() and file.good())){
+        throw runtime_error("ERROR: file could not be written: " + csv_path.string());
+    }
+
+    file << "sample," << DistributionSummary::csv_header << ",qv,delta_qv" << '\n';
+
+    vector<vector<string> > rows;
+
+    for (size_t i=0; i<summaries.size(); i++){
+        auto& s = summaries[i];
+        double qv = s.get_qv();
+
+        file << quote_csv(names[i]) << ',';
+        s.write_csv(file);
+        file << ',' << qv << ',' << qv - baseline_qv << '\n';
+
+        rows.push_back({
+                names[i],
+                std::to_string(s.n_reads),
+                format(double(s.yield)/1e9),
+                std::to_string(s.n50),
+                std::to_string(s.median_length),
+                std::to_string(s.n_alignments),
+                format(s.mean_identity),
+                format(s.median_identity),
+                format(s.peak_identity),
+                format(s.high_identity_fraction),
+                format(qv),
+                format(qv - baseline_qv)
+        });
+    }
+
+    file.close();
+    if (not file.good()){
+        throw runtime_error("ERROR: could not write comparison: " + csv_path.string());
+    }
+
+    HtmlReport report("wam: comparison of " + std::to_string(summaries.size()) + " samples");
+
+    report.add_table({"Sample", "Reads", "Yield (Gbp)", "Read N50", "Median read length", "Alignments",
+                      "Mean identity", "Median identity", "Peak identity", "Identity of 0.95 or more", "QV",
+                      "ΔQV (vs " + names[0] + ")"}, rows);
+
+    // Common ranges of the zoomed and log scaled plots, so that no sample is cut off
+    double zoom_start = 1;
+    double nx_max = 0;
+    int64_t first_length_bin = numeric_limits<int64_t>::max();
+    int64_t last_length_bin = numeric_limits<int64_t>::min();
+
+    for (auto& s: summaries){
+        if (s.n_alignments > 0){
+            zoom_start = std::min(zoom_start, s.get_identity_quantile_start(0.1));
+        }
+        nx_max = std::max(nx_max, s.get_max_nx_length(0.05));
+        if (not s.log_length_bins.empty()){
+            first_length_bin = std::min(first_length_bin, s.log_length_bins.begin()->first);
+            last_length_bin = std::max(last_length_bin, s.log_length_bins.rbegin()->first);
+        }
+    }
+
+    report.add_heading("Identity");
+
+    for (bool zoom: {false, true}){
+        SvgPlot plot(zoom ? "Identity (top 90% of the alignments of each sample)" : "Identity", "identity",
+                     "proportion of alignments");
+        for (size_t i=0; i<summaries.size(); i++){
+            plot.add_line(summaries[i].get_identity_curve(), names[i]);
+        }
+        if (zoom){
+            plot.set_x_range(std::min(zoom_start, 0.999), 1);
+        }
+        report.add_plot(plot);
+    }
+
+    SvgPlot cumulative_plot("Cumulative identity", "identity", "cumulative proportion of alignments");
+    for (size_t i=0; i<summaries.size(); i++){
+        cumulative_plot.add_line(summaries[i].get_cumulative_identity_curve(), names[i]);
+    }
+    cumulative_plot.set_y_range(0, 1);
+    report.add_plot(cumulative_plot);
+
+    report.add_heading("Read length");
+
+    SvgPlot log_length_plot("Read length", "log10(read length)", "proportion of reads");
+    for (size_t i=0; i<summaries.size(); i++){
+        log_length_plot.add_line(summaries[i].get_log_length_curve(first_length_bin, last_length_bin), names[i]);
+    }
+    report.add_plot(log_length_plot);
+
+    for (bool zoom: {false, true}){
+        SvgPlot plot(zoom ? "Nx (without the top 5% of the yield)" : "Nx", "cumulative sequence proportion", "read length");
+        for (size_t i=0; i<summaries.size(); i++){
+            plot.add_line(summaries[i].nx_curve, names[i]);
+        }
+        plot.add_marker(0.5, "N50", "6,3");
+        plot.set_x_range(zoom ? 0.05 : 0, 1);
+        if (zoom){
+            plot.set_y_range(0, nx_max);
+        }
+        report.add_plot(plot);
+    }
+
+    report.write(output_dir / "compare.html");
+}
+
+
+}
@@ -0,0 +1,709 @@
+#include "SampleMetrics.hpp"
+#include "AsyncWriter.hpp"
+#include "DistributionSummary.hpp"
+#include "HtmlReport.hpp"
+#include "BinaryIO.hpp"
+
+#include <unordered_map>
+#include <algorithm>
+#include <stdexcept>
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <utility>
+#include <cmath>
+
+using ghc::filesystem::create_directories;
+using ghc::filesystem::directory_iterator;
+using ghc::filesystem::remove_all;
+using ghc::filesystem::exists;
+using ghc::filesystem::rename;
+
+using std::unordered_map;
+using std::make_unique;
+using std::runtime_error;
+using std::ofstream;
+using std::ifstream;
+using std::sort;
+using std::pair;
+
+
+namespace gfase {
+
+
+template<class T1, class T2> void write_sorted_distribution_to_file(const unordered_map<T1,T2>& distribution, path output_path){
+    vector <pair <T1, T2> > sorted_distribution(distribution.size());
+
+    size_t i=0;
+    for (auto& [key,count]: distribution){
+        sorted_distribution[i] = {key, count};
+        i++;
+    }
+
+    sort(sorted_distribution.begin(), sorted_distribution.end(),[](pair<T1,T2>& a, pair<T1,T2>& b){
+        return a.first < b.first;
+    });
+
+    ofstream file(output_path);
+
+    if (not (file.is_open() and file.good())){
+        throw runtime_error("ERROR: file could not be written: " + output_path.string());
+    }
+
+    for (auto& [key,count]: sorted_distribution){
+        file << key << ',' << count << '\n';
+    }
+}
+
+const string SampleMetrics::state_filename = "wam_state.bin";
+const uint8_t SampleMetrics::min_mapq = 1;
+
+// Bump the version whenever the layout written by write_state() changes
+static const char state_magic[8] = {'W','A','M','S','T','A','T','E'};
+static const uint32_t state_version = 6;
+static const uint32_t byte_order_mark = 0x01020304;
+
+
+SampleMetrics::SampleMetrics(const Options& options, const vector<string>& ref_names, const vector<int64_t>& ref_lengths,
+                             bool sorted, path output_dir):
+        options(options),
+        ref_names(ref_names),
+        ref_lengths(ref_lengths),
+        output_dir(output_dir),
+        identity_distribution(),
+        length_distribution(),
+        alignment_summaries(ref_names, output_dir, options.summary_budget),
+        quality_calibration(),
+        grouped_metrics(),
+        windowed_identity(),
+        coverage(),
+        coverage_sources(),
+        stats(nullptr),
+        cigar_stage(nullptr),
+        aggregate_stage(nullptr)
+{
+    // One breakdown per grouping key, tags are loaded in the order the keys were given
+    size_t tag_index = 0;
+    for (auto& key: options.group_keys){
+        grouped_metrics.emplace_back(key, ref_names, tag_index);
+        if (key != "contig"){
+            tag_index++;
+        }
+    }
+
+    if (options.window_size > 0){
+        windowed_identity = make_unique<WindowedIdentity>(ref_names, ref_lengths, options.window_size);
+    }
+
+    if (options.write_coverage){
+        coverage = make_unique<CoverageTrack>(ref_names, ref_lengths, sorted, output_dir / "coverage.bedGraph.gz",
+                                              options.summary_budget);
+    }
+}
+
+
+vector<string> SampleMetrics::get_required_tags(const Options& options){
+    vector<string> tags;
+
+    for (auto& key: options.group_keys){
+        if (key != "contig"){
+            tags.emplace_back(key);
+        }
+    }
+
+    return tags;
+}
+
+
+void SampleMetrics::set_run_stats(RunStats* stats){
+    this->stats = stats;
+    cigar_stage = stats ? &stats->get_stage("cigar") : nullptr;
+    aggregate_stage = stats ? &stats->get_stage("aggregate") : nullptr;
+}
+
+
+void SampleMetrics::set_thread_pool(htsThreadPool* pool){
+    options.thread_pool = pool;
+}
+
+
+void SampleMetrics::add_alignment(const SamElement& e){
+    if (e.is_not_primary()){
+        return;
+    }
+
+    if (not e.is_supplementary()){
+        length_distribution[e.query_length]++;
+
+        for (auto& g: grouped_metrics){
+            g.add_read(e);
+        }
+    }
+
+    if (e.mapq < min_mapq){
+        return;
+    }
+
+
+    int64_t matches = 0;
+    int64_t nonmatches = 0;
+    // I or D > 50bps ( max_indel_length )
+    int64_t indels = 0;
+    int64_t indel_total_length = 0;
+    int64_t inferred_query_length = 0;
+    int64_t alignment_end = e.start_pos;
+
+    ScopedTimer cigar_timer(cigar_stage);
+
+    e.for_each_cigar([&](auto type, auto length){
+        if (type == '='){
+            matches += length;
+            inferred_query_length += length;
+            alignment_end += length;
+        }
+        else if (type == 'X'){
+            nonmatches += length;
+            inferred_query_length += length;
+            alignment_end += length;
+        }
+        else if (type == 'I'){
+            if (length <= options.max_indel_length){
+                nonmatches += length;
+            }
+            else {
+                indels += 1;
+                indel_total_length += length;
+            }
+            inferred_query_length += length;
+        }
+        else if (type == 'D'){
+            if (length <= options.max_indel_length){
+                nonmatches += length;
+            }
+            else {
+                indels += 1;
+                indel_total_length += length;
+            }
+            alignment_end += length;
+        }
+        else if (type == 'S' or type == 'H'){
+            inferred_query_length += length;
+        }
+        else if (type == 'M'){
+            throw runtime_error("ERROR: alignment contains ambiguous M operations, cannot determine mismatches "
+                                "without = or X operations");
+        }
+
+    });
+
+    cigar_timer.stop();
+
+    ScopedTimer timer(aggregate_stage);
+
+    double numerator = double(matches);
+    double denominator = double(nonmatches) + double(matches);
+
+    double scaled_identity = 0;
+    if (denominator > 0) {
+        // 7 decimals of precision is probably enough?
+        scaled_identity = round(AlignmentSummary::identity_scale*numerator / denominator);
+    }
+    double identity = scaled_identity/AlignmentSummary::identity_scale;
+
+    identity_distribution[identity]++;
+
+    quality_calibration.add_alignment(e);
+
+    for (auto& g: grouped_metrics){
+        g.add_alignment(e, identity, matches, nonmatches);
+    }
+
+    if (coverage){
+        coverage->add_interval(e.ref_id, e.start_pos, alignment_end);
+    }
+
+    if (windowed_identity){
+        windowed_identity->add_alignment(e, options.max_indel_length);
+    }
+
+    // The store fills in where the query name goes, and the unique key is only built when writing the outputs
+    AlignmentSummary summary = {};
+    summary.ref_id = e.ref_id;
+    summary.start = int32_t(e.start_pos);
+    summary.end = int32_t(alignment_end);
+    summary.matches = uint32_t(matches);
+    summary.nonmatches = uint32_t(nonmatches);
+    summary.indels = uint32_t(indels);
+    summary.indel_length = uint32_t(indel_total_length);
+    summary.inferred_length = uint32_t(inferred_query_length);
+    summary.scaled_identity = uint32_t(scaled_identity);
+    summary.mapq = e.mapq;
+    alignment_summaries.add(summary, e.query_name);
+}
+
+
+void SampleMetrics::write_outputs(){
+    ScopedTimer timer(stats ? &stats->get_stage("write") : nullptr, true);
+
+    if (coverage){
+        coverage->close();
+    }
+    else if (not coverage_sources.empty()){
+        CoverageTrack::merge_files(coverage_sources, ref_names, ref_lengths, output_dir / "coverage.bedGraph.gz");
+    }
+
+    timer.stop();
+
+    write_summaries(output_dir);
+}
+
+
+void SampleMetrics::set_summary_formats(bool write_bed_gz, bool write_arrow){
+    options.write_bed_gz = write_bed_gz;
+    options.write_arrow = write_arrow;
+}
+
+
+void SampleMetrics::write_summaries(path directory, bool with_alignments) const{
+    ScopedTimer write_timer(stats ? &stats->get_stage("write") : nullptr, true);
+
+    write_sorted_distribution_to_file(identity_distribution, directory / "identity_distribution.csv");
+    write_sorted_distribution_to_file(length_distribution, directory / "length_distribution.csv");
+    quality_calibration.write_to_csv(directory / "quality_calibration.csv");
+
+    if (windowed_identity){
+        windowed_identity->write_to_bedgraph(directory / "windowed_identity.bedGraph");
+    }
+
+    for (auto& g: grouped_metrics){
+        g.write_to_files(directory);
+    }
+
+    write_timer.stop();
+
+    ScopedTimer report_timer(stats ? &stats->get_stage("report") : nullptr, true);
+    write_report(directory);
+    report_timer.stop();
+
+    if (not with_alignments){
+        return;
+    }
+
+    string summary_prefix = "alignment_summary_" + std::to_string(options.max_indel_length) + "bpMaxIndel";
+    path summary_path = directory / (summary_prefix + ".tsv");
+
+    ScopedTimer tsv_timer(stats ? &stats->get_stage("write") : nullptr, true);
+    alignment_summaries.write_tsv(summary_path, summary_path.string() + ".sorted.bed");
+    tsv_timer.stop();
+
+    std::cout << "Successfully wrote alignment summary file: " << summary_path << std::endl;
+
+    if (options.write_bed_gz){
+        // Sorted, compressed and indexed here rather than with bedtools/bgzip/tabix afterwards
+        path bed_path = directory / (summary_prefix + ".bed.gz");
+
+        ScopedTimer bed_timer(stats ? &stats->get_stage("bed_gz") : nullptr, true);
+        alignment_summaries.write_bed_gz(bed_path, options.thread_pool);
+        bed_timer.stop();
+
+        std::cout << "Successfully wrote indexed alignment summary: " << bed_path << std::endl;
+    }
+
+    if (options.write_arrow){
+        ScopedTimer arrow_timer(stats ? &stats->get_stage("write") : nullptr, true);
+        alignment_summaries.write_arrow(directory / (summary_prefix + ".arrow"));
+        arrow_timer.stop();
+    }
+
+    ScopedTimer state_timer(stats ? &stats->get_stage("write") : nullptr, true);
+    write_state(directory / state_filename);
+}
+
+
+void SampleMetrics::write_report(path directory) const{
+    DistributionSummary summary(identity_distribution, length_distribution);
+
+    ofstream summary_file(directory / "summary.csv");
+
+    if (not (summary_file.is_open() and summary_file.good())){
+        throw runtime_error("ERROR: file could not be written: " + (directory / "summary.csv").string());
+    }
+
+    summary_file << DistributionSummary::csv_header << '\n';
+    summary.write_csv(summary_file);
+    summary_file << '\n';
+
+    HtmlReport report("wam: " + output_dir.string());
+    report.add_table(summary.get_table());
+
+    report.add_heading("Identity");
+
+    for (bool zoom: {false, true}){
+        SvgPlot plot(zoom ? "Identity (top 90% of alignments)" : "Identity", "identity", "proportion of alignments");
+        plot.add_line(summary.get_identity_curve());
+        plot.add_marker(summary.mean_identity, "mean", "6,3");
+        plot.add_marker(summary.median_identity, "median", "2,2");
+        plot.add_marker(summary.peak_identity, "peak", "8,3,2,3");
+        if (zoom){
+            plot.set_x_range(summary.get_identity_quantile_start(0.1), 1);
+        }
+        report.add_plot(plot);
+    }
+
+    SvgPlot identity_cumulative_plot("Cumulative identity", "identity", "cumulative proportion of alignments");
+    identity_cumulative_plot.add_line(summary.get_cumulative_identity_curve());
+    identity_cumulative_plot.set_y_range(0, 1);
+    report.add_plot(identity_cumulative_plot);
+
+    report.add_heading("Read length");
+
+    SvgPlot log_length_plot("Read length", "log10(read length)", "proportion of reads");
+    log_length_plot.add_line(summary.get_log_length_curve());
+    report.add_plot(log_length_plot);
+
+    for (bool zoom: {false, true}){
+        SvgPlot plot(zoom ? "Nx (without the top 5% of the yield)" : "Nx", "cumulative sequence proportion", "read length");
+        plot.add_line(summary.nx_curve);
+        plot.add_marker(0.5, "N50", "6,3");
+        plot.set_x_range(zoom ? 0.05 : 0, 1);
+
+        // The longest reads dwarf the rest of the curve
+        if (zoom){
+            plot.set_y_range(0, summary.get_max_nx_length(0.05));
+        }
+        report.add_plot(plot);
+    }
+
+    if (windowed_identity){
+        report.add_heading("Genome-wide identity");
+
+        // Contigs one after the other, pooling the windows of each pixel column of each contig
+        vector<int64_t> offsets(ref_lengths.size() + 1, 0);
+        for (size_t i=0; i<ref_lengths.size(); i++){
+            offsets[i+1] = offsets[i] + ref_lengths[i];
+        }
+        int64_t genome_length = std::max(int64_t(1), offsets.back());
+        int64_t n_columns = SvgPlot::width;
+
+        SvgPlot plot("Identity along the genome", "position (Mbp)", "identity");
+
+        vector<pair<double,double> > line;
+        int32_t line_ref_id = -1;
+        int64_t column = -1;
+        int64_t matches = 0;
+        int64_t total = 0;
+        double min_identity = 1;
+
+        auto add_point = [&](){
+            if (total > 0){
+                double identity = double(matches)/double(total);
+                line.emplace_back(((double(column) + 0.5)*double(genome_length)/double(n_columns))/1e6, identity);
+                min_identity = std::min(min_identity, identity);
+            }
+            matches = 0;
+            total = 0;
+        };
+
+        windowed_identity->for_each_window([&](int32_t ref_id, int64_t start, int64_t end,
+                                                const WindowedIdentity::Window& window){
+            int64_t c = (offsets[ref_id] + start)*n_columns/genome_length;
+
+            if (ref_id != line_ref_id or c != column){
+                add_point();
+            }
+            if (ref_id != line_ref_id){
+                if (not line.empty()){
+                    plot.add_line(line);
+                }
+                line.clear();
+                line_ref_id = ref_id;
+            }
+
+            column = c;
+            matches += window.matches;
+            total += window.matches + window.nonmatches;
+        });
+
+        add_point();
+        if (not line.empty()){
+            plot.add_line(line);
+        }
+
+        // Only the contigs wide enough for their name
+        for (size_t i=0; i<ref_lengths.size(); i++){
+            if (ref_lengths[i]*50 >= genome_length){
+                plot.add_marker(double(offsets[i])/1e6, ref_names[i]);
+            }
+        }
+
+        plot.set_x_range(0, double(genome_length)/1e6);
+        plot.set_y_range(std::min(0.99, std::floor(min_identity*100)/100), 1);
+        report.add_plot(plot);
+    }
+
+    report.write(directory / "report.html");
+}
+
+
+void SampleMetrics::write_snapshot() const{
+    path snapshot_dir = output_dir / ".snapshot";
+
+    if (exists(snapshot_dir)){
+        remove_all(snapshot_dir);
+    }
+    create_directories(snapshot_dir);
+
+    write_summaries(snapshot_dir, false);
+
+    // Renaming within a file system is atomic, so readers see either the previous or the new version of a file
+    for (auto& entry: directory_iterator(snapshot_dir)){
+        rename(entry.path(), output_dir / entry.path().filename());
+    }
+
+    remove_all(snapshot_dir);
+}
+
+
+void SampleMetrics::operator+=(const SampleMetrics& other){
+    if (other.options.max_indel_length != options.max_indel_length or
+        other.options.window_size != options.window_size or
+        other.options.group_keys != options.group_keys){
+        throw runtime_error("ERROR: cannot combine results computed with different options");
+    }
+
+    if (other.ref_names != ref_names or other.ref_lengths != ref_lengths){
+        throw runtime_error("ERROR: cannot combine results computed on different references");
+    }
+
+    add_counts(identity_distribution, other.identity_distribution);
+    add_counts(length_distribution, other.length_distribution);
+
+    quality_calibration += other.quality_calibration;
+
+    if (windowed_identity){
+        *windowed_identity += *other.windowed_identity;
+    }
+
+    for (size_t i=0; i<grouped_metrics.size(); i++){
+        grouped_metrics[i] += other.grouped_metrics[i];
+    }
+
+    alignment_summaries += other.alignment_summaries;
+
+    if (options.write_coverage and other.options.write_coverage){
+        coverage_sources.insert(coverage_sources.end(), other.coverage_sources.begin(), other.coverage_sources.end());
+    }
+    else{
+        options.write_coverage = false;
+        coverage_sources.clear();
+    }
+}
+
+
+void SampleMetrics::write_state(path state_path) const{
+    AsyncWriter file(state_path);
+
+    if (not (file.is_open() and file.good())){
+        throw runtime_error("ERROR: file could not be written: " + state_path.string());
+    }
+
+    write_state(file);
+    file.close();
+
+    if (not file.good()){
+        throw runtime_error("ERROR: could not write state file: " + state_path.string());
+    }
+}
+
+
+void SampleMetrics::write_state(ostream& file) const{
+    write_accumulators(file);
+    alignment_summaries.write_binary(file);
+}
+
+
+void SampleMetrics::write_accumulators(ostream& file) const{
+    file.write(state_magic, sizeof(state_magic));
+    write_value(file, state_version);
+    write_value(file, byte_order_mark);
+
+    write_value(file, options.max_indel_length);
+    write_value(file, options.write_coverage);
+    write_value(file, options.window_size);
+    write_strings(file, options.group_keys);
+
+    write_strings(file, ref_names);
+    write_vector(file, ref_lengths);
+
+    write_map(file, identity_distribution);
+    write_map(file, length_distribution);
+    quality_calibration.write_binary(file);
+
+    if (windowed_identity){
+        windowed_identity->write_binary(file);
+    }
+
+    for (auto& g: grouped_metrics){
+        g.write_binary(file);
+    }
+}
+
+
+SampleMetrics SampleMetrics::load_state(path state_path, path output_dir,
+                                        shared_ptr<AlignmentSummaryStore::Budget> summary_budget){
+    ifstream file(state_path, std::ios::binary);
+
+    if (not (file.is_open() and file.good())){
+        throw runtime_error("ERROR: could not read state file: " + state_path.string());
+    }
+
+    try {
+        auto metrics = read_state(file, output_dir, summary_budget);
+
+        if (metrics.options.write_coverage){
+            metrics.coverage_sources.emplace_back(state_path.parent_path() / "coverage.bedGraph.gz");
+        }
+
+        return metrics;
+    }
+    catch (const runtime_error& e){
+        throw runtime_error(string(e.what()) + ": " + state_path.string());
+    }
+}
+
+
+void SampleMetrics::read_header(istream& file, Options& options, vector<string>& ref_names,
+                                vector<int64_t>& ref_lengths){
+    char magic[sizeof(state_magic)];
+    uint32_t version;
+    uint32_t bom;
+
+    file.read(magic, sizeof(magic));
+    if (not file.good() or memcmp(magic, state_magic, sizeof(magic)) != 0){
+        throw runtime_error("ERROR: not a wam state");
+    }
+
+    read_value(file, version);
+    read_value(file, bom);
+
+    if (bom != byte_order_mark){
+        throw runtime_error("ERROR: state was written on a machine with a different byte order");
+    }
+    if (version != state_version){
+        throw runtime_error("ERROR: state version " + std::to_string(version) + " is not supported (expected " +
+                            std::to_string(state_version) + ")");
+    }
+
+    read_value(file, options.max_indel_length);
+    read_value(file, options.write_coverage);
+    read_value(file, options.window_size);
+    read_strings(file, options.group_keys);
+    read_strings(file, ref_names);
+    read_vector(file, ref_lengths);
+}
+
+
+void SampleMetrics::load_distributions(path state_path, unordered_map<double,int64_t>& identity_distribution,
+                                       unordered_map<size_t,int64_t>& length_distribution){
+    ifstream file(state_path, std::ios::binary);
+
+    if (not (file.is_open() and file.good())){
+        throw runtime_error("ERROR: could not read state file: " + state_path.string());
+    }
+
+    try {
+        Options options;
+        vector<string> ref_names;
+        vector<int64_t> ref_lengths;
+
+        read_header(file, options, ref_names, ref_lengths);
+
+        // The histograms come right after the header, the rest of the file is not read
+        read_map(file, identity_distribution);
+        read_map(file, length_distribution);
+    }
+    catch (const runtime_error& e){
+        throw runtime_error(string(e.what()) + ": " + state_path.string());
+    }
+}
+
+
+SampleMetrics SampleMetrics::read_state(istream& file, path output_dir,
+                                        shared_ptr<AlignmentSummaryStore::Budget> summary_budget){
+    auto metrics = read_accumulators(file, output_dir, summary_budget);
+    metrics.alignment_summaries.read_binary(file);
+
+    return metrics;
+}
+
+
+SampleMetrics SampleMetrics::read_accumulators(istream& file, path output_dir,
+                                               shared_ptr<AlignmentSummaryStore::Budget> summary_budget){
+    Options options;
+    vector<string> ref_names;
+    vector<int64_t> ref_lengths;
+
+    read_header(file, options, ref_names, ref_lengths);
+    options.summary_budget = summary_budget;
+
+    // The track is not reopened for writing, it is merged from the one next to the state file or resumed
+    bool write_coverage = options.write_coverage;
+    options.write_coverage = false;
+
+    SampleMetrics metrics(options, ref_names, ref_lengths, false, output_dir);
+    metrics.options.write_coverage = write_coverage;
+
+    read_map(file, metrics.identity_distribution);
+    read_map(file, metrics.length_distribution);
+    metrics.quality_calibration.read_binary(file);
+
+    if (metrics.windowed_identity){
+        metrics.windowed_identity->read_binary(file);
+    }
+
+    for (auto& g: metrics.grouped_metrics){
+        g.read_binary(file);
+    }
+
+    return metrics;
+}
+
+
+bool SampleMetrics::can_checkpoint() const{
+    return not coverage or coverage->is_sorted();
+}
+
+
+void SampleMetrics::write_checkpoint(ostream& o){
+    write_accumulators(o);
+    alignment_summaries.write_checkpoint(o);
+
+    write_value(o, bool(coverage));
+    if (coverage){
+        coverage->write_checkpoint(o);
+    }
+}
+
+
+SampleMetrics SampleMetrics::read_checkpoint(istream& i, path output_dir,
+                                             shared_ptr<AlignmentSummaryStore::Budget> summary_budget){
+    auto metrics = read_accumulators(i, output_dir, summary_budget);
+    metrics.alignment_summaries.read_checkpoint(i);
+
+    bool has_coverage;
+    read_value(i, has_coverage);
+
+    if (has_coverage){
+        metrics.coverage = CoverageTrack::resume(i, metrics.ref_names, metrics.ref_lengths, output_dir / "coverage.bedGraph.gz");
+    }
+
+    return metrics;
+}
+
+
+void SampleMetrics::discard_checkpoint(){
+    alignment_summaries.discard_checkpoint();
+}
+
+
+}
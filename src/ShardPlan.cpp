@@ -0,0 +1,439 @@
+#include "ShardPlan.hpp"
+#include "htslib/include/htslib/bgzf.h"
+#include "htslib/include/htslib/hts.h"
+#include "htslib/include/htslib/sam.h"
+
+using ghc::filesystem::file_size;
+
+#include <stdexcept>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+
+using std::runtime_error;
+using std::stringstream;
+using std::ifstream;
+using std::ofstream;
+using std::to_string;
+using std::max;
+
+
+namespace gfase {
+
+
+static const string plan_magic = "#wam_shard_plan";
+
+
+ShardPlan::ShardPlan():
+        bam_path(),
+        bam_size(0),
+        shards()
+{}
+
+
+size_t ShardPlan::size() const{
+    return shards.size();
+}
+
+
+/// Check that a chain of (up to 3) records starting at pos in a decompressed buffer looks like BAM records
+static bool is_record_chain(const uint8_t* data, size_t size, size_t pos, int32_t n_targets, bool at_eof){
+    auto get_int32 = [&](size_t p){
+        int32_t x;
+        memcpy(&x, data + p, sizeof(x));
+        return x;
+    };
+
+    auto get_uint16 = [&](size_t p){
+        uint16_t x;
+        memcpy(&x, data + p, sizeof(x));
+        return x;
+    };
+
+    for (int n=0; n<3; n++){
+        // Reaching the end of the data exactly at a record boundary is fine, as long as we validated something
+        if (pos == size){
+            return n > 0;
+        }
+
+        // Fixed size fields: block_size, refID, pos, l_read_name, mapq, bin, n_cigar, flag, l_seq, next_refID,
+        // next_pos, tlen
+        if (pos + 36 > size){
+            return n > 0 and not at_eof;
+        }
+
+        int64_t block_size = get_int32(pos);
+        int32_t ref_id = get_int32(pos + 4);
+        int32_t ref_pos = get_int32(pos + 8);
+        int64_t l_read_name = data[pos + 12];
+        int64_t n_cigar = get_uint16(pos + 16);
+        int64_t l_seq = get_int32(pos + 20);
+        int32_t next_ref_id = get_int32(pos + 24);
+        int32_t next_pos = get_int32(pos + 28);
+
+        if (block_size < 32 or ref_id < -1 or ref_id >= n_targets or next_ref_id < -1 or next_ref_id >= n_targets or
+            ref_pos < -1 or next_pos < -1 or l_read_name < 1 or l_seq < 0){
+            return false;
+        }
+
+        if (32 + l_read_name + 4*n_cigar + (l_seq + 1)/2 + l_seq > block_size){
+            return false;
+        }
+
+        size_t name_start = pos + 36;
+        if (name_start + l_read_name > size){
+            return n > 0 and not at_eof;
+        }
+
+        // Read names are printable, never start with '@' and are null terminated
+        if (data[name_start + l_read_name - 1] != 0){
+            return false;
+        }
+        for (size_t i=name_start; i<name_start + l_read_name - 1; i++){
+            if (data[i] < '!' or data[i] > '~' or data[i] == '@'){
+                return false;
+            }
+        }
+
+        size_t record_end = pos + 4 + size_t(block_size);
+        if (record_end > size){
+            // A record longer than the window, nothing more to check
+            return not at_eof;
+        }
+
+        pos = record_end;
+    }
+
+    return true;
+}
+
+
+int64_t ShardPlan::find_record_start(path bam_path, int64_t compressed_offset, int32_t n_targets){
+    ifstream file(bam_path, std::ios::binary);
+
+    if (not (file.is_open() and file.good())){
+        throw runtime_error("ERROR: could not read BAM: " + bam_path.string());
+    }
+
+    // BGZF blocks are at most 64KiB, so unless we are at the end of the file a block starts within this window
+    vector<char> raw(2*65536 + 18);
+    file.seekg(compressed_offset);
+    file.read(raw.data(), int64_t(raw.size()));
+    size_t n_raw = size_t(file.gcount());
+    bool raw_at_eof = (n_raw < raw.size());
+
+    BGZF* bgzf = nullptr;
+    int64_t block_address = -1;
+    int64_t block_length = 0;
+    int64_t block_clength = 0;
+
+    for (size_t i=0; i + 18 <= n_raw and block_address < 0; i++){
+        auto h = reinterpret_cast<const uint8_t*>(raw.data() + i);
+
+        // gzip header with FEXTRA, XLEN = 6 and the 'BC' subfield that holds the block size
+        if (h[0] != 0x1f or h[1] != 0x8b or h[2] != 8 or h[3] != 4 or h[10] != 6 or h[11] != 0 or
+            h[12] != 'B' or h[13] != 'C' or h[14] != 2 or h[15] != 0){
+            continue;
+        }
+
+        // Reopen after a false positive, since a failed block read leaves the handle in an error state
+        if (bgzf == nullptr or bgzf->errcode != 0){
+            if (bgzf != nullptr){
+                bgzf_close(bgzf);
+            }
+            if ((bgzf = bgzf_open(bam_path.string().c_str(), "r")) == nullptr){
+                throw runtime_error("ERROR: could not read BAM: " + bam_path.string());
+            }
+        }
+
+        int64_t address = compressed_offset + int64_t(i);
+
+        if (bgzf_seek(bgzf, address << 16, SEEK_SET) < 0 or bgzf_read_block(bgzf) < 0){
+            continue;
+        }
+
+        block_address = address;
+        block_length = bgzf->block_length;
+        block_clength = bgzf->block_clength;
+    }
+
+    if (block_address < 0){
+        if (bgzf != nullptr){
+            bgzf_close(bgzf);
+        }
+
+        // Only the end of the EOF marker block can be too short to hold a block header
+        if (raw_at_eof){
+            return -1;
+        }
+        throw runtime_error("ERROR: no BGZF block found after offset " + to_string(compressed_offset) + " of " +
+                            bam_path.string());
+    }
+
+    vector<uint8_t> window(4*1024*1024);
+    int64_t result = -1;
+
+    // A record may span many blocks (e.g. ultra-long reads), so keep going block by block until one has a record
+    // start. Only the empty block that marks the end of the file (or the end of the file itself) means there is none.
+    while (block_length > 0){
+        if (bgzf_seek(bgzf, block_address << 16, SEEK_SET) < 0){
+            break;
+        }
+
+        ssize_t n_window = bgzf_read(bgzf, window.data(), window.size());
+        if (n_window < 0){
+            break;
+        }
+
+        bool at_eof = size_t(n_window) < window.size();
+
+        // Offsets past the end of the first block would be written differently by a sequential reader
+        for (int64_t u=0; u<block_length and u<n_window; u++){
+            if (is_record_chain(window.data(), size_t(n_window), size_t(u), n_targets, at_eof)){
+                result = (block_address << 16) | u;
+                break;
+            }
+        }
+
+        if (result >= 0){
+            break;
+        }
+
+        block_address += block_clength;
+
+        if (block_address >= int64_t(file_size(bam_path))){
+            block_length = 0;
+            break;
+        }
+
+        if (bgzf_seek(bgzf, block_address << 16, SEEK_SET) < 0 or bgzf_read_block(bgzf) < 0){
+            break;
+        }
+
+        block_length = bgzf->block_length;
+        block_clength = bgzf->block_clength;
+    }
+
+    bgzf_close(bgzf);
+
+    if (result < 0 and block_length > 0){
+        throw runtime_error("ERROR: could not find a record start after offset " + to_string(compressed_offset) +
+                            " of " + bam_path.string() + " (corrupt BGZF block at " + to_string(block_address) + ")");
+    }
+
+    return result;
+}
+
+
+ShardPlan ShardPlan::create(path bam_path, size_t n_shards){
+    if (n_shards == 0){
+        throw runtime_error("ERROR: number of shards must be positive");
+    }
+
+    samFile* bam_file;
+    bam_hdr_t* bam_header;
+
+    if ((bam_file = hts_open(bam_path.string().c_str(), "r")) == nullptr){
+        throw runtime_error("ERROR: Cannot open bam file: " + bam_path.string());
+    }
+
+    if ((bam_header = sam_hdr_read(bam_file)) == nullptr){
+        throw runtime_error("ERROR: Cannot open header for bam file: " + bam_path.string());
+    }
+
+    ShardPlan plan;
+    plan.bam_path = bam_path;
+    plan.bam_size = int64_t(file_size(bam_path));
+
+    // The first record starts right after the header
+    int64_t first_offset = bgzf_tell(bam_file->fp.bgzf);
+
+    // Interior boundaries, -1 if the boundary falls past the last record (find_record_start throws rather than
+    // returning -1 for a boundary it cannot place)
+    vector<int64_t> boundaries(n_shards - 1, -1);
+
+    auto guess_from_size = [&](double compressed_offset){
+        return find_record_start(bam_path, int64_t(compressed_offset), bam_header->n_targets);
+    };
+
+    hts_idx_t* index = sam_index_load(bam_file, bam_path.string().c_str());
+
+    if (index != nullptr){
+        // Cumulative number of records per contig, the unplaced reads come last in a sorted BAM
+        vector<uint64_t> counts;
+        uint64_t total = 0;
+        for (int32_t tid=0; tid<bam_header->n_targets; tid++){
+            uint64_t mapped = 0;
+            uint64_t unmapped = 0;
+            hts_idx_get_stat(index, tid, &mapped, &unmapped);
+            counts.emplace_back(mapped + unmapped);
+            total += mapped + unmapped;
+        }
+
+        uint64_t placed = total;
+        uint64_t unplaced = hts_idx_get_n_no_coor(index);
+        total += unplaced;
+
+        int64_t unplaced_offset = -1;
+        hts_itr_t* iterator = sam_itr_queryi(index, HTS_IDX_NOCOOR, 0, 0);
+        if (iterator != nullptr){
+            if (not iterator->finished){
+                unplaced_offset = int64_t(iterator->curr_off);
+            }
+            hts_itr_destroy(iterator);
+        }
+
+        for (size_t k=1; k<n_shards; k++){
+            uint64_t target = total*k/n_shards;
+
+            if (target >= placed){
+                // Within the unplaced reads there is nothing to look up, so split them by compressed size
+                if (unplaced_offset >= 0 and unplaced > 0){
+                    double start = double(unplaced_offset >> 16);
+                    double fraction = double(target - placed)/double(unplaced);
+                    int64_t guess = guess_from_size(start + fraction*(double(plan.bam_size) - start));
+                    boundaries[k-1] = (guess < 0) ? -1 : max(guess, unplaced_offset);
+                }
+                continue;
+            }
+
+            // Locate the contig and (assuming uniform depth) the position of the target record
+            int32_t tid = 0;
+            uint64_t cumulative = 0;
+            while (cumulative + counts[tid] <= target){
+                cumulative += counts[tid];
+                tid++;
+            }
+
+            int64_t length = bam_header->target_len[tid];
+            int64_t position = int64_t(double(length)*double(target - cumulative)/double(counts[tid]));
+
+            // The first chunk of a query starts at a record that may overlap the position, which is all we need
+            for (int64_t start: {position, int64_t(0)}){
+                iterator = sam_itr_queryi(index, tid, int(start), int(length));
+                if (iterator != nullptr){
+                    bool found = (iterator->n_off > 0);
+                    if (found){
+                        boundaries[k-1] = int64_t(iterator->off[0].u);
+                    }
+                    hts_itr_destroy(iterator);
+                    if (found){
+                        break;
+                    }
+                }
+            }
+
+            // Nothing found at all: repeat the previous boundary (empty shard)
+            if (boundaries[k-1] < 0){
+                boundaries[k-1] = (k > 1) ? boundaries[k-2] : first_offset;
+            }
+        }
+
+        hts_idx_destroy(index);
+    }
+    else{
+        for (size_t k=1; k<n_shards; k++){
+            boundaries[k-1] = guess_from_size(double(plan.bam_size)*double(k)/double(n_shards));
+        }
+    }
+
+    bam_hdr_destroy(bam_header);
+    hts_close(bam_file);
+
+    // Boundaries must not decrease, and once one is past the last record so are all the following ones
+    int64_t begin = first_offset;
+    for (size_t k=0; k<n_shards; k++){
+        int64_t end = -1;
+
+        if (k + 1 < n_shards and begin >= 0 and boundaries[k] >= 0){
+            end = max(begin, boundaries[k]);
+        }
+
+        plan.shards.push_back({begin, end});
+        begin = end;
+    }
+
+    return plan;
+}
+
+
+void ShardPlan::write(path plan_path) const{
+    ofstream file(plan_path);
+
+    if (not (file.is_open() and file.good())){
+        throw runtime_error("ERROR: file could not be written: " + plan_path.string());
+    }
+
+    file << plan_magic << '\t' << bam_path.string() << '\t' << bam_size << '\n';
+    file << "shard" << '\t' << "begin" << '\t' << "end" << '\n';
+
+    for (size_t i=0; i<shards.size(); i++){
+        file << i << '\t' << shards[i].begin << '\t' << shards[i].end << '\n';
+    }
+}
+
+
+ShardPlan ShardPlan::load(path plan_path){
+    ifstream file(plan_path);
+
+    if (not (file.is_open() and file.good())){
+        throw runtime_error("ERROR: could not read shard plan: " + plan_path.string());
+    }
+
+    ShardPlan plan;
+    string line;
+    string magic;
+    string bam_path;
+
+    getline(file, line);
+    stringstream s(line);
+    getline(s, magic, '\t');
+    getline(s, bam_path, '\t');
+    s >> plan.bam_size;
+
+    if (magic != plan_magic or s.fail()){
+        throw runtime_error("ERROR: not a shard plan: " + plan_path.string());
+    }
+    plan.bam_path = bam_path;
+
+    // Column names
+    getline(file, line);
+
+    while (getline(file, line)){
+        if (line.empty()){
+            continue;
+        }
+
+        size_t index;
+        Shard shard;
+        stringstream l(line);
+        l >> index >> shard.begin >> shard.end;
+
+        if (l.fail() or index != plan.shards.size()){
+            throw runtime_error("ERROR: unexpected line in shard plan " + plan_path.string() + ": " + line);
+        }
+
+        plan.shards.emplace_back(shard);
+    }
+
+    return plan;
+}
+
+
+const ShardPlan::Shard& ShardPlan::get_shard(size_t index, path bam_path) const{
+    if (index >= shards.size()){
+        throw runtime_error("ERROR: shard " + to_string(index) + " does not exist, the plan has " +
+                            to_string(shards.size()) + " shards");
+    }
+
+    if (int64_t(file_size(bam_path)) != bam_size){
+        throw runtime_error("ERROR: BAM " + bam_path.string() + " is not the one the shard plan was made for (" +
+                            this->bam_path.string() + ")");
+    }
+
+    return shards[index];
+}
+
+
+}
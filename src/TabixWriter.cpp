@@ -0,0 +1,264 @@
+#include "TabixWriter.hpp"
+#include "htslib/include/htslib/bgzf.h"
+#include "htslib/include/htslib/tbx.h"
+
+#include <stdexcept>
+#include <cstring>
+
+using std::runtime_error;
+using std::to_string;
+
+
+namespace gfase {
+
+
+// Empty block that marks the end of a BGZF file
+static const char bgzf_eof[28] = {
+        '\x1f', '\x8b', '\x08', '\x04', '\x00', '\x00', '\x00', '\x00', '\x00', '\xff', '\x06', '\x00', '\x42', '\x43',
+        '\x02', '\x00', '\x1b', '\x00', '\x03', '\x00', '\x00', '\x00', '\x00', '\x00', '\x00', '\x00', '\x00', '\x00'
+};
+
+// Same bins as tabix itself
+static const int min_shift = 14;
+static const int n_levels = 5;
+
+
+TabixWriter::TabixWriter(path output_path, const vector<string>& ref_names, htsThreadPool* pool, int compression_level):
+        output_path(output_path),
+        ref_names(ref_names),
+        compression_level(compression_level),
+        file(output_path),
+        pool(nullptr),
+        queue(nullptr),
+        queue_size(0),
+        n_in_flight(0),
+        block(new Block{"", {}, "", compression_level, false}),
+        address(0),
+        index(nullptr),
+        has_records(false),
+        closed(false)
+{
+    if (not (file.is_open() and file.good())){
+        throw runtime_error("ERROR: file could not be written: " + output_path.string());
+    }
+
+    if (pool != nullptr and pool->pool != nullptr){
+        this->pool = pool->pool;
+
+        // A few blocks per thread keep every thread busy while this one formats lines
+        queue_size = 2*hts_tpool_size(this->pool);
+        queue = hts_tpool_process_init(this->pool, int(queue_size), 0);
+
+        if (queue == nullptr){
+            throw runtime_error("ERROR: could not create compression queue for: " + output_path.string());
+        }
+    }
+
+    block->data.reserve(BGZF_BLOCK_SIZE);
+}
+
+
+TabixWriter::~TabixWriter(){
+    if (queue != nullptr){
+        // Only if close() was not reached (e.g. an exception), the remaining blocks are dropped
+        while (n_in_flight > 0){
+            auto result = hts_tpool_next_result_wait(queue);
+            delete static_cast<Block*>(hts_tpool_result_data(result));
+            hts_tpool_delete_result(result, 0);
+            n_in_flight--;
+        }
+        hts_tpool_process_destroy(queue);
+    }
+
+    if (index != nullptr){
+        hts_idx_destroy(index);
+    }
+}
+
+
+void* TabixWriter::compress(void* arg){
+    auto b = static_cast<Block*>(arg);
+
+    size_t length = BGZF_MAX_BLOCK_SIZE;
+    b->compressed.resize(length);
+
+    if (bgzf_compress(&b->compressed[0], &length, b->data.data(), b->data.size(), b->compression_level) < 0){
+        b->failed = true;
+    }
+
+    b->compressed.resize(length);
+
+    return b;
+}
+
+
+void TabixWriter::write_meta(const string& line){
+    if (has_records){
+        throw runtime_error("ERROR: header lines must precede the records of: " + output_path.string());
+    }
+    if (line.empty() or line[0] != '#'){
+        throw runtime_error("ERROR: header lines must start with '#': " + line);
+    }
+
+    if (block->data.size() + line.size() + 1 > BGZF_BLOCK_SIZE){
+        dispatch();
+    }
+
+    block->data += line;
+    block->data += '\n';
+}
+
+
+void TabixWriter::write_record(int32_t ref_id, int32_t start, int32_t end, const string& line){
+    if (ref_id < 0 or size_t(ref_id) >= ref_names.size()){
+        throw runtime_error("ERROR: reference index out of range in: " + output_path.string());
+    }
+    if (line.size() + 1 > BGZF_BLOCK_SIZE){
+        throw runtime_error("ERROR: line too long for a BGZF block in: " + output_path.string());
+    }
+
+    // Records start in a new block, whose address is then the first offset of the index
+    if (not has_records){
+        dispatch();
+        has_records = true;
+    }
+
+    if (block->data.size() + line.size() + 1 > BGZF_BLOCK_SIZE){
+        dispatch();
+    }
+
+    block->data += line;
+    block->data += '\n';
+    block->entries.push_back({ref_id, start, end, uint32_t(block->data.size())});
+}
+
+
+void TabixWriter::dispatch(){
+    if (block->data.empty()){
+        return;
+    }
+
+    unique_ptr<Block> next(new Block{"", {}, "", compression_level, false});
+    next->data.reserve(BGZF_BLOCK_SIZE);
+    std::swap(block, next);
+
+    if (queue == nullptr){
+        compress(next.get());
+        write_block(*next);
+        return;
+    }
+
+    // Never more blocks in flight than the queue holds, so dispatching does not wait on results nobody collects
+    if (n_in_flight >= queue_size){
+        write_next_result(true);
+    }
+
+    if (hts_tpool_dispatch(pool, queue, compress, next.get()) < 0){
+        throw runtime_error("ERROR: could not queue compression for: " + output_path.string());
+    }
+    next.release();
+    n_in_flight++;
+
+    // Write whatever is done already without waiting
+    write_next_result(false);
+}
+
+
+void TabixWriter::write_next_result(bool wait){
+    while (n_in_flight > 0){
+        auto result = wait ? hts_tpool_next_result_wait(queue) : hts_tpool_next_result(queue);
+        if (result == nullptr){
+            return;
+        }
+
+        unique_ptr<Block> b(static_cast<Block*>(hts_tpool_result_data(result)));
+        hts_tpool_delete_result(result, 0);
+        n_in_flight--;
+
+        write_block(*b);
+
+        if (wait){
+            return;
+        }
+    }
+}
+
+
+void TabixWriter::write_block(Block& b){
+    if (b.failed){
+        throw runtime_error("ERROR: could not compress block of: " + output_path.string());
+    }
+
+    for (auto& e: b.entries){
+        uint64_t offset = uint64_t(address) << 16 | e.block_offset;
+
+        if (index == nullptr){
+            index = hts_idx_init(0, HTS_FMT_TBI, uint64_t(address) << 16, min_shift, n_levels);
+        }
+
+        if (hts_idx_push(index, e.ref_id, e.start, e.end, offset, 1) < 0){
+            throw runtime_error("ERROR: records are not sorted by reference and start in: " + output_path.string());
+        }
+    }
+
+    file.write(b.compressed.data(), std::streamsize(b.compressed.size()));
+    address += int64_t(b.compressed.size());
+}
+
+
+void TabixWriter::set_index_meta(){
+    // As written by tabix: the configuration, the length of the names, and the null terminated names in index order
+    string names;
+    for (auto& name: ref_names){
+        names += name;
+        names += '\0';
+    }
+
+    const tbx_conf_t& conf = tbx_conf_bed;
+    int32_t header[7] = {conf.preset, conf.sc, conf.bc, conf.ec, conf.meta_char, conf.line_skip, int32_t(names.size())};
+
+    vector<uint8_t> meta(sizeof(header) + names.size());
+    memcpy(meta.data(), header, sizeof(header));
+    memcpy(meta.data() + sizeof(header), names.data(), names.size());
+
+    if (hts_idx_set_meta(index, uint32_t(meta.size()), meta.data(), 1) < 0){
+        throw runtime_error("ERROR: could not build index of: " + output_path.string());
+    }
+}
+
+
+void TabixWriter::close(){
+    if (closed){
+        return;
+    }
+
+    dispatch();
+
+    while (n_in_flight > 0){
+        write_next_result(true);
+    }
+
+    if (index == nullptr){
+        index = hts_idx_init(0, HTS_FMT_TBI, uint64_t(address) << 16, min_shift, n_levels);
+    }
+
+    hts_idx_finish(index, uint64_t(address) << 16);
+
+    file.write(bgzf_eof, sizeof(bgzf_eof));
+    file.close();
+
+    if (not file.good()){
+        throw runtime_error("ERROR: could not write to file: " + output_path.string());
+    }
+
+    set_index_meta();
+
+    if (hts_idx_save(index, output_path.string().c_str(), HTS_FMT_TBI) < 0){
+        throw runtime_error("ERROR: could not write index: " + output_path.string() + ".tbi");
+    }
+
+    closed = true;
+}
+
+
+}
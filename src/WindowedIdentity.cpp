@@ -0,0 +1,195 @@
+#include "WindowedIdentity.hpp"
+#include "BinaryIO.hpp"
+
+#include <stdexcept>
+#include <algorithm>
+#include <fstream>
+#include <cmath>
+
+using std::runtime_error;
+using std::ofstream;
+using std::min;
+using std::max;
+
+
+namespace gfase {
+
+
+WindowedIdentity::WindowedIdentity(const vector<string>& ref_names, const vector<int64_t>& ref_lengths, int64_t window_size):
+        ref_names(ref_names),
+        ref_lengths(ref_lengths),
+        window_size(window_size),
+        windows(ref_names.size())
+{
+    if (window_size <= 0){
+        throw runtime_error("ERROR: window size must be positive");
+    }
+}
+
+
+vector<WindowedIdentity::Window>& WindowedIdentity::get_contig(int32_t ref_id){
+    auto& contig = windows[ref_id];
+
+    if (contig.empty()){
+        contig.resize(max(int64_t(1), (ref_lengths[ref_id] + window_size - 1) / window_size));
+    }
+
+    return contig;
+}
+
+
+void WindowedIdentity::add_alignment(const SamElement& e, int64_t max_indel_length){
+    if (e.ref_id < 0 or size_t(e.ref_id) >= windows.size()){
+        return;
+    }
+
+    auto& contig = get_contig(e.ref_id);
+    int64_t last_window = int64_t(contig.size()) - 1;
+
+    // Split a reference span over the windows it overlaps, calling f(window, n_bases) for each piece
+    auto for_each_overlap = [&](int64_t start, int64_t length, auto f){
+        int64_t stop = start + length;
+        while (start < stop){
+            int64_t w = min(start / window_size, last_window);
+            int64_t window_stop = (w == last_window) ? stop : min(stop, (w + 1)*window_size);
+            f(contig[w], window_stop - start);
+            start = window_stop;
+        }
+    };
+
+    int64_t ref_pos = e.start_pos;
+
+    e.for_each_cigar([&](auto type, auto length){
+        if (type == '='){
+            for_each_overlap(ref_pos, length, [](Window& w, int64_t n){
+                w.matches += n;
+                w.covered_bases += n;
+            });
+            ref_pos += length;
+        }
+        else if (type == 'X'){
+            for_each_overlap(ref_pos, length, [](Window& w, int64_t n){
+                w.nonmatches += n;
+                w.covered_bases += n;
+            });
+            ref_pos += length;
+        }
+        else if (type == 'D'){
+            bool counted = (length <= max_indel_length);
+            for_each_overlap(ref_pos, length, [&](Window& w, int64_t n){
+                if (counted){
+                    w.nonmatches += n;
+                }
+                w.covered_bases += n;
+            });
+            ref_pos += length;
+        }
+        else if (type == 'I'){
+            // Insertions have no reference span, attribute them to the window they occur in
+            if (length <= max_indel_length){
+                contig[min(ref_pos / window_size, last_window)].nonmatches += length;
+            }
+        }
+        else if (type == 'N'){
+            ref_pos += length;
+        }
+    });
+}
+
+
+void WindowedIdentity::operator+=(const WindowedIdentity& other){
+    if (other.window_size != window_size or other.windows.size() != windows.size()){
+        throw runtime_error("ERROR: cannot combine windowed identity with different windows or references");
+    }
+
+    for (size_t i=0; i<windows.size(); i++){
+        if (other.windows[i].empty()){
+            continue;
+        }
+
+        auto& contig = get_contig(int32_t(i));
+
+        for (size_t w=0; w<contig.size(); w++){
+            contig[w].matches += other.windows[i][w].matches;
+            contig[w].nonmatches += other.windows[i][w].nonmatches;
+            contig[w].covered_bases += other.windows[i][w].covered_bases;
+        }
+    }
+}
+
+
+void WindowedIdentity::write_binary(ostream& o) const{
+    write_value(o, window_size);
+    write_value(o, uint64_t(windows.size()));
+
+    for (auto& contig: windows){
+        write_vector(o, contig);
+    }
+}
+
+
+void WindowedIdentity::read_binary(istream& i){
+    int64_t other_window_size;
+    uint64_t n_contigs;
+
+    read_value(i, other_window_size);
+    read_value(i, n_contigs);
+
+    if (other_window_size != window_size or n_contigs != windows.size()){
+        throw runtime_error("ERROR: windowed identity in binary file has different windows or references");
+    }
+
+    for (auto& contig: windows){
+        read_vector(i, contig);
+    }
+}
+
+
+void WindowedIdentity::for_each_window(const function<void(int32_t ref_id, int64_t start, int64_t end, const Window& window)>& f) const{
+    for (size_t i=0; i<windows.size(); i++){
+        for (size_t w=0; w<windows[i].size(); w++){
+            auto& window = windows[i][w];
+
+            if (window.covered_bases == 0){
+                continue;
+            }
+
+            int64_t start = int64_t(w)*window_size;
+            int64_t end = min(start + window_size, ref_lengths[i]);
+
+            f(int32_t(i), start, end, window);
+        }
+    }
+}
+
+
+void WindowedIdentity::write_to_bedgraph(path output_path) const{
+    ofstream file(output_path);
+
+    if (not (file.is_open() and file.good())){
+        throw runtime_error("ERROR: file could not be written: " + output_path.string());
+    }
+
+    file << "#chr" << "\tstart_pos" << "\tend_pos" << "\tidentity" << "\tmean_depth" << "\tmatches" << "\tnonmatches" << '\n';
+    file << "track type=bedGraph name=\"windowed_identity\" autoScale=on\n";
+
+    for_each_window([&](int32_t ref_id, int64_t start, int64_t end, const Window& window){
+        double identity = 0;
+        if (window.matches + window.nonmatches > 0){
+            identity = round(10000000*double(window.matches) / double(window.matches + window.nonmatches))/10000000;
+        }
+
+        double mean_depth = double(window.covered_bases) / double(max(int64_t(1), end - start));
+
+        file << ref_names[ref_id] << '\t'
+             << start << '\t'
+             << end << '\t'
+             << identity << '\t'
+             << mean_depth << '\t'
+             << window.matches << '\t'
+             << window.nonmatches << '\n';
+    });
+}
+
+
+}
@@ -0,0 +1,356 @@
+#include "AlignmentSummaryStore.hpp"
+#include "SampleMetrics.hpp"
+#include "Filesystem.hpp"
+#include "Bam.hpp"
+#include "htslib/include/htslib/sam.h"
+
+#include "benchmark/benchmark.h"
+
+using ghc::filesystem::temp_directory_path;
+using ghc::filesystem::create_directories;
+using ghc::filesystem::remove_all;
+using ghc::filesystem::file_size;
+using ghc::filesystem::path;
+using gfase::AlignmentSummaryStore;
+using gfase::SampleMetrics;
+using gfase::SamElement;
+using gfase::Bam;
+
+#include <unordered_map>
+#include <stdexcept>
+#include <iostream>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+#include <cmath>
+
+#include <unistd.h>
+
+using std::unordered_map;
+using std::runtime_error;
+using std::to_string;
+using std::mt19937;
+using std::string;
+using std::vector;
+using std::cerr;
+
+
+// Set up by main() before any benchmark runs
+static path small_bam_path;
+static path large_bam_path;
+static path scratch_dir;
+
+
+/// Write a BAM made of the records of bam_path repeated n times. Each copy is shifted by its index (when that
+/// stays within the contig), so that copies are distinct alignments and are not collapsed by deduplication.
+void write_replicated_bam(path bam_path, path output_path, int64_t n){
+    samFile* in = hts_open(bam_path.string().c_str(), "r");
+    if (in == nullptr){
+        throw runtime_error("ERROR: could not read BAM: " + bam_path.string());
+    }
+
+    bam_hdr_t* header = sam_hdr_read(in);
+    if (header == nullptr){
+        throw runtime_error("ERROR: could not read header of BAM: " + bam_path.string());
+    }
+
+    vector<bam1_t*> records;
+    bam1_t* record = bam_init1();
+    while (sam_read1(in, header, record) >= 0){
+        records.emplace_back(bam_dup1(record));
+    }
+    bam_destroy1(record);
+    hts_close(in);
+
+    samFile* out = hts_open(output_path.string().c_str(), "wb");
+    if (out == nullptr or sam_hdr_write(out, header) < 0){
+        throw runtime_error("ERROR: could not write BAM: " + output_path.string());
+    }
+
+    for (int64_t i=0; i<n; i++){
+        for (auto r: records){
+            int64_t pos = r->core.pos;
+            bool placed = (r->core.tid >= 0 and pos >= 0);
+
+            if (placed and bam_endpos(r) + i < int64_t(header->target_len[r->core.tid])){
+                r->core.pos = int32_t(pos + i);
+            }
+
+            if (sam_write1(out, header, r) < 0){
+                throw runtime_error("ERROR: could not write BAM: " + output_path.string());
+            }
+
+            r->core.pos = int32_t(pos);
+        }
+    }
+
+    hts_close(out);
+
+    for (auto r: records){
+        bam_destroy1(r);
+    }
+    bam_hdr_destroy(header);
+}
+
+
+/// Synthetic long read alignment: =/X runs with the occasional small and large indel
+SamElement make_alignment(mt19937& rng, size_t n_operations){
+    SamElement e;
+    e.mapq = 60;
+    e.ref_id = 0;
+    e.start_pos = 0;
+
+    std::uniform_int_distribution<uint32_t> match_length(1, 200);
+    std::uniform_int_distribution<uint32_t> indel_length(1, 100);
+    std::uniform_int_distribution<int> choice(0, 9);
+
+    for (size_t i=0; i<n_operations; i++){
+        int c = choice(rng);
+        if (i % 2 == 0){
+            e.cigars.emplace_back(bam_cigar_gen(match_length(rng), BAM_CEQUAL));
+        }
+        else if (c < 6){
+            e.cigars.emplace_back(bam_cigar_gen(1, BAM_CDIFF));
+        }
+        else if (c < 8){
+            e.cigars.emplace_back(bam_cigar_gen(indel_length(rng), BAM_CINS));
+        }
+        else{
+            e.cigars.emplace_back(bam_cigar_gen(indel_length(rng), BAM_CDEL));
+        }
+    }
+
+    return e;
+}
+
+
+static void read_bam(benchmark::State& state, const path& bam_path){
+    int64_t n_records = 0;
+
+    for (auto _: state){
+        Bam bam(bam_path);
+        bam.for_alignment_in_bam(true, true, [&](SamElement& e){
+            benchmark::DoNotOptimize(e.cigars.data());
+            n_records++;
+        });
+    }
+
+    state.SetItemsProcessed(n_records);
+    state.SetBytesProcessed(int64_t(state.iterations())*int64_t(file_size(bam_path)));
+}
+
+
+static void BM_read_bam_small(benchmark::State& state){
+    read_bam(state, small_bam_path);
+}
+
+
+static void BM_read_bam_large(benchmark::State& state){
+    read_bam(state, large_bam_path);
+}
+
+
+/// Same branching as SampleMetrics::add_alignment
+static void BM_cigar_loop(benchmark::State& state){
+    mt19937 rng(42);
+    vector<SamElement> alignments;
+    for (size_t i=0; i<1000; i++){
+        alignments.emplace_back(make_alignment(rng, size_t(state.range(0))));
+    }
+
+    int64_t max_indel_length = 50;
+
+    for (auto _: state){
+        for (auto& e: alignments){
+            int64_t matches = 0;
+            int64_t nonmatches = 0;
+            int64_t indels = 0;
+
+            e.for_each_cigar([&](auto type, auto length){
+                if (type == '='){
+                    matches += length;
+                }
+                else if (type == 'X'){
+                    nonmatches += length;
+                }
+                else if (type == 'I' or type == 'D'){
+                    if (length <= max_indel_length){
+                        nonmatches += length;
+                    }
+                    else {
+                        indels += 1;
+                    }
+                }
+            });
+
+            benchmark::DoNotOptimize(matches + nonmatches + indels);
+        }
+    }
+
+    state.SetItemsProcessed(int64_t(state.iterations())*int64_t(alignments.size())*state.range(0));
+}
+
+
+/// Identity histogram as filled by SampleMetrics (7 decimals)
+static void BM_identity_histogram(benchmark::State& state){
+    mt19937 rng(42);
+    std::uniform_real_distribution<double> identity(0.8, 1.0);
+
+    vector<double> values;
+    for (size_t i=0; i<100000; i++){
+        values.emplace_back(round(10000000*identity(rng))/10000000);
+    }
+
+    for (auto _: state){
+        unordered_map<double, int64_t> distribution;
+        for (auto x: values){
+            distribution[x]++;
+        }
+        benchmark::DoNotOptimize(distribution.size());
+    }
+
+    state.SetItemsProcessed(int64_t(state.iterations())*int64_t(values.size()));
+}
+
+
+void fill_store(AlignmentSummaryStore& store, size_t n, mt19937& rng){
+    std::uniform_int_distribution<int32_t> position(0, 100000000);
+
+    Bam::AlignmentSummary summary = {};
+    for (size_t i=0; i<n; i++){
+        summary.ref_id = int32_t(i % 24);
+        summary.start = position(rng);
+        summary.end = summary.start + 10000;
+        summary.matches = 9900;
+        summary.nonmatches = 100;
+        summary.scaled_identity = 9900000;
+        summary.mapq = 60;
+
+        store.add(summary, "read_" + to_string(i) + "_ch" + to_string(i % 512));
+    }
+}
+
+
+/// Hashing, deduplication and name storage of the per-alignment summaries (formerly the unique key string)
+static void BM_summary_store_add(benchmark::State& state){
+    vector<string> ref_names;
+    for (size_t i=0; i<24; i++){
+        ref_names.emplace_back("chr" + to_string(i + 1));
+    }
+
+    size_t n = size_t(state.range(0));
+
+    for (auto _: state){
+        mt19937 rng(42);
+        AlignmentSummaryStore store(ref_names, scratch_dir, nullptr);
+        fill_store(store, n, rng);
+    }
+
+    state.SetItemsProcessed(int64_t(state.iterations())*int64_t(n));
+}
+
+
+/// Sorting and writing alignment_summary_*.tsv
+static void BM_summary_store_write_tsv(benchmark::State& state){
+    vector<string> ref_names;
+    for (size_t i=0; i<24; i++){
+        ref_names.emplace_back("chr" + to_string(i + 1));
+    }
+
+    mt19937 rng(42);
+    AlignmentSummaryStore store(ref_names, scratch_dir, nullptr);
+    fill_store(store, size_t(state.range(0)), rng);
+
+    path output_path = scratch_dir / "alignment_summary.tsv";
+    int64_t n_bytes = 0;
+
+    for (auto _: state){
+        store.write_tsv(output_path);
+        n_bytes += int64_t(file_size(output_path));
+    }
+
+    state.SetItemsProcessed(int64_t(state.iterations())*state.range(0));
+    state.SetBytesProcessed(n_bytes);
+}
+
+
+/// Everything wam does for one BAM except the external sort: decoding, accumulating, and writing the state
+static void end_to_end(benchmark::State& state, const path& bam_path){
+    int64_t n_records = 0;
+    path output_dir = scratch_dir / "end_to_end";
+
+    for (auto _: state){
+        create_directories(output_dir);
+
+        Bam bam(bam_path);
+        SampleMetrics metrics({}, bam.get_ref_names(), bam.get_ref_lengths(), bam.is_coordinate_sorted(), output_dir);
+        bam.set_detail_filter(SampleMetrics::min_mapq);
+
+        bam.for_alignment_in_bam(true, true, [&](SamElement& e){
+            metrics.add_alignment(e);
+            n_records++;
+        });
+
+        metrics.write_state(output_dir / SampleMetrics::state_filename);
+
+        state.PauseTiming();
+        remove_all(output_dir);
+        state.ResumeTiming();
+    }
+
+    state.SetItemsProcessed(n_records);
+    state.SetBytesProcessed(int64_t(state.iterations())*int64_t(file_size(bam_path)));
+}
+
+
+static void BM_end_to_end_small(benchmark::State& state){
+    end_to_end(state, small_bam_path);
+}
+
+
+static void BM_end_to_end_large(benchmark::State& state){
+    end_to_end(state, large_bam_path);
+}
+
+
+BENCHMARK(BM_read_bam_small)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_read_bam_large)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_cigar_loop)->Arg(20)->Arg(2000);
+BENCHMARK(BM_identity_histogram);
+BENCHMARK(BM_summary_store_add)->Arg(100000)->Arg(1000000)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_summary_store_write_tsv)->Arg(100000)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_end_to_end_small)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_end_to_end_large)->Unit(benchmark::kMillisecond);
+
+
+int main(int argc, char** argv){
+    path script_path = __FILE__;
+    path project_directory = script_path.parent_path().parent_path().parent_path();
+
+    small_bam_path = project_directory / "testdata" / "reads_minimap2.bam";
+
+    // Size of the generated BAM, as a number of copies of the test BAM
+    int64_t n_replicates = 200;
+    if (auto value = getenv("WAMBAM_BENCH_REPLICATES")){
+        n_replicates = std::stoll(value);
+    }
+
+    scratch_dir = temp_directory_path() / ("wambam_bench." + to_string(getpid()));
+    create_directories(scratch_dir);
+
+    large_bam_path = scratch_dir / "replicated.bam";
+    write_replicated_bam(small_bam_path, large_bam_path, n_replicates);
+
+    cerr << "Generated " << large_bam_path << " (" << file_size(large_bam_path)/(1024*1024) << " MB)" << '\n';
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)){
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+
+    remove_all(scratch_dir);
+
+    return 0;
+}
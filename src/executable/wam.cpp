@@ -1,265 +1,1256 @@
 #include "Filesystem.hpp"
 #include "CLI11.hpp"
+#include "SampleMetrics.hpp"
+#include "SampleComparison.hpp"
+#include "ReadMetrics.hpp"
+#include "FastqReader.hpp"
+#include "BamFollower.hpp"
+#include "ProgressReporter.hpp"
+#include "RunCheckpoint.hpp"
+#include "CoverageTrack.hpp"
+#include "ShardPlan.hpp"
+#include "RunStats.hpp"
 #include "Bam.hpp"
+#include "htslib/include/htslib/thread_pool.h"
 
+using ghc::filesystem::directory_iterator;
 using ghc::filesystem::path;
 using ghc::filesystem::exists;
+using ghc::filesystem::file_size;
+using ghc::filesystem::is_directory;
 using ghc::filesystem::create_directories;
+using ghc::filesystem::rename;
+using ghc::filesystem::remove;
+using gfase::AlignmentSummaryStore;
+using gfase::DistributionSummary;
+using gfase::SampleComparison;
+using gfase::ReadMetrics;
+using gfase::FastqReader;
+using gfase::ProgressReporter;
+using gfase::CoverageTrack;
+using gfase::SampleMetrics;
+using gfase::BamFollower;
 using gfase::SamElement;
+using gfase::RunCheckpoint;
+using gfase::ShardPlan;
+using gfase::ScopedTimer;
+using gfase::RunStats;
 using gfase::Bam;
-using AlignmentSummary = gfase::Bam::AlignmentSummary;
 
+#include <condition_variable>
 #include <unordered_map>
+#include <unordered_set>
 #include <algorithm>
 #include <stdexcept>
 #include <iostream>
 #include <fstream>
-#include <utility>
+#include <sstream>
+#include <cstring>
+#include <csignal>
+#include <thread>
+#include <atomic>
 #include <string>
+#include <chrono>
+#include <mutex>
+#include <cctype>
 
+using std::condition_variable;
 using std::unordered_map;
-using std::sort;
+using std::unordered_set;
 using std::runtime_error;
-using std::ofstream;
-using std::cerr;
+using std::stringstream;
+using std::exception;
+using std::unique_ptr;
+using std::make_unique;
+using std::make_shared;
+using std::shared_ptr;
+using std::unique_lock;
 using std::pair;
+using std::lock_guard;
+using std::ifstream;
+using std::thread;
+using std::atomic;
+using std::mutex;
+using std::cerr;
 using std::string;
+using std::sort;
+using std::min;
+using std::max;
+using std::chrono::steady_clock;
+using std::chrono::duration_cast;
+using std::chrono::seconds;
 
-// bool compareRecords(const Record& a, const Record& b) {
-//     if (a.chromosome == b.chromosome) {
-//         return a.startPosition < b.startPosition;
-//     }
-//     return a.chromosome < b.chromosome;
-// }
 
-template<class T1, class T2> void write_sorted_distribution_to_file(const unordered_map<T1,T2>& distribution, path output_path){
-    vector <pair <T1, T2> > sorted_distribution(distribution.size());
+void sanitize_directory_name(string& name){
+    for (auto& c: name){
+        if (not (isalnum(c) or c == '-' or c == '_' or c == '.')){
+            c = '_';
+        }
+    }
 
-    size_t i=0;
-    for (auto& [key,count]: distribution){
-        sorted_distribution[i] = {key, count};
-        i++;
+    if (name.empty() or name == "." or name == ".."){
+        name = "_" + name;
     }
+}
 
-    sort(sorted_distribution.begin(), sorted_distribution.end(),[](pair<T1,T2>& a, pair<T1,T2>& b){
-        return a.first < b.first;
-    });
 
-    ofstream file(output_path);
+struct CheckpointOptions {
+    // Seconds between checkpoints, 0 to disable
+    int64_t interval = 600;
+    // Continue from the checkpoint in the output directory if there is one, skip the run if it completed already
+    bool resume = false;
+};
 
-    if (not (file.is_open() and file.good())){
-        throw runtime_error("ERROR: file could not be written: " + output_path.string());
-    }
 
-    for (auto& [key,count]: sorted_distribution){
-        file << key << ',' << count << '\n';
+struct StatsOptions {
+    // Write run_stats.json to the output directory
+    bool write_json = false;
+    // Also count hardware events in each stage (implies write_json)
+    bool perf_counters = false;
+};
+
+
+struct ProgressOptions {
+    // Seconds between progress reports, 0 to disable
+    int64_t interval = 60;
+    // Optional JSON status file, rewritten with every report
+    path status_path;
+};
+
+
+static const string stats_filename = "run_stats.json";
+
+
+/// Block offsets [begin, end) of the compressed bytes that a run over the BAM, or over one shard of it, reads
+pair<int64_t,int64_t> get_block_range(int64_t bam_size, const ShardPlan::Shard* shard){
+    if (shard == nullptr){
+        return {0, bam_size};
     }
+
+    int64_t begin = (shard->begin >= 0) ? (shard->begin >> 16) : bam_size;
+    int64_t end = (shard->end >= 0) ? (shard->end >> 16) : bam_size;
+
+    return {begin, end};
 }
 
-void sort_bedgraph(const std::string& input_file, const std::string& output_file) {
 
-    if (std::system("command -v bedtools > /dev/null 2>&1") != 0) {
-        std::cerr << "WARNING: bedtools is not installed or not in PATH." << std::endl;
-        std::cerr << "WARNING: alignment_summary.tsv should be sorted with command: bedtools sort -i alignment_summary.tsv > alignment_summary.sorted.bed" << std::endl;
-        return;
+/// Whether a run wrote its final state to output_dir, or to its subdirectories if it was demultiplexed. Only then
+/// does an output directory without a checkpoint mean that the run completed.
+bool has_final_state(path output_dir){
+    if (exists(output_dir / SampleMetrics::state_filename)){
+        return true;
     }
-    // Make the bedtools sort command
-    std::string command = "bedtools sort -i " + input_file + " > " + output_file;
-
-    // Run the command
-    int ret_code = std::system(command.c_str());
 
-    // Check the return code
-    if (ret_code != 0) {
-        std::cerr << "WARNING: bed file was not sorted " << ret_code << std::endl;
-        std::cerr << "WARNING: alignment_summary.tsv should be sorted with command: bedtools sort -i alignment_summary.tsv > alignment_summary.sorted.bed" << std::endl;
-        return;
-    } else {
-        std::cout << "Successfully sorted the BEDGraph file: " << output_file << std::endl;
+    for (auto& entry: directory_iterator(output_dir)){
+        if (is_directory(entry.path()) and exists(entry.path() / SampleMetrics::state_filename)){
+            return true;
+        }
     }
+
+    return false;
 }
 
-void write_sorted_alignment_summary_to_file(const unordered_map<string, AlignmentSummary>& distribution, path output_path) {
-    // Vector of pairs to sort the unordered_map
-    vector<pair<string, AlignmentSummary>> sorted_distribution(distribution.size());
-
-    // size_t i = 0;
-    // for (auto& [key, summary] : distribution) {
-    //     sorted_distribution[i] = {key, summary};
-    //     i++;
-    // }
-
-    ofstream file(output_path);
-    if (!(file.is_open() && file.good())) {
-        throw runtime_error("ERROR: file could not be written: " + output_path.string());
-    }
-
-    // write the header to the csv
-    file << "#chr" << "\tstart_pos" << "\tend_pos" << "\tidentity" << "\tmatches" << "\tnonmatches" << "\tlargeINDELs" << "\tlargeINDEL_total_length"
-                                                                << "\tinferred_len" << "\tmapq" << "\talignmentName" << "\n";
-      
-    // add bedGraph header 
-    file << "track type=bedGraph name=\"identity\" autoScale=on\n";
-
-                                                 
-
-    for (auto& [key, summary] : distribution) {
-        file << summary.ref_name << '\t'
-             << summary.start << '\t'
-             << summary.end << '\t'
-             << summary.identity << '\t'
-             << summary.matches << '\t'
-             << summary.nonmatches << '\t'
-             << summary.indels << '\t'
-             << summary.indel_length << '\t'
-             << summary.inferred_length << '\t'
-             << summary.mapq << '\t'
-             << key << '\n';
-    }
-    file.close();
-
-    std::cout << "Successfully wrote alignment summary file: " << output_path << std::endl;
-    std::cout << "Now sorting alignment summary into bedgraph." << std::endl;
-    sort_bedgraph(output_path, output_path.string()+".sorted.bed");
 
-}
+/// Process one BAM, or only the records of one shard of it if shard is not null. If requested, the time spent in
+/// each stage (and its hardware counters) is written to run_stats.json in the output directory. Progress (if not
+/// null) is told about the records and compressed bytes read.
+void get_identity_from_bam(path bam_path, path output_dir, const SampleMetrics::Options& options, const string& split_tag,
+                           htsThreadPool* pool, const CheckpointOptions& checkpointing, const StatsOptions& stats_options,
+                           ProgressReporter* progress, const ShardPlan::Shard* shard=nullptr){
+    RunStats stats;
+    RunStats* run_stats = stats_options.write_json ? &stats : nullptr;
+
+    // Before any stage is timed. The counters belong to this thread, which is the one that reads and processes.
+    if (stats_options.perf_counters){
+        try {
+            stats.enable_perf_counters();
+        }
+        catch (const exception& e){
+            cerr << "WARNING: hardware counters are not available, only timing is reported (" << e.what() << ")" << '\n';
+        }
+    }
+
+    path checkpoint_path = output_dir / RunCheckpoint::filename;
+    bool resuming = false;
 
-void get_identity_from_bam(path bam_path, path output_dir, int64_t max_indel_length){
     if (exists(output_dir)){
-        throw runtime_error("ERROR: output directory exists already");
+        if (not checkpointing.resume){
+            throw runtime_error("ERROR: output directory exists already");
+        }
+
+        if (exists(checkpoint_path)){
+            resuming = true;
+        }
+        else if (has_final_state(output_dir)){
+            cerr << "Skipping " << output_dir.string() << ", it has no checkpoint so it completed already" << '\n';
+
+            if (progress != nullptr){
+                auto [begin, end] = get_block_range(int64_t(file_size(bam_path)), shard);
+                progress->skip(max(int64_t(0), end - begin));
+            }
+            return;
+        }
+        else {
+            // Interrupted before its first checkpoint: start over in place, anything it wrote is overwritten (or
+            // removed, for spill files)
+            cerr << "Restarting " << output_dir.string() << ", it has neither a checkpoint nor results" << '\n';
+            AlignmentSummaryStore::remove_runs(output_dir);
+        }
     }
     else {
         create_directories(output_dir);
     }
 
     Bam bam_reader(bam_path);
+    bam_reader.set_run_stats(run_stats);
+
+    if (pool != nullptr and pool->pool != nullptr){
+        bam_reader.set_thread_pool(pool);
+    }
 
-    unordered_map<double, int64_t> identity_distribution;
-    unordered_map<size_t, int64_t> length_distribution;
-    // Unordered map to store alignment summaries by unique key
-    unordered_map<string, AlignmentSummary> alignment_summaries;
+    auto ref_names = bam_reader.get_ref_names();
+    auto ref_lengths = bam_reader.get_ref_lengths();
+    bool sorted = bam_reader.is_coordinate_sorted();
+    int64_t bam_size = int64_t(file_size(bam_path));
 
+    // Demultiplexing: the split tag is loaded last
+    auto tags = SampleMetrics::get_required_tags(options);
+    size_t split_tag_index = tags.size();
+    bool split = not split_tag.empty();
+    if (split){
+        tags.emplace_back(split_tag);
+    }
+    bam_reader.set_tags_to_load(tags);
+    bam_reader.set_detail_filter(SampleMetrics::min_mapq);
 
-    bam_reader.for_alignment_in_bam(true, [&](SamElement& e){
-//        cerr << e.ref_name << ' ' << e.query_name << ' ' << int(e.mapq) << ' ' << e.flag << '\n';
-        if (e.is_not_primary()){
-            return;
+    // Each value of the split tag (or just "" without demultiplexing) gets its own metrics and directory. Values
+    // are interned to small ids so that routing a read is a vector lookup (plus a hash lookup when the value
+    // differs from the previous read's).
+    unordered_map<string, size_t> split_ids;
+    unordered_set<string> directory_names;
+    vector<string> split_values;
+    vector<SampleMetrics> split_metrics;
+    string last_value;
+    size_t last_id = 0;
+    bool has_last = false;
+
+    auto add_value = [&](const string& value){
+        path directory = output_dir;
+
+        if (split){
+            string directory_name = value.empty() ? "unclassified" : value;
+            sanitize_directory_name(directory_name);
+
+            if (not directory_names.emplace(directory_name).second){
+                throw runtime_error("ERROR: two values of tag " + split_tag + " map to the same directory: " +
+                                    (output_dir / directory_name).string());
+            }
+
+            directory = output_dir / directory_name;
         }
 
-        if (not e.is_supplementary()){
-            length_distribution[e.query_length]++;
+        split_ids.emplace(value, split_values.size());
+        split_values.emplace_back(value);
+        return directory;
+    };
+
+    // Also moves the reader to the start of the range, which is what the checkpoint of a resumed run must match
+    auto checkpoint = RunCheckpoint::start(bam_reader, bam_size, shard);
+
+    if (resuming){
+        ifstream file(checkpoint_path, std::ios::binary);
+        auto previous = RunCheckpoint::read(file, checkpoint_path);
+
+        if (not previous.is_same_range(checkpoint)){
+            throw runtime_error("ERROR: checkpoint was made for a different BAM or shard: " + checkpoint_path.string());
         }
 
-        if (e.mapq < 1){
-            return;
+        for (auto& value: previous.values){
+            split_metrics.emplace_back(SampleMetrics::read_checkpoint(file, add_value(value), options.summary_budget));
         }
 
+        previous.seek(bam_reader);
+        cerr << "Resuming " << output_dir.string() << " from its checkpoint" << '\n';
+    }
+    else{
+        // An empty checkpoint right away (i.e. start over), so that an interrupted run is never mistaken for a
+        // complete one by --resume
+        vector<SampleMetrics> none;
+        checkpoint.write(output_dir, none);
+    }
 
-        int64_t matches = 0;
-        int64_t nonmatches = 0;
-        // I or D > 50bps ( max_indel_length )
-        int64_t indels = 0;
-        int64_t indel_total_length = 0;
-        int64_t inferred_query_length = 0;
-        int64_t alignment_end = e.start_pos;
+    if (not split and split_metrics.empty()){
+        // Runs spilled before the first checkpoint of an interrupted run
+        if (resuming){
+            AlignmentSummaryStore::remove_runs(output_dir);
+        }
 
-        e.for_each_cigar([&](auto type, auto length){
-            if (type == '='){
-                matches += length;
-                inferred_query_length += length;
-                alignment_end += length;
-            }
-            else if (type == 'X'){
-                nonmatches += length;
-                inferred_query_length += length;
-                alignment_end += length;
-            }
-            else if (type == 'I'){
-                if (length <= max_indel_length){
-                    nonmatches += length;
+        split_metrics.emplace_back(options, ref_names, ref_lengths, sorted, add_value(""));
+    }
+
+    for (auto& metrics: split_metrics){
+        metrics.set_run_stats(run_stats);
+        metrics.set_thread_pool(pool);
+        metrics.set_summary_formats(options.write_bed_gz, options.write_arrow);
+    }
+
+    int64_t interval = checkpointing.interval;
+    if (interval > 0 and options.write_coverage and not sorted){
+        cerr << "WARNING: periodic checkpoints are disabled, the coverage of an unsorted BAM is only written at the end" << '\n';
+        interval = 0;
+    }
+
+    // The difference arrays of an unsorted coverage track can't be spilled, so they may push the process past the
+    // budget on their own
+    if (options.write_coverage and not sorted and options.summary_budget and options.summary_budget->limit > 0){
+        int64_t coverage_bytes = CoverageTrack::get_max_unsorted_bytes(ref_lengths);
+
+        if (coverage_bytes > options.summary_budget->limit){
+            cerr << "WARNING: the coverage of an unsorted BAM needs up to " << coverage_bytes/(1024*1024) << " MB "
+                 << (split ? "for each value of the tag " : "") << "(4 bytes per reference base), more than 3/4 of "
+                 << "--max_memory. Sort the BAM to compute it in little memory" << '\n';
+        }
+    }
+
+    auto last_checkpoint = steady_clock::now();
+    int64_t n_since_check = 0;
+
+    RunStats::Stage* checkpoint_stage = run_stats ? &stats.get_stage("checkpoint") : nullptr;
+    int64_t begin_offset = bam_reader.get_virtual_offset();
+    int64_t n_records = 0;
+
+    // Progress is reported in block offsets every thousand records, anything before where reading starts (the
+    // header, or what was read before the checkpoint) counts as done already
+    auto [range_begin, range_end] = get_block_range(bam_size, shard);
+    int64_t progress_offset = begin_offset >> 16;
+    int64_t n_unreported = 0;
+
+    if (range_end <= range_begin){
+        progress = nullptr;
+    }
+    if (progress != nullptr){
+        progress->skip(progress_offset - range_begin);
+    }
+
+    bam_reader.for_alignment_in_bam(true, true, [&](SamElement& e){
+        if (split){
+            const string& value = e.tags[split_tag_index];
+
+            if (not has_last or value != last_value){
+                auto result = split_ids.find(value);
+
+                if (result == split_ids.end()){
+                    // The directory may exist already if it was created after the last checkpoint, along with
+                    // runs spilled there
+                    path split_dir = add_value(value);
+                    create_directories(split_dir);
+
+                    if (resuming){
+                        AlignmentSummaryStore::remove_runs(split_dir);
+                    }
+
+                    last_id = split_metrics.size();
+                    split_metrics.emplace_back(options, ref_names, ref_lengths, sorted, split_dir);
+                    split_metrics.back().set_run_stats(run_stats);
+                    split_metrics.back().set_thread_pool(pool);
                 }
-                else {
-                    indels += 1;
-                    indel_total_length += length;
+                else{
+                    last_id = result->second;
                 }
-                inferred_query_length += length;
+
+                last_value = value;
+                has_last = true;
             }
-            else if (type == 'D'){
-                if (length <= max_indel_length){
-                    nonmatches += length;
-                }
-                else {
-                    indels += 1;
-                    indel_total_length += length;
-                }
-                alignment_end += length;
+        }
+
+        split_metrics[last_id].add_alignment(e);
+        n_records++;
+
+        if (progress != nullptr and ++n_unreported == 1024){
+            int64_t offset = bam_reader.get_virtual_offset() >> 16;
+            progress->add(n_unreported, offset - progress_offset);
+            progress_offset = offset;
+            n_unreported = 0;
+        }
+
+        // Only look at the clock every few thousand reads
+        if (interval > 0 and ++n_since_check == 4096){
+            n_since_check = 0;
+
+            auto now = steady_clock::now();
+            if (duration_cast<seconds>(now - last_checkpoint).count() >= interval){
+                ScopedTimer timer(checkpoint_stage, true);
+                checkpoint.update(bam_reader);
+                checkpoint.values = split_values;
+                checkpoint.write(output_dir, split_metrics);
+                last_checkpoint = now;
+            }
+        }
+    });
+
+    // Compressed bytes, from the block offsets of the virtual offsets
+    int64_t n_bytes = (bam_reader.get_virtual_offset() >> 16) - (begin_offset >> 16);
+
+    // Up to the end of the range, which also covers the EOF block
+    if (progress != nullptr){
+        progress->add(n_unreported, range_end - progress_offset);
+    }
+
+    for (auto& metrics: split_metrics){
+        metrics.write_outputs();
+    }
+
+    remove(checkpoint_path);
+
+    for (auto& metrics: split_metrics){
+        metrics.discard_checkpoint();
+    }
+
+    if (stats_options.write_json){
+        stats.set_count("records", n_records);
+        stats.set_count("bytes_read", n_bytes);
+        stats.write_json(output_dir / stats_filename);
+    }
+}
+
+
+/// Blocking counter of reserved bytes. A reservation is always granted when nothing else is reserved, so a
+/// single job larger than the whole budget still runs (alone).
+class MemoryBudget {
+    mutex m;
+    condition_variable cv;
+    int64_t capacity;
+    int64_t used;
+
+public:
+    MemoryBudget(int64_t capacity):
+            capacity(capacity),
+            used(0)
+    {}
+
+    void reserve(int64_t bytes){
+        unique_lock<mutex> lock(m);
+        cv.wait(lock, [&]{ return capacity <= 0 or used == 0 or used + bytes <= capacity; });
+        used += bytes;
+    }
+
+    void release(int64_t bytes){
+        {
+            lock_guard<mutex> lock(m);
+            used -= bytes;
+        }
+        cv.notify_all();
+    }
+};
+
+
+struct ManifestEntry {
+    string sample;
+    path bam_path;
+    int64_t size;
+};
+
+
+/// TSV with a header line naming at least the columns 'sample' and 'bam'
+vector<ManifestEntry> load_manifest(path manifest_path){
+    ifstream file(manifest_path);
+
+    if (not (file.is_open() and file.good())){
+        throw runtime_error("ERROR: could not read manifest: " + manifest_path.string());
+    }
+
+    auto split = [](const string& line){
+        vector<string> tokens;
+        stringstream s(line);
+        string token;
+        while (getline(s, token, '\t')){
+            tokens.emplace_back(token);
+        }
+        return tokens;
+    };
+
+    string line;
+    getline(file, line);
+    auto header = split(line);
+
+    auto sample_column = std::find(header.begin(), header.end(), "sample") - header.begin();
+    auto bam_column = std::find(header.begin(), header.end(), "bam") - header.begin();
+
+    if (size_t(sample_column) == header.size() or size_t(bam_column) == header.size()){
+        throw runtime_error("ERROR: manifest header must contain the columns 'sample' and 'bam': " + manifest_path.string());
+    }
+
+    vector<ManifestEntry> entries;
+    unordered_set<string> samples;
+
+    while (getline(file, line)){
+        if (line.empty()){
+            continue;
+        }
+
+        auto tokens = split(line);
+
+        if (tokens.size() <= size_t(max(sample_column, bam_column))){
+            throw runtime_error("ERROR: manifest line has too few columns: " + line);
+        }
+
+        ManifestEntry entry = {tokens[sample_column], tokens[bam_column], 0};
+
+        if (not samples.emplace(entry.sample).second){
+            throw runtime_error("ERROR: duplicate sample name in manifest: " + entry.sample);
+        }
+
+        if (not exists(entry.bam_path)){
+            throw runtime_error("ERROR: BAM in manifest does not exist: " + entry.bam_path.string());
+        }
+
+        entry.size = int64_t(file_size(entry.bam_path));
+        entries.emplace_back(entry);
+    }
+
+    return entries;
+}
+
+
+/// Process every sample of a manifest, each into output_dir/<sample>. Workers pick the next sample from a
+/// shared counter (largest BAMs first so that a big one doesn't start last), and all BAMs decompress through
+/// the same htslib thread pool, so when only a few large samples remain their blocks are inflated by every pool
+/// thread. The n_threads are split between the two: half of them (at most one per sample) read and process BAMs,
+/// the others decompress.
+void run_manifest(path manifest_path, path output_dir, const SampleMetrics::Options& options, const string& split_tag,
+                  const CheckpointOptions& checkpointing, const StatsOptions& stats_options,
+                  const ProgressOptions& progress_options, int64_t n_threads, double max_memory_gb){
+    auto entries = load_manifest(manifest_path);
+
+    if (exists(output_dir) and not checkpointing.resume){
+        throw runtime_error("ERROR: output directory exists already");
+    }
+    else {
+        create_directories(output_dir);
+    }
+
+    sort(entries.begin(), entries.end(), [](const ManifestEntry& a, const ManifestEntry& b){
+        return a.size > b.size;
+    });
+
+    // Rough guess of the peak memory of one sample. Without a budget the per-alignment summaries dominate and scale
+    // with the number of records, i.e. with the compressed size. With one, they are bounded by the summary budget
+    // that all samples share, and what remains of --max_memory is for everything else.
+    int64_t capacity = int64_t(max_memory_gb*1024*1024*1024);
+    if (options.summary_budget){
+        capacity -= options.summary_budget->limit;
+    }
+
+    auto estimate_memory = [&](const ManifestEntry& entry){
+        int64_t estimate = (int64_t(256) << 20) + (options.summary_budget ? 0 : entry.size/16);
+        return (capacity > 0) ? min(estimate, capacity) : estimate;
+    };
+
+    // Progress of all the samples together
+    unique_ptr<ProgressReporter> progress;
+    if (progress_options.interval > 0){
+        int64_t total_bytes = 0;
+        for (auto& entry: entries){
+            total_bytes += entry.size;
+        }
+        progress = make_unique<ProgressReporter>(total_bytes, progress_options.interval, progress_options.status_path);
+    }
+
+    // An htslib pool cannot grow once created, so it is sized for the whole run: with fewer samples than half the
+    // threads, it gets what the workers don't use. Without any thread to spare, workers decompress their own BAM.
+    size_t n_workers = min(entries.size(), size_t(max(int64_t(1), n_threads/2)));
+    int64_t n_pool_threads = n_threads - int64_t(n_workers);
+
+    htsThreadPool thread_pool = {nullptr, 0};
+    if (n_pool_threads > 0){
+        if ((thread_pool.pool = hts_tpool_init(int(n_pool_threads))) == nullptr){
+            throw runtime_error("ERROR: could not create thread pool");
+        }
+    }
+    htsThreadPool* pool = &thread_pool;
+
+    MemoryBudget budget(capacity);
+    atomic<size_t> next_entry(0);
+    mutex output_mutex;
+    vector<string> failures;
+
+    auto worker = [&](){
+        while (true){
+            size_t i = next_entry.fetch_add(1);
+            if (i >= entries.size()){
+                break;
             }
-            else if (type == 'S' or type == 'H'){
-                inferred_query_length += length;
+
+            auto& entry = entries[i];
+            auto estimate = estimate_memory(entry);
+
+            budget.reserve(estimate);
+
+            try {
+                get_identity_from_bam(entry.bam_path, output_dir / entry.sample, options, split_tag, pool, checkpointing,
+                                      stats_options, progress.get());
+
+                lock_guard<mutex> lock(output_mutex);
+                cerr << "Finished sample " << entry.sample << '\n';
             }
-            else if (type == 'M'){
-                throw runtime_error("ERROR: alignment contains ambiguous M operations, cannot determine mismatches "
-                                    "without = or X operations");
+            catch (const exception& e){
+                lock_guard<mutex> lock(output_mutex);
+                failures.emplace_back(entry.sample + ": " + e.what());
             }
 
+            budget.release(estimate);
+        }
+    };
+
+    vector<thread> threads;
+    for (size_t i=0; i<n_workers; i++){
+        threads.emplace_back(worker);
+    }
+
+    for (auto& t: threads){
+        t.join();
+    }
+
+    if (thread_pool.pool != nullptr){
+        hts_tpool_destroy(thread_pool.pool);
+    }
+
+    if (not failures.empty()){
+        for (auto& failure: failures){
+            cerr << "ERROR: sample failed: " << failure << '\n';
+        }
+        throw runtime_error("ERROR: " + std::to_string(failures.size()) + " of " + std::to_string(entries.size()) + " samples failed");
+    }
+
+    if (progress){
+        progress->finish();
+    }
+}
+
+
+static volatile sig_atomic_t stop_requested = 0;
+
+void request_stop(int){
+    stop_requested = 1;
+}
+
+
+/// Fold the records of a growing BAM (or of the BAMs appearing in a directory) into one set of metrics as they are
+/// written, rewriting the outputs every snapshot_interval seconds when there is new data. Stops after idle_timeout
+/// seconds without new data (0 = never), or on SIGINT/SIGTERM, and writes the final outputs.
+void follow(path watch_path, path output_dir, const SampleMetrics::Options& options, int64_t snapshot_interval,
+            int64_t idle_timeout){
+    if (exists(output_dir)){
+        throw runtime_error("ERROR: output directory exists already");
+    }
+    else {
+        create_directories(output_dir);
+    }
+
+    signal(SIGINT, request_stop);
+    signal(SIGTERM, request_stop);
+
+    BamFollower follower(watch_path, SampleMetrics::get_required_tags(options));
+    follower.set_detail_filter(SampleMetrics::min_mapq);
+
+    // Created when the first header is read
+    unique_ptr<SampleMetrics> metrics;
+
+    auto last_data = steady_clock::now();
+    auto last_snapshot = steady_clock::now();
+    bool has_new_data = false;
+    int64_t n_records = 0;
+
+    while (not stop_requested){
+        int64_t n = follower.poll([&](SamElement& e){
+            if (not metrics){
+                metrics = make_unique<SampleMetrics>(options, follower.get_ref_names(), follower.get_ref_lengths(), false, output_dir);
+            }
+            metrics->add_alignment(e);
         });
 
+        auto now = steady_clock::now();
+
+        if (n > 0){
+            n_records += n;
+            has_new_data = true;
+            last_data = now;
+        }
 
-        double numerator = double(matches);
-        double denominator = double(nonmatches) + double(matches);
+        if (has_new_data and duration_cast<seconds>(now - last_snapshot).count() >= snapshot_interval){
+            metrics->write_snapshot();
+            has_new_data = false;
+            last_snapshot = now;
 
-        double identity = 0;
-        if (denominator > 0) {
-            // 7 decimals of precision is probably enough?
-            identity = round(10000000*numerator / denominator)/10000000;
+            cerr << "Snapshot written: " << n_records << " records from " << follower.get_n_files() << " files ("
+                 << follower.get_n_done() << " complete)" << '\n';
         }
 
-        identity_distribution[identity]++;
+        if (idle_timeout > 0 and duration_cast<seconds>(now - last_data).count() >= idle_timeout){
+            break;
+        }
 
-        // make a unique name for each alignment and insert the summary data into the map
-        string uniqueName = bam_reader.createUniqueKey(e.ref_name, e.start_pos,
-                                                         alignment_end, matches, nonmatches, e.query_name);
-        AlignmentSummary summary = {e.ref_name, e.start_pos, alignment_end, matches, nonmatches, indels, indel_total_length, inferred_query_length, identity, e.mapq};
-        alignment_summaries[uniqueName] = summary;
+        follower.wait(1000*max(int64_t(1), min(snapshot_interval, int64_t(10))));
+    }
 
+    if (metrics){
+        metrics->write_outputs();
+    }
+}
 
-    });
 
-    write_sorted_distribution_to_file(identity_distribution, output_dir / "identity_distribution.csv");
-    write_sorted_distribution_to_file(length_distribution, output_dir / "length_distribution.csv");
-    string summaryFilename = "alignment_summary_" + std::to_string(max_indel_length) + "bpMaxIndel.tsv";
-    write_sorted_alignment_summary_to_file(alignment_summaries, output_dir / summaryFilename);
+/// Split a BAM into shards for run --shard, see ShardPlan
+void plan_shards(path bam_path, size_t n_shards, path plan_path){
+    auto plan = ShardPlan::create(bam_path, n_shards);
+    plan.write(plan_path);
+}
+
+
+/// Length and quality summary of reads before alignment, from a FASTQ or an unaligned (or any) BAM. Nothing but
+/// the length and qualities of each primary record is looked at.
+void summarize_reads(path input_path, path output_dir, htsThreadPool* pool){
+    if (exists(output_dir)){
+        throw runtime_error("ERROR: output directory exists already");
+    }
+
+    ReadMetrics metrics;
+
+    auto add_read = [&](int64_t length, const uint8_t* qualities){
+        metrics.add_read(length, qualities);
+    };
+
+    if (FastqReader::is_fastq(input_path)){
+        FastqReader reader(input_path);
+        reader.set_thread_pool(pool);
+        reader.for_read_in_fastq(add_read);
+    }
+    else {
+        Bam reader(input_path);
+        if (pool->pool != nullptr){
+            reader.set_thread_pool(pool);
+        }
+        reader.for_read_in_bam(add_read);
+    }
+
+    create_directories(output_dir);
+    metrics.write_outputs(output_dir);
+
+    cerr << "Wrote " << (output_dir / "report.html").string() << " and summary.csv" << '\n';
+}
+
+
+path get_state_path(path p){
+    return is_directory(p) ? p / SampleMetrics::state_filename : p;
+}
+
+
+/// Compare several samples from the histograms of their states, named after their output directories unless names
+/// are given
+void compare_results(const vector<string>& inputs, const vector<string>& names, path output_dir){
+    if (not names.empty() and names.size() != inputs.size()){
+        throw runtime_error("ERROR: " + std::to_string(names.size()) + " names given for " +
+                            std::to_string(inputs.size()) + " inputs");
+    }
+
+    if (exists(output_dir)){
+        throw runtime_error("ERROR: output directory exists already");
+    }
+    else {
+        create_directories(output_dir);
+    }
+
+    SampleComparison comparison;
+
+    for (size_t i=0; i<inputs.size(); i++){
+        path state_path = get_state_path(inputs[i]);
+
+        unordered_map<double,int64_t> identity_distribution;
+        unordered_map<size_t,int64_t> length_distribution;
+        SampleMetrics::load_distributions(state_path, identity_distribution, length_distribution);
+
+        string name;
+        if (not names.empty()){
+            name = names[i];
+        }
+        else {
+            name = state_path.parent_path().filename().string();
+            if (name.empty()){
+                name = path(inputs[i]).stem().string();
+            }
+        }
+
+        comparison.add_sample(name, DistributionSummary(identity_distribution, length_distribution));
+    }
+
+    comparison.write(output_dir);
+
+    cerr << "Wrote " << (output_dir / "compare.html").string() << " and comparison.csv" << '\n';
+}
+
+
+/// Combine the states of several runs (e.g. shards of one BAM, or several flow cells of one sample) and regenerate
+/// every output from the combined state
+void merge_results(const vector<string>& inputs, path output_dir, const SampleMetrics::Options& options,
+                   htsThreadPool* pool, bool write_stats){
+    RunStats stats;
+    RunStats* run_stats = write_stats ? &stats : nullptr;
+
+    if (exists(output_dir)){
+        throw runtime_error("ERROR: output directory exists already");
+    }
+    else {
+        create_directories(output_dir);
+    }
+
+    RunStats::Stage* load_stage = run_stats ? &stats.get_stage("load") : nullptr;
+    RunStats::Stage* aggregate_stage = run_stats ? &stats.get_stage("aggregate") : nullptr;
+
+    ScopedTimer load_timer(load_stage, true);
+    auto merged = SampleMetrics::load_state(get_state_path(inputs.at(0)), output_dir, options.summary_budget);
+    load_timer.stop();
+
+    merged.set_run_stats(run_stats);
+    merged.set_thread_pool(pool);
+    merged.set_summary_formats(options.write_bed_gz, options.write_arrow);
+
+    for (size_t i=1; i<inputs.size(); i++){
+        ScopedTimer timer(load_stage, true);
+        auto other = SampleMetrics::load_state(get_state_path(inputs[i]), output_dir, options.summary_budget);
+        timer.stop();
+
+        ScopedTimer aggregate_timer(aggregate_stage, true);
+        merged += other;
+    }
+
+    merged.write_outputs();
+
+    if (write_stats){
+        stats.set_count("states", int64_t(inputs.size()));
+        stats.write_json(output_dir / stats_filename);
+    }
+}
+
+
+/// Most of the budget goes to the alignment summaries (the only thing that grows with the number of reads), the
+/// rest is left for htslib buffers and the other accumulators
+shared_ptr<AlignmentSummaryStore::Budget> create_summary_budget(double max_memory_gb){
+    if (max_memory_gb <= 0){
+        return nullptr;
+    }
+
+    return make_shared<AlignmentSummaryStore::Budget>(int64_t(max_memory_gb*0.75*1024*1024*1024));
+}
+
+
+void report_peak_memory(){
+    cerr << "Peak memory (RSS): " << RunStats::get_peak_rss_bytes()/(1024*1024) << " MB" << '\n';
 }
 
 
 int main (int argc, char* argv[]){
     path bam_path;
+    path manifest_path;
     path output_dir;
-    int64_t max_indel_length;
+    SampleMetrics::Options options;
+    string split_tag;
+    int64_t n_threads;
+    double max_memory_gb;
+    CheckpointOptions checkpointing;
+    StatsOptions stats_options;
+    ProgressOptions progress_options;
 
     CLI::App app{"App description"};
 
-    app.add_option(
+    auto input_group = app.add_option_group("input", "Either a single BAM or a manifest of BAMs");
+
+    input_group->add_option(
             "-i,--input_bam",
             bam_path,
-            "Path to BAM")
-            ->required();
+            "Path to BAM");
+
+    input_group->add_option(
+            "--manifest",
+            manifest_path,
+            "TSV with a header and (at least) columns 'sample' and 'bam'. All BAMs are processed concurrently "
+            "sharing the threads, each into <output_dir>/<sample>");
+
+    input_group->require_option(0, 1);
 
     app.add_option(
             "-o,--output_dir",
             output_dir,
-            "Path to directory which will be created for output (must not exist already)")
-            ->required();
+            "Path to directory which will be created for output (must not exist already)");
 
     app.add_option(
             "-l,--max_indel_length",
-            max_indel_length,
+            options.max_indel_length,
             "max indel length to be counted as a mismatch")
             ->default_val(50);
 
+    app.add_flag(
+            "-c,--coverage",
+            options.write_coverage,
+            "Also write the read depth as a bgzipped bedGraph (coverage.bedGraph.gz), streamed if the BAM is coordinate "
+            "sorted. Otherwise it takes 4 bytes per base of each contig with alignments, counted in --max_memory");
+
+    app.add_flag(
+            "--bed_gz",
+            options.write_bed_gz,
+            "Also write the alignment summary as bgzipped BED with a tabix index (.bed.gz and .bed.gz.tbi), compressed "
+            "by the -t threads");
+
+    app.add_flag(
+            "--arrow",
+            options.write_arrow,
+            "Also write the alignment summary as an Arrow IPC file (.arrow), which loads without parsing text");
+
+    app.add_option(
+            "-w,--window_size",
+            options.window_size,
+            "Size of the reference windows used for the windowed identity track (0 to disable)")
+            ->default_val(10000);
+
+    app.add_option(
+            "-g,--group_by",
+            options.group_keys,
+            "Also break the metrics down by 'contig' and/or any 2 letter aux tag (e.g. RG, BC). Can be repeated");
+
+    app.add_option(
+            "-b,--group_by_tag,--group-by-tag",
+            split_tag,
+            "Demultiplex by this 2 letter aux tag (e.g. BC): all outputs are written to one subdirectory per tag value "
+            "('unclassified' for reads without the tag)");
+
+    app.add_option(
+            "-t,--threads",
+            n_threads,
+            "Total number of threads. With --manifest, half of them (at most one per BAM) process BAMs at once and "
+            "the others decompress BGZF blocks for all of them")
+            ->default_val(1);
+
+    app.add_option(
+            "-m,--max_memory",
+            max_memory_gb,
+            "Memory budget in GB (0 = no limit). Alignment summaries beyond 3/4 of it are spilled to sorted runs "
+            "in the output directory and merged at the end, and with --manifest a BAM only starts when its "
+            "estimated memory fits in the rest. The depth arrays of -c on an unsorted BAM count toward the 3/4 but "
+            "can't be spilled")
+            ->default_val(0);
+
+    app.add_option(
+            "-k,--checkpoint_interval",
+            checkpointing.interval,
+            "Seconds between checkpoints (" + RunCheckpoint::filename + " in the output directory) from which an "
+            "interrupted run can continue with --resume (0 to disable)")
+            ->default_val(600);
+
+    app.add_flag(
+            "--resume",
+            checkpointing.resume,
+            "Continue an interrupted run from its checkpoint. The output directory may exist, and runs (or samples "
+            "of a manifest) that completed already are skipped");
+
+    app.add_flag(
+            "--stats_json,--stats-json",
+            stats_options.write_json,
+            "Write the wall/CPU time of each stage (reading, decoding, CIGAR processing, aggregation, checkpoints, "
+            "writing, sorting), records/s, bytes read and peak RSS to " + stats_filename + " in the output directory");
+
+    app.add_flag(
+            "--perf_counters,--perf-counters",
+            stats_options.perf_counters,
+            "Also count cycles, instructions, cache misses and branch misses (user space, via perf_event_open) in each "
+            "stage of " + stats_filename + ", with IPC and counts per million records. Implies --stats_json");
+
+    app.add_option(
+            "--progress_interval",
+            progress_options.interval,
+            "Seconds between progress reports on stderr (records, compressed MB/s and ETA), 0 to disable")
+            ->default_val(60);
+
+    app.add_option(
+            "--status_file",
+            progress_options.status_path,
+            "Also write the progress to this JSON file (replaced atomically at every report), e.g. for a job scheduler");
+
+    vector<string> merge_inputs;
+    path merge_output_dir;
+
+    auto merge_command = app.add_subcommand("merge", "Combine the results of several runs from their binary state "
+                                                     "(" + SampleMetrics::state_filename + ") and regenerate all outputs");
+
+    merge_command->add_option(
+            "inputs",
+            merge_inputs,
+            "State files, or output directories of previous runs")
+            ->required();
+
+    merge_command->add_option(
+            "-m,--max_memory",
+            max_memory_gb,
+            "Memory budget in GB, alignment summaries beyond 3/4 of it are spilled to disk (0 = no limit)")
+            ->default_val(0);
+
+    merge_command->add_flag(
+            "--stats_json,--stats-json",
+            stats_options.write_json,
+            "Write the time spent loading, combining and writing to " + stats_filename + " in the output directory");
+
+    merge_command->add_option(
+            "-t,--threads",
+            n_threads,
+            "Number of threads compressing the bgzipped outputs")
+            ->default_val(1);
+
+    merge_command->add_option(
+            "-o,--output_dir",
+            merge_output_dir,
+            "Path to directory which will be created for output (must not exist already)")
+            ->required();
+
+    merge_command->add_flag(
+            "--bed_gz",
+            options.write_bed_gz,
+            "Also write the merged alignment summary as bgzipped BED with a tabix index (.bed.gz and .bed.gz.tbi)");
+
+    merge_command->add_flag(
+            "--arrow",
+            options.write_arrow,
+            "Also write the merged alignment summary as an Arrow IPC file (.arrow)");
+
+    path reads_path;
+    path reads_output_dir;
+
+    auto reads_command = app.add_subcommand("reads", "Summarize reads before alignment (length distribution, N50, "
+                                                     "yield and quality) from an unaligned BAM or a FASTQ, without "
+                                                     "decoding anything else");
+
+    reads_command->add_option(
+            "-i,--input",
+            reads_path,
+            "Unaligned BAM (or any SAM/BAM/CRAM, only primary records are counted), or FASTQ (plain, gzipped or "
+            "bgzipped, detected from the content)")
+            ->required();
+
+    reads_command->add_option(
+            "-t,--threads",
+            n_threads,
+            "Number of threads decompressing the input (a FASTQ must be bgzipped rather than gzipped to use them)")
+            ->default_val(1);
+
+    reads_command->add_option(
+            "-o,--output_dir",
+            reads_output_dir,
+            "Path to directory which will be created for output (must not exist already)")
+            ->required();
+
+    vector<string> compare_inputs;
+    vector<string> compare_names;
+    path compare_output_dir;
+
+    auto compare_command = app.add_subcommand("compare", "Compare the identity and read length distributions of "
+                                                         "several samples from their binary state, with overlaid plots "
+                                                         "(compare.html) and a table of statistics (comparison.csv)");
+
+    compare_command->add_option(
+            "inputs",
+            compare_inputs,
+            "State files, or output directories of previous runs (or merges). The first is the baseline of the "
+            "difference in QV")
+            ->required();
+
+    compare_command->add_option(
+            "-n,--names",
+            compare_names,
+            "Name of each sample, in the order of the inputs (default: the name of the directory of each state)");
+
+    compare_command->add_option(
+            "-o,--output_dir",
+            compare_output_dir,
+            "Path to directory which will be created for output (must not exist already)")
+            ->required();
+
+    path plan_bam_path;
+    path plan_path;
+    size_t n_shards;
+
+    auto plan_command = app.add_subcommand("plan", "Split a BAM into ranges of records (by virtual offset) that can be "
+                                                   "processed independently with 'run --shard' and combined with 'merge'");
+
+    plan_command->add_option(
+            "-i,--input_bam",
+            plan_bam_path,
+            "Path to BAM (if it is indexed, shards are balanced by number of records, otherwise by compressed size)")
+            ->required();
+
+    plan_command->add_option(
+            "-n,--shards",
+            n_shards,
+            "Number of shards (some may be empty)")
+            ->required();
+
+    plan_command->add_option(
+            "-o,--output",
+            plan_path,
+            "Path of the plan (TSV) to write")
+            ->required();
+
+    size_t shard_index;
+
+    auto run_command = app.add_subcommand("run", "Process only one shard of the BAM given with -i, using the other "
+                                                 "options as usual. The output directory holds a partial state to merge");
+
+    run_command->add_option(
+            "--plan",
+            plan_path,
+            "Shard plan written by 'wam plan'")
+            ->required();
+
+    run_command->add_option(
+            "--shard",
+            shard_index,
+            "Index of the shard to process (0 based)")
+            ->required();
+
+    // Every other option of a normal run is given after 'run'
+    run_command->fallthrough();
+
+    path watch_path;
+    int64_t snapshot_interval;
+    int64_t idle_timeout;
+
+    auto follow_command = app.add_subcommand("follow", "Follow a BAM that is being written, or a directory in which "
+                                                       "BAMs appear (e.g. during a sequencing run), and keep the outputs up to date");
+
+    follow_command->add_option(
+            "--watch",
+            watch_path,
+            "BAM or directory (searched recursively for .bam files) to follow")
+            ->required();
+
+    follow_command->add_option(
+            "--snapshot_interval",
+            snapshot_interval,
+            "Seconds between rewrites of the distributions and reports (each file is replaced atomically). The "
+            "alignment summaries and the state are only written when following stops")
+            ->default_val(60);
+
+    follow_command->add_option(
+            "--idle_timeout",
+            idle_timeout,
+            "Stop after this many seconds without new records (0 = run until interrupted with Ctrl-C/SIGTERM)")
+            ->default_val(0);
+
+    follow_command->fallthrough();
+
+    app.require_subcommand(0, 1);
+
     CLI11_PARSE(app, argc, argv);
 
-    get_identity_from_bam(bam_path, output_dir, max_indel_length);
+    options.summary_budget = create_summary_budget(max_memory_gb);
+
+    if (stats_options.perf_counters){
+        stats_options.write_json = true;
+    }
+
+    if (*plan_command){
+        plan_shards(plan_bam_path, n_shards, plan_path);
+        return 0;
+    }
+
+    if (*compare_command){
+        compare_results(compare_inputs, compare_names, compare_output_dir);
+        return 0;
+    }
+
+    if (*follow_command){
+        if (output_dir.empty()){
+            return app.exit(CLI::RequiredError("--output_dir"));
+        }
+        if (options.write_coverage or not split_tag.empty() or not bam_path.empty() or not manifest_path.empty() or stats_options.write_json){
+            throw runtime_error("ERROR: follow mode does not support --coverage, --group_by_tag, --input_bam, --manifest, --stats_json or --perf_counters");
+        }
+
+        follow(watch_path, output_dir, options, snapshot_interval, idle_timeout);
+        report_peak_memory();
+        return 0;
+    }
+
+    if (not *merge_command and not *reads_command){
+        if (output_dir.empty()){
+            return app.exit(CLI::RequiredError("--output_dir"));
+        }
+        if (bam_path.empty() and manifest_path.empty()){
+            return app.exit(CLI::RequiredError("--input_bam or --manifest"));
+        }
+        if (*run_command and bam_path.empty()){
+            return app.exit(CLI::RequiredError("--input_bam"));
+        }
+    }
+
+    // A manifest splits the threads between its own pool and the samples processed at once
+    bool manifest_run = not manifest_path.empty() and not *merge_command and not *reads_command;
+
+    htsThreadPool pool = {nullptr, 0};
+    if (n_threads > 1 and not manifest_run){
+        if ((pool.pool = hts_tpool_init(int(n_threads))) == nullptr){
+            throw runtime_error("ERROR: could not create thread pool");
+        }
+    }
+
+    if (*reads_command){
+        summarize_reads(reads_path, reads_output_dir, &pool);
+
+        if (pool.pool != nullptr){
+            hts_tpool_destroy(pool.pool);
+        }
+
+        report_peak_memory();
+        return 0;
+    }
+
+    if (*merge_command){
+        merge_results(merge_inputs, merge_output_dir, options, &pool, stats_options.write_json);
+
+        if (pool.pool != nullptr){
+            hts_tpool_destroy(pool.pool);
+        }
+
+        report_peak_memory();
+        return 0;
+    }
+
+    if (manifest_run){
+        run_manifest(manifest_path, output_dir, options, split_tag, checkpointing, stats_options, progress_options,
+                     n_threads, max_memory_gb);
+    }
+    else{
+        ShardPlan::Shard shard = {};
+        bool sharded = bool(*run_command);
+        if (sharded){
+            shard = ShardPlan::load(plan_path).get_shard(shard_index, bam_path);
+        }
+
+        unique_ptr<ProgressReporter> progress;
+        if (progress_options.interval > 0){
+            auto [begin, end] = get_block_range(int64_t(file_size(bam_path)), sharded ? &shard : nullptr);
+            progress = make_unique<ProgressReporter>(max(int64_t(0), end - begin), progress_options.interval,
+                                                     progress_options.status_path);
+        }
+
+        get_identity_from_bam(bam_path, output_dir, options, split_tag, &pool, checkpointing, stats_options,
+                              progress.get(), sharded ? &shard : nullptr);
+
+        if (progress){
+            progress->finish();
+        }
+    }
+
+    if (pool.pool != nullptr){
+        hts_tpool_destroy(pool.pool);
+    }
+
+    report_peak_memory();
 
     return 0;
 }
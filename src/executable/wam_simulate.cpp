@@ -0,0 +1,720 @@
+#include "Filesystem.hpp"
+#include "CLI11.hpp"
+#include "htslib/include/htslib/sam.h"
+#include "htslib/include/htslib/hts.h"
+
+using ghc::filesystem::path;
+
+#include <stdexcept>
+#include <algorithm>
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cmath>
+
+using std::runtime_error;
+using std::to_string;
+using std::string;
+using std::vector;
+using std::cerr;
+using std::min;
+using std::max;
+using std::chrono::steady_clock;
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+
+
+struct SimulationOptions {
+    int64_t n_reads = 100000;
+    int64_t n_contigs = 24;
+    int64_t contig_length = 100000000;
+
+    // Log-normal read lengths, given by their mean and the standard deviation of the log
+    double mean_length = 20000;
+    double length_sigma = 0.8;
+    int64_t min_length = 200;
+    int64_t max_length = 1000000;
+
+    // Per-read identity is Beta distributed with this mean, a higher concentration gives a narrower distribution
+    double mean_identity = 0.96;
+    double identity_concentration = 200;
+
+    // Composition of the errors (deletions are the rest), and probability that an indel extends by one more base
+    double mismatch_fraction = 0.4;
+    double insertion_fraction = 0.3;
+    double indel_extension = 0.4;
+
+    // Mean number per read of indels longer than 50bp (e.g. structural variants)
+    double large_indel_rate = 0.05;
+
+    double unmapped_fraction = 0.01;
+    double supplementary_fraction = 0.03;
+
+    bool write_md = false;
+    bool write_qualities = false;
+    bool write_methylation = false;
+    bool sorted = false;
+
+    int64_t n_threads = 1;
+    int64_t compression_level = 6;
+    uint64_t seed = 42;
+};
+
+
+/// Generates reads one at a time and encodes them directly into a bam1_t (no SAM text in between). Positions are
+/// either uniform, or drawn as a Poisson process along the genome so that a sorted BAM can be streamed.
+class ReadSimulator {
+    const SimulationOptions& options;
+    std::mt19937_64 rng;
+
+    std::lognormal_distribution<double> length_distribution;
+    std::gamma_distribution<double> identity_a;
+    std::gamma_distribution<double> identity_b;
+    std::geometric_distribution<uint32_t> extension_distribution;
+    std::geometric_distribution<int64_t> call_distribution;
+    std::uniform_real_distribution<double> uniform;
+
+    // Position of the last mapped read when sorted, over the contigs minus a margin at their end
+    int32_t tid;
+    double position;
+    int64_t usable_length;
+
+    int64_t n_simulated;
+
+    // Reused buffers of the current read
+    string name;
+    vector<uint32_t> cigars;
+    vector<uint8_t> bases;
+    vector<uint8_t> qualities;
+    string md;
+    string mm;
+    vector<uint8_t> ml;
+
+    string generate_name();
+    void generate_alignment(int64_t length, double identity, int64_t& ref_span);
+    void generate_bases(int64_t length);
+    void generate_md();
+    void generate_methylation(int64_t length, bool reverse);
+    void encode(bam1_t* b, int32_t ref_id, int32_t pos, uint16_t flag, uint8_t mapq, int64_t query_length);
+
+public:
+    ReadSimulator(const SimulationOptions& options);
+
+    /// Fill b with the next read, false once every read was generated
+    bool next(bam1_t* b);
+};
+
+
+ReadSimulator::ReadSimulator(const SimulationOptions& options):
+        options(options),
+        rng(options.seed),
+        length_distribution(log(options.mean_length) - options.length_sigma*options.length_sigma/2, options.length_sigma),
+        identity_a(options.mean_identity*options.identity_concentration, 1),
+        identity_b((1 - options.mean_identity)*options.identity_concentration, 1),
+        extension_distribution(1 - options.indel_extension),
+        call_distribution(1.0/3),
+        uniform(0, 1),
+        tid(0),
+        position(0),
+        usable_length(options.contig_length - 2*options.max_length),
+        n_simulated(0)
+{
+    if (options.mean_identity <= 0 or options.mean_identity >= 1){
+        throw runtime_error("ERROR: mean identity must be in (0,1)");
+    }
+    if (options.indel_extension < 0 or options.indel_extension >= 1){
+        throw runtime_error("ERROR: indel extension probability must be in [0,1)");
+    }
+    if (options.mismatch_fraction + options.insertion_fraction > 1){
+        throw runtime_error("ERROR: mismatch and insertion fractions add up to more than 1");
+    }
+    // With deletions the reference span can exceed the read length, a read always fits in the margin
+    if (usable_length <= 0){
+        throw runtime_error("ERROR: contigs must be longer than twice the longest read");
+    }
+}
+
+
+string ReadSimulator::generate_name(){
+    // ONT style UUID
+    static const char hex[] = "0123456789abcdef";
+    uint64_t x = rng();
+    uint64_t y = rng();
+
+    string s(36, '-');
+    for (size_t i=0, j=0; i<36; i++){
+        if (i == 8 or i == 13 or i == 18 or i == 23){
+            continue;
+        }
+        uint64_t& source = (j < 16) ? x : y;
+        s[i] = hex[source & 0xf];
+        source >>= 4;
+        j++;
+    }
+
+    return s;
+}
+
+
+void ReadSimulator::generate_alignment(int64_t length, double identity, int64_t& ref_span){
+    cigars.clear();
+    ref_span = 0;
+
+    double error_rate = 1 - identity;
+    std::geometric_distribution<int64_t> match_run(min(1.0, max(1e-9, error_rate)));
+    std::poisson_distribution<int64_t> n_large(options.large_indel_rate);
+    std::uniform_real_distribution<double> large_length(log(51), log(5000));
+
+    // Large indels are placed at uniform query positions, in order, never at the very start
+    vector<int64_t> large_positions(size_t(n_large(rng)));
+    for (auto& p: large_positions){
+        p = 1 + int64_t(uniform(rng)*double(length - 1));
+    }
+    std::sort(large_positions.begin(), large_positions.end());
+    size_t next_large = 0;
+
+    auto add = [&](uint32_t length, int op){
+        // Merge with the previous operation of the same type
+        if (not cigars.empty() and bam_cigar_op(cigars.back()) == uint32_t(op)){
+            cigars.back() += length << BAM_CIGAR_SHIFT;
+        }
+        else{
+            cigars.emplace_back(bam_cigar_gen(length, op));
+        }
+
+        if (op == BAM_CEQUAL or op == BAM_CDIFF or op == BAM_CDEL){
+            ref_span += length;
+        }
+    };
+
+    int64_t query_position = 0;
+
+    while (query_position < length){
+        int64_t run = min(match_run(rng) + 1, length - query_position);
+
+        if (next_large < large_positions.size() and large_positions[next_large] < query_position + run){
+            run = max(int64_t(0), large_positions[next_large] - query_position);
+            if (run > 0){
+                add(uint32_t(run), BAM_CEQUAL);
+                query_position += run;
+            }
+
+            uint32_t indel_length = uint32_t(exp(large_length(rng)));
+            if (uniform(rng) < 0.5 and query_position + indel_length < length){
+                add(indel_length, BAM_CINS);
+                query_position += indel_length;
+            }
+            else{
+                add(indel_length, BAM_CDEL);
+            }
+
+            next_large++;
+            continue;
+        }
+
+        add(uint32_t(run), BAM_CEQUAL);
+        query_position += run;
+
+        if (query_position == length){
+            break;
+        }
+
+        double type = uniform(rng);
+        uint32_t indel_length = 1 + extension_distribution(rng);
+
+        if (type < options.mismatch_fraction){
+            add(1, BAM_CDIFF);
+            query_position++;
+        }
+        else if (type < options.mismatch_fraction + options.insertion_fraction){
+            indel_length = uint32_t(min(int64_t(indel_length), length - query_position));
+            add(indel_length, BAM_CINS);
+            query_position += indel_length;
+        }
+        else{
+            add(indel_length, BAM_CDEL);
+        }
+    }
+}
+
+
+void ReadSimulator::generate_bases(int64_t length){
+    // 4 bit codes of A, C, G, T, two per byte
+    static const uint8_t codes[4] = {1, 2, 4, 8};
+
+    bases.resize(size_t((length + 1)/2));
+
+    uint64_t x = 0;
+    for (size_t i=0; i<bases.size(); i++){
+        if (i % 16 == 0){
+            x = rng();
+        }
+        bases[i] = uint8_t(codes[x & 3] << 4 | codes[(x >> 2) & 3]);
+        x >>= 4;
+    }
+
+    if (length % 2 == 1){
+        bases.back() &= 0xf0;
+    }
+
+    if (options.write_qualities){
+        qualities.resize(size_t(length));
+
+        x = 0;
+        for (size_t i=0; i<qualities.size(); i++){
+            if (i % 8 == 0){
+                x = rng();
+            }
+            // Roughly Q10 to Q40
+            qualities[i] = uint8_t(10 + (x & 0xff) % 31);
+            x >>= 8;
+        }
+    }
+}
+
+
+void ReadSimulator::generate_md(){
+    // The reference is not simulated, so mismatched and deleted reference bases are random
+    static const char ref_bases[] = "ACGT";
+
+    md.clear();
+    int64_t run = 0;
+
+    for (auto c: cigars){
+        auto op = bam_cigar_op(c);
+        auto length = bam_cigar_oplen(c);
+
+        if (op == BAM_CEQUAL){
+            run += length;
+        }
+        else if (op == BAM_CDIFF){
+            for (uint32_t i=0; i<length; i++){
+                md += to_string(run);
+                md += ref_bases[rng() & 3];
+                run = 0;
+            }
+        }
+        else if (op == BAM_CDEL){
+            md += to_string(run);
+            md += '^';
+            for (uint32_t i=0; i<length; i++){
+                md += ref_bases[rng() & 3];
+            }
+            run = 0;
+        }
+    }
+
+    md += to_string(run);
+}
+
+
+void ReadSimulator::generate_methylation(int64_t length, bool reverse){
+    // MM counts the Cs of the read as sequenced, i.e. the Gs of the stored sequence if it is reverse complemented
+    uint8_t target = reverse ? 4 : 2;
+
+    mm = "C+m?";
+    ml.clear();
+
+    // Only the number of Cs matters: which of them are called does not depend on where they are
+    int64_t n_targets = 0;
+    for (int64_t i=0; i<length; i++){
+        n_targets += (bam_seqi(bases.data(), i) == target);
+    }
+
+    // About a third of the Cs are called, with a random probability of methylation
+    int64_t remaining = n_targets;
+    while (true){
+        int64_t skipped = call_distribution(rng);
+        if (skipped >= remaining){
+            break;
+        }
+
+        mm += ',';
+        mm += to_string(skipped);
+        ml.emplace_back(uint8_t(rng() >> 56));
+        remaining -= skipped + 1;
+    }
+
+    mm += ';';
+}
+
+
+void ReadSimulator::encode(bam1_t* b, int32_t ref_id, int32_t pos, uint16_t flag, uint8_t mapq, int64_t query_length){
+    // Pad the name with NULs so that the CIGAR is 4 byte aligned
+    size_t l_qname = name.size() + 1;
+    size_t l_extranul = (4 - l_qname % 4) % 4;
+
+    size_t l_data = l_qname + l_extranul + 4*cigars.size() + size_t((query_length + 1)/2) + size_t(query_length);
+
+    if (l_data > b->m_data){
+        b->m_data = uint32_t(l_data*2);
+        auto data = static_cast<uint8_t*>(realloc(b->data, b->m_data));
+        if (data == nullptr){
+            throw runtime_error("ERROR: out of memory");
+        }
+        b->data = data;
+    }
+
+    b->l_data = int(l_data);
+    b->core.tid = ref_id;
+    b->core.pos = pos;
+    b->core.qual = mapq;
+    b->core.flag = flag;
+    b->core.l_qname = uint8_t(l_qname + l_extranul);
+    b->core.l_extranul = uint8_t(l_extranul);
+    b->core.n_cigar = uint32_t(cigars.size());
+    b->core.l_qseq = int32_t(query_length);
+    b->core.mtid = -1;
+    b->core.mpos = -1;
+    b->core.isize = 0;
+
+    int64_t end = pos + 1;
+    if (ref_id >= 0){
+        end = pos;
+        for (auto c: cigars){
+            if (bam_cigar_type(bam_cigar_op(c)) & 2){
+                end += bam_cigar_oplen(c);
+            }
+        }
+    }
+    b->core.bin = uint16_t(bam_reg2bin(pos, end));
+
+    uint8_t* p = b->data;
+    memcpy(p, name.c_str(), l_qname);
+    memset(p + l_qname, 0, l_extranul);
+    p += l_qname + l_extranul;
+
+    memcpy(p, cigars.data(), 4*cigars.size());
+    p += 4*cigars.size();
+
+    memcpy(p, bases.data(), size_t((query_length + 1)/2));
+    p += (query_length + 1)/2;
+
+    if (options.write_qualities){
+        memcpy(p, qualities.data(), size_t(query_length));
+    }
+    else{
+        memset(p, 0xff, size_t(query_length));
+    }
+
+    if (ref_id >= 0 and options.write_md){
+        bam_aux_append(b, "MD", 'Z', int(md.size() + 1), reinterpret_cast<const uint8_t*>(md.c_str()));
+    }
+
+    if (options.write_methylation){
+        bam_aux_append(b, "MM", 'Z', int(mm.size() + 1), reinterpret_cast<const uint8_t*>(mm.c_str()));
+
+        // B array: subtype, count, values
+        vector<uint8_t> array(5 + ml.size());
+        array[0] = 'C';
+        uint32_t n = uint32_t(ml.size());
+        memcpy(array.data() + 1, &n, 4);
+        std::copy(ml.begin(), ml.end(), array.begin() + 5);
+        bam_aux_append(b, "ML", 'B', int(array.size()), array.data());
+    }
+}
+
+
+bool ReadSimulator::next(bam1_t* b){
+    if (n_simulated == options.n_reads){
+        return false;
+    }
+
+    // When sorted, the unmapped reads are all at the end
+    int64_t n_unmapped = int64_t(round(options.unmapped_fraction*double(options.n_reads)));
+    bool unmapped = options.sorted ? (n_simulated >= options.n_reads - n_unmapped) : (uniform(rng) < options.unmapped_fraction);
+
+    n_simulated++;
+
+    name = generate_name();
+
+    int64_t length = int64_t(length_distribution(rng));
+    length = max(options.min_length, min(options.max_length, length));
+
+    double a = identity_a(rng);
+    double identity = a/(a + identity_b(rng));
+
+    if (unmapped){
+        cigars.clear();
+        generate_bases(length);
+        if (options.write_methylation){
+            generate_methylation(length, false);
+        }
+
+        encode(b, -1, -1, BAM_FUNMAP, 0, length);
+        return true;
+    }
+
+    bool supplementary = uniform(rng) < options.supplementary_fraction;
+    bool reverse = uniform(rng) < 0.5;
+
+    // Supplementary alignments cover part of the read, the rest is hard clipped
+    int64_t clip = 0;
+    if (supplementary){
+        clip = int64_t(uniform(rng)*0.5*double(length));
+        length -= clip;
+    }
+
+    int64_t ref_span;
+    generate_alignment(length, identity, ref_span);
+
+    if (clip > 0){
+        cigars.insert(cigars.begin(), bam_cigar_gen(uint32_t(clip), BAM_CHARD_CLIP));
+    }
+
+    generate_bases(length);
+
+    if (options.write_md){
+        generate_md();
+    }
+    if (options.write_methylation){
+        generate_methylation(length, reverse);
+    }
+
+    int64_t pos;
+    if (options.sorted){
+        // Exponential gaps give a uniform density of read starts, in order. Past the end of the last contig, the
+        // remaining reads all start at its last usable position.
+        double n_mapped = max(1.0, double(options.n_reads - n_unmapped));
+        std::exponential_distribution<double> gap(n_mapped/double(options.n_contigs*usable_length));
+        position += gap(rng);
+
+        while (position >= double(usable_length) and tid < options.n_contigs - 1){
+            position -= double(usable_length);
+            tid++;
+        }
+        position = min(position, double(usable_length - 1));
+        pos = int64_t(position);
+    }
+    else{
+        tid = int32_t(rng() % uint64_t(options.n_contigs));
+        pos = int64_t(uniform(rng)*double(usable_length));
+    }
+
+    // Only for absurdly long deletions
+    pos = max(int64_t(0), min(pos, options.contig_length - ref_span));
+
+    uint16_t flag = uint16_t((reverse ? BAM_FREVERSE : 0) | (supplementary ? BAM_FSUPPLEMENTARY : 0));
+    uint8_t mapq = uint8_t((uniform(rng) < 0.05) ? rng() % 60 : 60);
+
+    encode(b, tid, int32_t(pos), flag, mapq, length);
+
+    return true;
+}
+
+
+void simulate(const SimulationOptions& options, path output_path){
+    string mode = "wb" + to_string(max(int64_t(0), min(int64_t(9), options.compression_level)));
+    htsFile* file = hts_open(output_path.string().c_str(), mode.c_str());
+
+    if (file == nullptr){
+        throw runtime_error("ERROR: could not write BAM: " + output_path.string());
+    }
+
+    if (options.n_threads > 1){
+        hts_set_threads(file, int(options.n_threads));
+    }
+
+    string text = "@HD\tVN:1.6\tSO:" + string(options.sorted ? "coordinate" : "unsorted") + '\n';
+    for (int64_t i=0; i<options.n_contigs; i++){
+        text += "@SQ\tSN:chr" + to_string(i + 1) + "\tLN:" + to_string(options.contig_length) + '\n';
+    }
+    text += "@PG\tID:wam_simulate\tPN:wam_simulate\tVN:0.0.0\n";
+
+    bam_hdr_t* header = sam_hdr_parse(int(text.size()), text.c_str());
+    if (header == nullptr){
+        throw runtime_error("ERROR: could not create BAM header");
+    }
+
+    // sam_hdr_parse only fills in the references
+    header->l_text = uint32_t(text.size());
+    header->text = strdup(text.c_str());
+
+    if (sam_hdr_write(file, header) < 0){
+        throw runtime_error("ERROR: could not write BAM header: " + output_path.string());
+    }
+
+    ReadSimulator simulator(options);
+    bam1_t* record = bam_init1();
+
+    auto start = steady_clock::now();
+    int64_t n = 0;
+    int64_t n_bases = 0;
+
+    while (simulator.next(record)){
+        if (sam_write1(file, header, record) < 0){
+            throw runtime_error("ERROR: could not write BAM: " + output_path.string());
+        }
+
+        n++;
+        n_bases += record->core.l_qseq;
+
+        if (n % 100000 == 0){
+            double elapsed = double(duration_cast<milliseconds>(steady_clock::now() - start).count())/1000;
+            cerr << n << " reads, " << n_bases/1000000 << " Mbp (" << int64_t(double(n)/max(elapsed, 1e-3))
+                 << " reads/s)" << '\n';
+        }
+    }
+
+    bam_destroy1(record);
+
+    if (hts_close(file) != 0){
+        throw runtime_error("ERROR: could not close BAM: " + output_path.string());
+    }
+
+    bam_hdr_destroy(header);
+
+    cerr << "Wrote " << n << " reads (" << n_bases/1000000 << " Mbp) to " << output_path.string() << '\n';
+}
+
+
+int main (int argc, char* argv[]){
+    path output_path;
+    SimulationOptions options;
+
+    CLI::App app{"Write a BAM of simulated long read alignments (=/X CIGARs) for benchmarks and scale tests"};
+
+    app.add_option(
+            "-o,--output",
+            output_path,
+            "Path of the BAM to write")
+            ->required();
+
+    app.add_option(
+            "-n,--reads",
+            options.n_reads,
+            "Number of reads")
+            ->default_val(100000);
+
+    app.add_option(
+            "--contigs",
+            options.n_contigs,
+            "Number of reference contigs (chr1, chr2, ...)")
+            ->default_val(24);
+
+    app.add_option(
+            "--contig_length",
+            options.contig_length,
+            "Length of each contig")
+            ->default_val(100000000);
+
+    app.add_option(
+            "--mean_length",
+            options.mean_length,
+            "Mean read length (log-normal distribution)")
+            ->default_val(20000);
+
+    app.add_option(
+            "--length_sigma",
+            options.length_sigma,
+            "Standard deviation of the log of the read length")
+            ->default_val(0.8);
+
+    app.add_option(
+            "--min_length",
+            options.min_length,
+            "Reads are at least this long")
+            ->default_val(200);
+
+    app.add_option(
+            "--max_length",
+            options.max_length,
+            "Reads are at most this long")
+            ->default_val(1000000);
+
+    app.add_option(
+            "--mean_identity",
+            options.mean_identity,
+            "Mean per-read identity (Beta distribution)")
+            ->default_val(0.96);
+
+    app.add_option(
+            "--identity_concentration",
+            options.identity_concentration,
+            "Concentration (alpha + beta) of the identity distribution, higher is narrower")
+            ->default_val(200);
+
+    app.add_option(
+            "--mismatch_fraction",
+            options.mismatch_fraction,
+            "Fraction of the errors that are mismatches")
+            ->default_val(0.4);
+
+    app.add_option(
+            "--insertion_fraction",
+            options.insertion_fraction,
+            "Fraction of the errors that are insertions (the rest are deletions)")
+            ->default_val(0.3);
+
+    app.add_option(
+            "--indel_extension",
+            options.indel_extension,
+            "Probability that an indel extends by one more base (geometric lengths)")
+            ->default_val(0.4);
+
+    app.add_option(
+            "--large_indel_rate",
+            options.large_indel_rate,
+            "Mean number of indels of 51bp to 5kbp per read")
+            ->default_val(0.05);
+
+    app.add_option(
+            "--unmapped_fraction",
+            options.unmapped_fraction,
+            "Fraction of unmapped reads")
+            ->default_val(0.01);
+
+    app.add_option(
+            "--supplementary_fraction",
+            options.supplementary_fraction,
+            "Fraction of supplementary alignments (hard clipped)")
+            ->default_val(0.03);
+
+    app.add_flag(
+            "--md",
+            options.write_md,
+            "Add MD tags");
+
+    app.add_flag(
+            "--qualities",
+            options.write_qualities,
+            "Add base qualities (otherwise '*')");
+
+    app.add_flag(
+            "--methylation",
+            options.write_methylation,
+            "Add MM/ML tags (5mC)");
+
+    app.add_flag(
+            "--sorted",
+            options.sorted,
+            "Write reads in coordinate order (SO:coordinate)");
+
+    app.add_option(
+            "-t,--threads",
+            options.n_threads,
+            "Threads for BGZF compression")
+            ->default_val(1);
+
+    app.add_option(
+            "-l,--level",
+            options.compression_level,
+            "BGZF compression level (0-9)")
+            ->default_val(6);
+
+    app.add_option(
+            "--seed",
+            options.seed,
+            "Random seed")
+            ->default_val(42);
+
+    CLI11_PARSE(app, argc, argv);
+
+    simulate(options, output_path);
+
+    return 0;
+}
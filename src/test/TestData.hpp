@@ -0,0 +1,152 @@
+#pragma once
+
+#include "SampleMetrics.hpp"
+#include "Filesystem.hpp"
+#include "ShardPlan.hpp"
+#include "Bam.hpp"
+#include "htslib/include/htslib/sam.h"
+
+using ghc::filesystem::temp_directory_path;
+using ghc::filesystem::create_directories;
+using ghc::filesystem::remove_all;
+using ghc::filesystem::path;
+
+#include <stdexcept>
+#include <iostream>
+#include <iterator>
+#include <fstream>
+#include <string>
+
+#include <unistd.h>
+
+using std::runtime_error;
+using std::ifstream;
+using std::to_string;
+using std::string;
+using std::cerr;
+
+
+namespace gfase {
+
+
+/// Directory of the repository, found from the location of this file so that tests run from any build directory
+inline path get_project_directory(){
+    path script_path = __FILE__;
+    return script_path.parent_path().parent_path().parent_path();
+}
+
+
+/// Fresh scratch directory for one test (named after it and the process), removed when it goes out of scope
+class ScratchDirectory {
+public:
+    path directory;
+
+    explicit ScratchDirectory(const string& name):
+            directory(temp_directory_path() / ("wambam_" + name + "_" + to_string(getpid())))
+    {
+        remove_all(directory);
+        create_directories(directory);
+    }
+
+    ~ScratchDirectory(){
+        remove_all(directory);
+    }
+};
+
+
+/// SAM (or any format htslib reads) rewritten as a BGZF compressed BAM
+inline void write_bam(path input_path, path output_path){
+    samFile* in = hts_open(input_path.string().c_str(), "r");
+    if (in == nullptr){
+        throw runtime_error("ERROR: could not read test data: " + input_path.string());
+    }
+
+    bam_hdr_t* header = sam_hdr_read(in);
+    if (header == nullptr){
+        throw runtime_error("ERROR: could not read header of test data: " + input_path.string());
+    }
+
+    samFile* out = hts_open(output_path.string().c_str(), "wb");
+    if (out == nullptr or sam_hdr_write(out, header) < 0){
+        throw runtime_error("ERROR: could not write BAM: " + output_path.string());
+    }
+
+    bam1_t* record = bam_init1();
+    while (sam_read1(in, header, record) >= 0){
+        if (sam_write1(out, header, record) < 0){
+            throw runtime_error("ERROR: could not write BAM: " + output_path.string());
+        }
+    }
+
+    bam_destroy1(record);
+    bam_hdr_destroy(header);
+    hts_close(in);
+
+    if (hts_close(out) != 0){
+        throw runtime_error("ERROR: could not close BAM: " + output_path.string());
+    }
+}
+
+
+/// Path of testdata/reads_minimap2.bam, which is stored as SAM text
+inline path get_test_sam_path(){
+    return get_project_directory() / "testdata" / "reads_minimap2.bam";
+}
+
+
+/// The test data rewritten as a real BGZF compressed BAM, which the offset based features (shards, checkpoints,
+/// indexes) need. Returns the path of the written BAM.
+inline path write_test_bam(path output_dir){
+    path output_path = output_dir / "reads_minimap2.bam";
+    write_bam(get_test_sam_path(), output_path);
+    return output_path;
+}
+
+
+/// Metrics of the records of a BAM (only those of one shard, if not null) computed the way a run of wam does,
+/// with outputs going to output_dir (which is created)
+inline SampleMetrics compute_metrics(path bam_path, path output_dir, const SampleMetrics::Options& options,
+                                     const ShardPlan::Shard* shard=nullptr){
+    create_directories(output_dir);
+
+    Bam bam_reader(bam_path);
+    bam_reader.set_tags_to_load(SampleMetrics::get_required_tags(options));
+    bam_reader.set_detail_filter(SampleMetrics::min_mapq);
+
+    if (shard != nullptr){
+        bam_reader.set_virtual_offset_range(shard->begin, shard->end);
+    }
+
+    SampleMetrics metrics(options, bam_reader.get_ref_names(), bam_reader.get_ref_lengths(),
+                          bam_reader.is_coordinate_sorted(), output_dir);
+
+    bam_reader.for_alignment_in_bam(true, true, [&](SamElement& e){
+        metrics.add_alignment(e);
+    });
+
+    return metrics;
+}
+
+
+/// Whole contents of a file, e.g. to compare the outputs of two runs
+inline string read_file(path file_path){
+    ifstream file(file_path, std::ios::binary);
+    if (not (file.is_open() and file.good())){
+        throw runtime_error("ERROR: could not read file: " + file_path.string());
+    }
+
+    return string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+
+/// Report a failed check without stopping, so that one run lists every failure. Returns the condition.
+inline bool check(bool condition, const string& description, int& n_failures){
+    if (not condition){
+        cerr << "FAIL: " << description << '\n';
+        n_failures++;
+    }
+    return condition;
+}
+
+
+}
@@ -0,0 +1,283 @@
+#include "SampleMetrics.hpp"
+#include "ArrowWriter.hpp"
+#include "Filesystem.hpp"
+#include "TestData.hpp"
+
+using ghc::filesystem::path;
+using gfase::ScratchDirectory;
+using gfase::SampleMetrics;
+using gfase::ArrowWriter;
+
+#include <stdexcept>
+#include <iostream>
+#include <sstream>
+#include <cstring>
+#include <utility>
+#include <string>
+#include <vector>
+
+using std::runtime_error;
+using std::stringstream;
+using std::string;
+using std::vector;
+using std::pair;
+using std::cerr;
+
+
+/// Read access to a table of a flatbuffer (see the flatbuffers binary format), just enough to walk the footer and
+/// the messages of an Arrow file
+class FlatTable {
+    const string* buffer;
+    uint32_t position;
+
+    template <class T> T read(size_t at) const{
+        if (at + sizeof(T) > buffer->size()){
+            throw runtime_error("ERROR: flatbuffer offset out of range");
+        }
+
+        T value;
+        memcpy(&value, buffer->data() + at, sizeof(T));
+        return value;
+    }
+
+    /// Offset of a field from the start of the table, 0 if it is absent
+    uint16_t get_field_offset(uint16_t id) const{
+        uint32_t vtable = uint32_t(int64_t(position) - read<int32_t>(position));
+        uint16_t vtable_size = read<uint16_t>(vtable);
+
+        if (sizeof(uint16_t)*(2 + id) >= vtable_size){
+            return 0;
+        }
+
+        return read<uint16_t>(vtable + sizeof(uint16_t)*(2 + id));
+    }
+
+    uint32_t follow(uint16_t id) const{
+        uint16_t offset = get_field_offset(id);
+        if (offset == 0){
+            throw runtime_error("ERROR: flatbuffer table has no field " + std::to_string(id));
+        }
+
+        uint32_t at = position + offset;
+        return at + read<uint32_t>(at);
+    }
+
+public:
+    FlatTable(const string& buffer, uint32_t position):
+            buffer(&buffer),
+            position(position)
+    {}
+
+    static FlatTable get_root(const string& buffer){
+        return {buffer, FlatTable(buffer, 0).read<uint32_t>(0)};
+    }
+
+    template <class T> T get(uint16_t id, T default_value) const{
+        uint16_t offset = get_field_offset(id);
+        return (offset == 0) ? default_value : read<T>(position + offset);
+    }
+
+    FlatTable get_table(uint16_t id) const{
+        return {*buffer, follow(id)};
+    }
+
+    /// Number of elements of a vector field
+    uint32_t get_vector_size(uint16_t id) const{
+        return read<uint32_t>(follow(id));
+    }
+
+    /// Field of element i of a vector of structs of element_size bytes
+    template <class T> T get_struct_field(uint16_t id, uint32_t i, size_t element_size, size_t field_offset) const{
+        return read<T>(follow(id) + sizeof(uint32_t) + i*element_size + field_offset);
+    }
+};
+
+
+struct Block {
+    int64_t offset;
+    int32_t metadata_length;
+    int64_t body_length;
+};
+
+
+// Enums of Message.fbs
+static const uint8_t header_dictionary_batch = 2;
+static const uint8_t header_record_batch = 3;
+
+
+/// Parse an Arrow IPC file from its footer, check that every block listed there is an encapsulated message of the
+/// expected type and size, and return the values of one int32 column (given by the index of its values buffer)
+vector<int32_t> read_int32_column(const string& arrow, size_t values_buffer, size_t n_columns,
+                                  size_t& n_record_batches, int& n_failures){
+    vector<int32_t> values;
+    n_record_batches = 0;
+
+    const string magic("ARROW1\0\0", 8);
+    gfase::check(arrow.size() > 2*magic.size() and arrow.compare(0, 8, magic) == 0, "file starts with the magic",
+                 n_failures);
+    gfase::check(arrow.compare(arrow.size() - 6, 6, magic, 0, 6) == 0, "file ends with the magic", n_failures);
+
+    int32_t footer_size;
+    memcpy(&footer_size, arrow.data() + arrow.size() - 10, sizeof(footer_size));
+    int64_t footer_start = int64_t(arrow.size()) - 10 - footer_size;
+
+    if (not gfase::check(footer_size > 0 and footer_start >= 8, "footer size is within the file", n_failures)){
+        return values;
+    }
+
+    string footer = arrow.substr(size_t(footer_start), size_t(footer_size));
+    auto root = FlatTable::get_root(footer);
+
+    gfase::check(root.get<int16_t>(0, 0) == 4, "footer has metadata version V5", n_failures);
+    gfase::check(root.get_table(1).get_vector_size(1) == n_columns, "footer schema has every column", n_failures);
+
+    // Dictionaries, then record batches, as written
+    vector<pair<uint8_t,Block> > blocks;
+    for (uint16_t id: {2, 3}){
+        for (uint32_t i=0; i<root.get_vector_size(id); i++){
+            Block b = {root.get_struct_field<int64_t>(id, i, 24, 0),
+                       root.get_struct_field<int32_t>(id, i, 24, 8),
+                       root.get_struct_field<int64_t>(id, i, 24, 16)};
+            blocks.emplace_back((id == 2) ? header_dictionary_batch : header_record_batch, b);
+        }
+    }
+
+    int64_t previous_end = -1;
+
+    for (auto& [header_type, block]: blocks){
+        int64_t end = block.offset + block.metadata_length + block.body_length;
+
+        if (not gfase::check(block.offset >= 8 and end <= footer_start, "block is within the file", n_failures)){
+            continue;
+        }
+
+        gfase::check(previous_end < 0 or block.offset == previous_end, "blocks are contiguous", n_failures);
+        previous_end = end;
+
+        uint32_t marker;
+        int32_t metadata_size;
+        memcpy(&marker, arrow.data() + block.offset, sizeof(marker));
+        memcpy(&metadata_size, arrow.data() + block.offset + 4, sizeof(metadata_size));
+
+        gfase::check(marker == 0xFFFFFFFF, "block starts with the continuation marker", n_failures);
+        gfase::check(block.metadata_length == 8 + metadata_size, "block metadata length matches the message",
+                     n_failures);
+        gfase::check(block.metadata_length % 8 == 0, "block body is 8 byte aligned", n_failures);
+
+        string metadata = arrow.substr(size_t(block.offset + 8), size_t(metadata_size));
+        auto message = FlatTable::get_root(metadata);
+
+        gfase::check(message.get<uint8_t>(1, 0) == header_type, "block is a message of the listed type", n_failures);
+        gfase::check(message.get<int64_t>(3, 0) == block.body_length, "block body length matches the message",
+                     n_failures);
+
+        if (header_type != header_record_batch){
+            continue;
+        }
+
+        n_record_batches++;
+
+        auto batch = message.get_table(2);
+        auto length = batch.get<int64_t>(0, 0);
+
+        // Buffers are (offset in the body, length)
+        auto buffer_offset = batch.get_struct_field<int64_t>(2, uint32_t(values_buffer), 16, 0);
+        auto buffer_length = batch.get_struct_field<int64_t>(2, uint32_t(values_buffer), 16, 8);
+
+        if (not gfase::check(buffer_length == length*int64_t(sizeof(int32_t)) and
+                             buffer_offset + buffer_length <= block.body_length, "column buffer fits its batch",
+                             n_failures)){
+            continue;
+        }
+
+        size_t start = values.size();
+        values.resize(start + size_t(length));
+        memcpy(values.data() + start, arrow.data() + block.offset + block.metadata_length + buffer_offset,
+               size_t(buffer_length));
+    }
+
+    return values;
+}
+
+
+int main(){
+    ScratchDirectory scratch("arrow_writer");
+    path bam_path = gfase::write_test_bam(scratch.directory);
+    path output_dir = scratch.directory / "output";
+    int n_failures = 0;
+
+    SampleMetrics::Options options;
+    options.write_arrow = true;
+    auto metrics = gfase::compute_metrics(bam_path, output_dir, options);
+    metrics.write_summaries(output_dir);
+
+    // Start of each row of the TSV, in order
+    vector<int32_t> starts;
+    stringstream lines(gfase::read_file(output_dir / "alignment_summary_50bpMaxIndel.tsv"));
+    string line;
+    while (getline(lines, line)){
+        if (line.empty() or line[0] == '#' or line.compare(0, 5, "track") == 0){
+            continue;
+        }
+
+        stringstream fields(line);
+        string ref_name;
+        int32_t start;
+        fields >> ref_name >> start;
+        starts.emplace_back(start);
+    }
+
+    gfase::check(not starts.empty(), "test BAM has alignment summaries", n_failures);
+
+    // The summary written by wam: chr (dictionary indexes, buffers 0 and 1), then start_pos (buffers 2 and 3)
+    {
+        string arrow = gfase::read_file(output_dir / "alignment_summary_50bpMaxIndel.arrow");
+        size_t n_batches;
+        auto result = read_int32_column(arrow, 3, 11, n_batches, n_failures);
+
+        gfase::check(result == starts, "alignment summary arrow has the rows of the TSV", n_failures);
+    }
+
+    // Several batches, with a string column between the int32 ones
+    {
+        path arrow_path = scratch.directory / "batches.arrow";
+        size_t batch_size = 300;
+
+        ArrowWriter writer(arrow_path, {
+                {"start_pos", ArrowWriter::Type::int32, {}},
+                {"name", ArrowWriter::Type::utf8, {}},
+                {"end_pos", ArrowWriter::Type::int32, {}}
+        }, batch_size);
+
+        for (auto start: starts){
+            writer.append_int(0, start);
+            writer.append_string(1, "row_" + std::to_string(start));
+            writer.append_int(2, start + 1);
+            writer.end_row();
+        }
+        writer.close();
+
+        string arrow = gfase::read_file(arrow_path);
+        size_t n_batches;
+
+        // Buffers: validity and values of start_pos, validity, offsets and characters of name, then end_pos
+        auto result = read_int32_column(arrow, 1, 3, n_batches, n_failures);
+        gfase::check(result == starts, "first column of every batch reads back", n_failures);
+        gfase::check(n_batches == (starts.size() + batch_size - 1)/batch_size, "rows are split into batches",
+                     n_failures);
+
+        result = read_int32_column(arrow, 6, 3, n_batches, n_failures);
+        for (auto& x: result){
+            x--;
+        }
+        gfase::check(result == starts, "column after a string column reads back", n_failures);
+    }
+
+    if (n_failures > 0){
+        cerr << n_failures << " check(s) failed" << '\n';
+        return 1;
+    }
+
+    cerr << "PASS" << '\n';
+    return 0;
+}
@@ -0,0 +1,329 @@
+#include "Filesystem.hpp"
+#include "TestData.hpp"
+#include "Bam.hpp"
+#include "htslib/include/htslib/sam.h"
+
+using ghc::filesystem::path;
+using gfase::ScratchDirectory;
+using gfase::SamElement;
+using gfase::Bam;
+
+#include <unordered_set>
+#include <stdexcept>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdint>
+#include <cctype>
+#include <string>
+#include <vector>
+#include <tuple>
+
+using std::unordered_set;
+using std::runtime_error;
+using std::stringstream;
+using std::ofstream;
+using std::ifstream;
+using std::string;
+using std::vector;
+using std::cerr;
+
+
+/// Everything that Bam reports about one record, and the virtual offset after it
+struct Record {
+    string query_name;
+    int32_t ref_id;
+    int32_t start_pos;
+    int32_t query_length;
+    uint16_t flag;
+    uint8_t mapq;
+    vector<uint32_t> cigars;
+    vector<uint8_t> qualities;
+    vector<string> tags;
+    int64_t offset;
+
+    bool operator==(const Record& other) const{
+        return std::tie(query_name, ref_id, start_pos, query_length, flag, mapq, cigars, qualities, tags, offset) ==
+               std::tie(other.query_name, other.ref_id, other.start_pos, other.query_length, other.flag, other.mapq,
+                        other.cigars, other.qualities, other.tags, other.offset);
+    }
+};
+
+
+/// Which records are read, and what is copied from them
+struct ReadOptions {
+    vector<string> tags;
+    // 0 to copy the CIGAR and qualities of every record (see Bam::set_detail_filter)
+    uint8_t min_mapq;
+    int64_t begin;
+    int64_t end;
+};
+
+
+vector<string> split(const string& s, char delimiter){
+    vector<string> fields;
+    stringstream stream(s);
+    string field;
+
+    while (getline(stream, field, delimiter)){
+        fields.emplace_back(field);
+    }
+
+    return fields;
+}
+
+
+/// The test data with the cases that it lacks, by record: mapq 0, secondary, no qualities, and the CIGAR moved to a CG
+/// tag behind the placeholder that BAM uses for CIGARs of more than 65535 operations. Returns the number of CG tags.
+size_t write_test_cases(path output_path){
+    ifstream in(gfase::get_test_sam_path());
+    ofstream out(output_path);
+    string line;
+    size_t i = 0;
+    size_t n_cigar_tags = 0;
+
+    while (getline(in, line)){
+        if (line.empty() or line[0] == '@'){
+            out << line << '\n';
+            continue;
+        }
+
+        auto fields = split(line, '\t');
+
+        if (i % 5 == 1){
+            fields[4] = "0";
+        }
+        else if (i % 5 == 2){
+            fields[1] = std::to_string(std::stoi(fields[1]) | BAM_FSECONDARY);
+        }
+        else if (i % 5 == 3){
+            fields[10] = "*";
+        }
+        else if (i % 5 == 4 and fields[5] != "*"){
+            string tag = "CG:B:I";
+            int64_t ref_length = 0;
+            int64_t length = 0;
+
+            for (auto c: fields[5]){
+                if (isdigit(c)){
+                    length = 10*length + (c - '0');
+                    continue;
+                }
+
+                int op = int(string(BAM_CIGAR_STR).find(c));
+                if (bam_cigar_type(op) & 2){
+                    ref_length += length;
+                }
+
+                tag += "," + std::to_string(bam_cigar_gen(length, op));
+                length = 0;
+            }
+
+            fields[5] = std::to_string(fields[9].size()) + "S" + std::to_string(ref_length) + "N";
+            fields.emplace_back(tag);
+            n_cigar_tags++;
+        }
+
+        for (size_t f=0; f<fields.size(); f++){
+            out << (f > 0 ? "\t" : "") << fields[f];
+        }
+        out << '\n';
+
+        i++;
+    }
+
+    return n_cigar_tags;
+}
+
+
+/// Whether the CIGAR is the placeholder (query length soft clipped, then the reference length skipped) of a CIGAR
+/// stored in a CG tag
+bool is_placeholder(const Record& r){
+    return r.cigars.size() == 2 and bam_cigar_op(r.cigars[0]) == BAM_CSOFT_CLIP and
+           int32_t(bam_cigar_oplen(r.cigars[0])) == r.query_length and bam_cigar_op(r.cigars[1]) == BAM_CREF_SKIP;
+}
+
+
+/// Same as the conversion of aux values in Bam.cpp
+string aux_to_string(const uint8_t* aux){
+    if (aux[0] == 'Z' or aux[0] == 'H') {
+        return bam_aux2Z(aux);
+    }
+    else if (aux[0] == 'A') {
+        return string(1, bam_aux2A(aux));
+    }
+    else if (aux[0] != 'f' and aux[0] != 'd' and aux[0] != 'B') {
+        return std::to_string(bam_aux2i(aux));
+    }
+
+    return "";
+}
+
+
+/// Records as read by htslib with sam_read1, which Bam reads with its own decoder
+vector<Record> read_with_htslib(path bam_path, const ReadOptions& options){
+    vector<Record> records;
+
+    samFile* file = hts_open(bam_path.string().c_str(), "r");
+    if (file == nullptr){
+        throw runtime_error("ERROR: could not open: " + bam_path.string());
+    }
+
+    bam_hdr_t* header = sam_hdr_read(file);
+    if (header == nullptr){
+        throw runtime_error("ERROR: could not read header: " + bam_path.string());
+    }
+
+    if (options.begin >= 0 and bgzf_seek(file->fp.bgzf, options.begin, SEEK_SET) < 0){
+        throw runtime_error("ERROR: could not seek in: " + bam_path.string());
+    }
+
+    bam1_t* alignment = bam_init1();
+
+    while ((options.end < 0 or bgzf_tell(file->fp.bgzf) < options.end) and sam_read1(file, header, alignment) >= 0){
+        Record r;
+        r.query_name = bam_get_qname(alignment);
+        r.ref_id = alignment->core.tid;
+        r.start_pos = int32_t(alignment->core.pos);
+        r.query_length = alignment->core.l_qseq;
+        r.flag = alignment->core.flag;
+        r.mapq = alignment->core.qual;
+
+        bool details = options.min_mapq == 0 or (not Bam::is_not_primary(r.flag) and r.mapq >= options.min_mapq);
+
+        if (details){
+            auto cigar = bam_get_cigar(alignment);
+            r.cigars.assign(cigar, cigar + alignment->core.n_cigar);
+
+            auto qualities = bam_get_qual(alignment);
+            if (r.query_length > 0 and qualities[0] != 0xff){
+                r.qualities.assign(qualities, qualities + r.query_length);
+            }
+        }
+
+        for (auto& tag: options.tags){
+            const uint8_t* aux = bam_aux_get(alignment, tag.c_str());
+            r.tags.emplace_back(aux == nullptr ? "" : aux_to_string(aux));
+        }
+
+        r.offset = bgzf_tell(file->fp.bgzf);
+        records.emplace_back(r);
+    }
+
+    bam_destroy1(alignment);
+    bam_hdr_destroy(header);
+    hts_close(file);
+
+    return records;
+}
+
+
+vector<Record> read_with_bam(path bam_path, const ReadOptions& options){
+    vector<Record> records;
+
+    Bam bam_reader(bam_path);
+    bam_reader.set_tags_to_load(options.tags);
+
+    if (options.min_mapq > 0){
+        bam_reader.set_detail_filter(options.min_mapq);
+    }
+
+    if (options.begin >= 0){
+        bam_reader.set_virtual_offset_range(options.begin, options.end);
+    }
+
+    bam_reader.for_alignment_in_bam(true, true, [&](SamElement& e){
+        records.push_back({e.query_name, e.ref_id, e.start_pos, e.query_length, e.flag, e.mapq, e.cigars, e.qualities,
+                           e.tags, bam_reader.get_virtual_offset()});
+    });
+
+    return records;
+}
+
+
+void compare(const vector<Record>& result, const vector<Record>& expected, const string& description,
+             int& n_failures){
+    gfase::check(result.size() == expected.size(), description + ": same number of records", n_failures);
+
+    for (size_t i=0; i<result.size() and i<expected.size(); i++){
+        if (not (result[i] == expected[i])){
+            gfase::check(false, description + ": same fields and offsets (first difference at record " +
+                                std::to_string(i) + ", " + expected[i].query_name + ")", n_failures);
+            break;
+        }
+    }
+}
+
+
+int main(){
+    ScratchDirectory scratch("bam_decoder");
+    path sam_path = scratch.directory / "test_cases.sam";
+    path bam_path = scratch.directory / "test_cases.bam";
+    int n_failures = 0;
+
+    size_t n_cigar_tags = write_test_cases(sam_path);
+    gfase::write_bam(sam_path, bam_path);
+
+    // Integer, character and float tags, the CG tag itself (an array, so "") and a missing one
+    vector<string> tags = {"NM", "tp", "de", "CG", "XX"};
+
+    ReadOptions all = {tags, 0, -1, -1};
+    auto expected = read_with_htslib(bam_path, all);
+
+    unordered_set<int64_t> blocks;
+    size_t n_placeholders = 0;
+    for (auto& r: expected){
+        blocks.emplace(r.offset >> 16);
+        n_placeholders += is_placeholder(r) ? 1 : 0;
+    }
+
+    gfase::check(expected.size() > 1000, "test BAM has records", n_failures);
+    gfase::check(blocks.size() > 2, "records span several BGZF blocks", n_failures);
+    gfase::check(n_cigar_tags > 0 and n_placeholders == 0, "CIGARs in CG tags are restored by htslib", n_failures);
+
+    compare(read_with_bam(bam_path, all), expected, "whole BAM", n_failures);
+
+    // Records that are only counted are read without their CIGAR and qualities
+    ReadOptions filtered = {tags, 1, -1, -1};
+    compare(read_with_bam(bam_path, filtered), read_with_htslib(bam_path, filtered), "detail filter", n_failures);
+
+    // A range of records starting and ending mid-file, as for a shard or a resumed checkpoint
+    ReadOptions range = {{}, 1, expected[700].offset, expected[1400].offset};
+    auto expected_range = read_with_htslib(bam_path, range);
+    gfase::check(expected_range.size() == 700, "range has the records between its offsets", n_failures);
+    compare(read_with_bam(bam_path, range), expected_range, "virtual offset range", n_failures);
+
+    // Lengths and qualities of primary records, as summarized by wam reads
+    {
+        vector<Record> result;
+        Bam bam_reader(bam_path);
+        bam_reader.for_read_in_bam([&](int64_t length, const uint8_t* qualities){
+            Record r = {};
+            r.query_length = int32_t(length);
+            if (qualities != nullptr){
+                r.qualities.assign(qualities, qualities + length);
+            }
+            result.emplace_back(r);
+        });
+
+        vector<Record> primary;
+        for (auto& r: expected){
+            if (not (Bam::is_not_primary(r.flag) or Bam::is_supplementary(r.flag))){
+                Record p = {};
+                p.query_length = r.query_length;
+                p.qualities = r.qualities;
+                primary.emplace_back(p);
+            }
+        }
+
+        compare(result, primary, "primary reads", n_failures);
+    }
+
+    if (n_failures > 0){
+        cerr << n_failures << " check(s) failed" << '\n';
+        return 1;
+    }
+
+    cerr << "PASS" << '\n';
+    return 0;
+}
@@ -0,0 +1,60 @@
+#include "GroupedMetrics.hpp"
+#include "Filesystem.hpp"
+#include "TestData.hpp"
+#include "Sam.hpp"
+
+using ghc::filesystem::path;
+using gfase::ScratchDirectory;
+using gfase::GroupedMetrics;
+using gfase::SamElement;
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+using std::cerr;
+
+
+int main(){
+    ScratchDirectory scratch("grouped_metrics");
+    int n_failures = 0;
+
+    // Reads without the tag (empty value), with a tag that is literally "*", and with a comma and a quote in it
+    GroupedMetrics metrics("RG", {"chr1"}, 0);
+
+    vector<string> values = {"", "*", "*", "a,b", "say \"hi\""};
+    for (auto& value: values){
+        SamElement e;
+        e.tags = {value};
+        e.query_length = 100;
+        e.ref_id = 0;
+
+        metrics.add_read(e);
+        metrics.add_alignment(e, 0.99, 99, 1);
+    }
+
+    metrics.write_to_files(scratch.directory);
+
+    string lengths = gfase::read_file(scratch.directory / "length_distribution_by_RG.csv");
+
+    // Groups are sorted by name, the empty name (reads without the tag) first
+    string expected = ",100,1\n"
+                      "*,100,2\n"
+                      "\"a,b\",100,1\n"
+                      "\"say \"\"hi\"\"\",100,1\n";
+
+    gfase::check(lengths == expected, "missing tag and \"*\" are separate groups, and names are quoted", n_failures);
+
+    string summary = gfase::read_file(scratch.directory / "summary_by_RG.csv");
+    gfase::check(summary.find("\n\"a,b\",1,100,") != string::npos, "summary quotes group names", n_failures);
+
+    if (n_failures > 0){
+        cerr << n_failures << " check(s) failed" << '\n';
+        return 1;
+    }
+
+    cerr << "PASS" << '\n';
+    return 0;
+}
@@ -0,0 +1,63 @@
+#include "SampleMetrics.hpp"
+#include "Filesystem.hpp"
+#include "TestData.hpp"
+
+using ghc::filesystem::exists;
+using ghc::filesystem::path;
+using gfase::ScratchDirectory;
+using gfase::SampleMetrics;
+
+#include <iostream>
+#include <cstdlib>
+#include <string>
+
+using std::string;
+using std::cerr;
+
+
+/// Runs `wam merge` the way the WDL merge task does, so that the command line it uses is checked against the options
+/// that the merge subcommand actually accepts. The path of the wam executable is the only argument.
+int main(int argc, char* argv[]){
+    if (argc != 2){
+        cerr << "Usage: test_merge_command_line <path to wam>" << '\n';
+        return 1;
+    }
+
+    path wam_path = argv[1];
+
+    ScratchDirectory scratch("merge_command_line");
+    path bam_path = gfase::write_test_bam(scratch.directory);
+    path run_dir = scratch.directory / "run";
+    path merged_dir = scratch.directory / "merged";
+    int n_failures = 0;
+
+    SampleMetrics::Options options;
+    auto metrics = gfase::compute_metrics(bam_path, run_dir, options);
+    metrics.write_outputs();
+
+    // Same arguments as the mergeWambam task
+    string command = "'" + wam_path.string() + "' merge -o '" + merged_dir.string() + "' --bed_gz --arrow '" +
+                     (run_dir / SampleMetrics::state_filename).string() + "'";
+
+    int status = std::system(command.c_str());
+
+    gfase::check(status == 0, "wam merge accepts the options of the WDL merge task", n_failures);
+
+    string prefix = "alignment_summary_50bpMaxIndel";
+    for (auto& name: {prefix + ".tsv", prefix + ".bed.gz", prefix + ".bed.gz.tbi", prefix + ".arrow"}){
+        gfase::check(exists(merged_dir / name), "merge writes " + name, n_failures);
+    }
+
+    if (exists(merged_dir / (prefix + ".tsv"))){
+        gfase::check(gfase::read_file(merged_dir / (prefix + ".tsv")) == gfase::read_file(run_dir / (prefix + ".tsv")),
+                     "merging one state gives the alignment summary of its run", n_failures);
+    }
+
+    if (n_failures > 0){
+        cerr << n_failures << " check(s) failed" << '\n';
+        return 1;
+    }
+
+    cerr << "PASS" << '\n';
+    return 0;
+}
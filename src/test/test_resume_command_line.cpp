@@ -0,0 +1,95 @@
+#include "SampleMetrics.hpp"
+#include "RunCheckpoint.hpp"
+#include "Filesystem.hpp"
+#include "TestData.hpp"
+
+using ghc::filesystem::create_directories;
+using ghc::filesystem::exists;
+using ghc::filesystem::path;
+using gfase::ScratchDirectory;
+using gfase::RunCheckpoint;
+using gfase::SampleMetrics;
+
+#include <iostream>
+#include <fstream>
+#include <cstdlib>
+#include <string>
+
+using std::ofstream;
+using std::string;
+using std::cerr;
+
+
+/// Runs wam with --resume on output directories left in each state that an interrupted run can leave before its
+/// first checkpoint, and checks which ones are run again. The path of the wam executable is the only argument.
+int main(int argc, char* argv[]){
+    if (argc != 2){
+        cerr << "Usage: test_resume_command_line <path to wam>" << '\n';
+        return 1;
+    }
+
+    path wam_path = argv[1];
+
+    ScratchDirectory scratch("resume_command_line");
+    path bam_path = gfase::write_test_bam(scratch.directory);
+    path complete_dir = scratch.directory / "complete";
+    int n_failures = 0;
+
+    auto run_wam = [&](path output_dir, const string& arguments){
+        string command = "'" + wam_path.string() + "' -i '" + bam_path.string() + "' -o '" + output_dir.string() + "' " +
+                         arguments;
+        return std::system(command.c_str());
+    };
+
+    string summary_name = "alignment_summary_50bpMaxIndel.tsv";
+
+    gfase::check(run_wam(complete_dir, "") == 0, "run completes", n_failures);
+    string expected = gfase::read_file(complete_dir / summary_name);
+
+    // Killed between creating the directory and writing the first checkpoint: run again, not skipped
+    {
+        path output_dir = scratch.directory / "created_only";
+        create_directories(output_dir);
+
+        gfase::check(run_wam(output_dir, "--resume") == 0, "empty directory resumes", n_failures);
+        gfase::check(exists(output_dir / SampleMetrics::state_filename), "empty directory is run again", n_failures);
+        gfase::check(not exists(output_dir / RunCheckpoint::filename), "restarted run removes its checkpoint",
+                     n_failures);
+
+        if (exists(output_dir / summary_name)){
+            gfase::check(gfase::read_file(output_dir / summary_name) == expected,
+                         "restarted run gives the results of an uninterrupted one", n_failures);
+        }
+    }
+
+    // Same, with a spill file and a partial output written before the kill
+    {
+        path output_dir = scratch.directory / "partial";
+        create_directories(output_dir);
+        ofstream(output_dir / ".alignment_summaries.1.0.spill") << "stale";
+        ofstream(output_dir / summary_name) << "partial";
+
+        gfase::check(run_wam(output_dir, "--resume") == 0, "partial directory resumes", n_failures);
+        gfase::check(not exists(output_dir / ".alignment_summaries.1.0.spill"), "stale spill file is removed",
+                     n_failures);
+        gfase::check(gfase::read_file(output_dir / summary_name) == expected, "partial output is replaced",
+                     n_failures);
+    }
+
+    // Completed: skipped, so its outputs are left as they are
+    {
+        ofstream(complete_dir / summary_name) << "marker";
+
+        gfase::check(run_wam(complete_dir, "--resume") == 0, "complete directory resumes", n_failures);
+        gfase::check(gfase::read_file(complete_dir / summary_name) == "marker", "complete directory is skipped",
+                     n_failures);
+    }
+
+    if (n_failures > 0){
+        cerr << n_failures << " check(s) failed" << '\n';
+        return 1;
+    }
+
+    cerr << "PASS" << '\n';
+    return 0;
+}
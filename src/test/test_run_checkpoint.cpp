@@ -0,0 +1,209 @@
+#include "AlignmentSummaryStore.hpp"
+#include "RunCheckpoint.hpp"
+#include "SampleMetrics.hpp"
+#include "Filesystem.hpp"
+#include "ShardPlan.hpp"
+#include "TestData.hpp"
+#include "Bam.hpp"
+
+using ghc::filesystem::directory_iterator;
+using ghc::filesystem::create_directories;
+using ghc::filesystem::file_size;
+using ghc::filesystem::path;
+using gfase::AlignmentSummaryStore;
+using gfase::ScratchDirectory;
+using gfase::RunCheckpoint;
+using gfase::SampleMetrics;
+using gfase::SamElement;
+using gfase::ShardPlan;
+using gfase::Bam;
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using std::stringstream;
+using std::ifstream;
+using std::string;
+using std::vector;
+using std::cerr;
+
+
+/// Write the checkpoint, read it back, and count the records that a run resumed from it reads
+int64_t count_resumed(path bam_path, path output_dir, const RunCheckpoint& checkpoint, const ShardPlan::Shard* shard,
+                      int& n_failures){
+    vector<SampleMetrics> none;
+    checkpoint.write(output_dir, none);
+
+    path checkpoint_path = output_dir / RunCheckpoint::filename;
+    ifstream file(checkpoint_path, std::ios::binary);
+    auto previous = RunCheckpoint::read(file, checkpoint_path);
+
+    // Same as a resumed run: start the range over, check it, then seek
+    Bam bam_reader(bam_path);
+    auto current = RunCheckpoint::start(bam_reader, int64_t(file_size(bam_path)), shard);
+    gfase::check(previous.is_same_range(current), "checkpoint matches the range it was written for", n_failures);
+    previous.seek(bam_reader);
+
+    int64_t n = 0;
+    bam_reader.for_alignment_in_bam(false, [&](SamElement& e){
+        n++;
+    });
+
+    return n;
+}
+
+
+size_t count_files(path directory){
+    size_t n = 0;
+    for (auto i = directory_iterator(directory); i != directory_iterator(); ++i){
+        n++;
+    }
+    return n;
+}
+
+
+/// Checkpoints refer to the spill files of the alignment summaries, which must survive the store (as they do an
+/// interrupted process) and be adopted by the resumed one
+void test_summary_checkpoints(path directory, int& n_failures){
+    create_directories(directory);
+
+    vector<string> ref_names = {"chr1", "chr2"};
+    AlignmentSummaryStore::AlignmentSummary summary = {};
+    summary.matches = 100;
+
+    stringstream expected;
+    stringstream checkpoint;
+    {
+        AlignmentSummaryStore store(ref_names, directory, nullptr);
+        AlignmentSummaryStore full(ref_names, directory / "full", nullptr);
+
+        for (int32_t i=0; i<300; i++){
+            summary.ref_id = i % 2;
+            summary.start = 1000 - i;
+            summary.end = summary.start + 50;
+            store.add(summary, "read_" + std::to_string(i % 200));
+            full.add(summary, "read_" + std::to_string(i % 200));
+
+            // Several checkpoints, each of which only spills what was added since the previous one
+            if (i % 100 == 99){
+                checkpoint.str("");
+                store.write_checkpoint(checkpoint);
+            }
+        }
+
+        full.write_binary(expected);
+
+        // A run spilled after the last checkpoint, e.g. by going over the budget just before being preempted
+        summary.start = 5000;
+        store.add(summary, "read_after");
+        stringstream ignored;
+        store.write_checkpoint(ignored);
+    }
+
+    gfase::check(count_files(directory) == 4, "checkpointed runs outlive their store", n_failures);
+
+    AlignmentSummaryStore resumed(ref_names, directory, nullptr);
+    resumed.read_checkpoint(checkpoint);
+
+    stringstream result;
+    resumed.write_binary(result);
+
+    gfase::check(resumed.get_n_runs() == 3, "resumed store adopts the runs of the checkpoint", n_failures);
+    gfase::check(count_files(directory) == 3, "runs the checkpoint does not refer to are deleted", n_failures);
+    gfase::check(result.str() == expected.str(), "resumed summaries are those of the checkpoint", n_failures);
+
+    resumed.discard_checkpoint();
+}
+
+
+int main(){
+    ScratchDirectory scratch("run_checkpoint");
+    path bam_path = gfase::write_test_bam(scratch.directory);
+    int64_t bam_size = int64_t(file_size(bam_path));
+    int n_failures = 0;
+
+    int64_t first_record;
+    int64_t n_total = 0;
+    {
+        Bam bam_reader(bam_path);
+        first_record = bam_reader.get_virtual_offset();
+        bam_reader.for_alignment_in_bam(false, [&](SamElement& e){
+            n_total++;
+        });
+    }
+
+    gfase::check(n_total > 0, "test BAM has records", n_failures);
+
+    // An empty shard (e.g. more shards than blocks) must read nothing on resume, not everything from the first record
+    {
+        ShardPlan::Shard empty = {-1, -1};
+        Bam bam_reader(bam_path);
+        auto checkpoint = RunCheckpoint::start(bam_reader, bam_size, &empty);
+
+        gfase::check(checkpoint.next_offset == -1, "empty shard has nothing to resume", n_failures);
+        gfase::check(count_resumed(bam_path, scratch.directory, checkpoint, &empty, n_failures) == 0,
+                     "resuming an empty shard reads no records", n_failures);
+
+        // Also after reading it (which reads nothing), as the periodic checkpoints do
+        bam_reader.for_alignment_in_bam(false, [&](SamElement& e){});
+        checkpoint.update(bam_reader);
+        gfase::check(count_resumed(bam_path, scratch.directory, checkpoint, &empty, n_failures) == 0,
+                     "resuming an updated empty shard reads no records", n_failures);
+    }
+
+    // A shard covering the whole BAM, resumed before anything was read
+    {
+        ShardPlan::Shard whole = {first_record, -1};
+        Bam bam_reader(bam_path);
+        auto checkpoint = RunCheckpoint::start(bam_reader, bam_size, &whole);
+
+        gfase::check(count_resumed(bam_path, scratch.directory, checkpoint, &whole, n_failures) == n_total,
+                     "resuming a shard from its start reads all of its records", n_failures);
+    }
+
+    // The whole BAM, interrupted part way
+    {
+        Bam bam_reader(bam_path);
+        auto checkpoint = RunCheckpoint::start(bam_reader, bam_size, nullptr);
+        int64_t n_before = n_total / 3;
+        int64_t n = 0;
+
+        bam_reader.for_alignment_in_bam(false, [&](SamElement& e){
+            if (++n == n_before){
+                checkpoint.update(bam_reader);
+            }
+        });
+
+        gfase::check(count_resumed(bam_path, scratch.directory, checkpoint, nullptr, n_failures) == n_total - n_before,
+                     "resuming part way reads only the remaining records", n_failures);
+    }
+
+    // Checkpoints of other ranges are rejected
+    {
+        ShardPlan::Shard empty = {-1, -1};
+        ShardPlan::Shard whole = {first_record, -1};
+        Bam a(bam_path);
+        Bam b(bam_path);
+        auto empty_checkpoint = RunCheckpoint::start(a, bam_size, &empty);
+        auto whole_checkpoint = RunCheckpoint::start(b, bam_size, &whole);
+
+        gfase::check(not empty_checkpoint.is_same_range(whole_checkpoint), "empty and whole shards differ", n_failures);
+
+        whole_checkpoint.bam_size++;
+        gfase::check(not whole_checkpoint.is_same_range(RunCheckpoint::start(a, bam_size, &whole)),
+                     "checkpoint of another BAM differs", n_failures);
+    }
+
+    test_summary_checkpoints(scratch.directory / "summaries", n_failures);
+
+    if (n_failures > 0){
+        cerr << n_failures << " check(s) failed" << '\n';
+        return 1;
+    }
+
+    cerr << "PASS" << '\n';
+    return 0;
+}
@@ -0,0 +1,149 @@
+#include "SampleMetrics.hpp"
+#include "Filesystem.hpp"
+#include "ShardPlan.hpp"
+#include "TestData.hpp"
+#include "Bam.hpp"
+
+using ghc::filesystem::create_directories;
+using ghc::filesystem::path;
+using gfase::ScratchDirectory;
+using gfase::SampleMetrics;
+using gfase::SamElement;
+using gfase::ShardPlan;
+using gfase::Bam;
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using std::stringstream;
+using std::string;
+using std::vector;
+using std::cerr;
+
+
+/// Outputs that are fully determined by the state (the report and the state itself are compared separately)
+static const vector<string> compared_outputs = {
+        "identity_distribution.csv",
+        "length_distribution.csv",
+        "quality_calibration.csv",
+        "identity_distribution_by_contig.csv",
+        "length_distribution_by_contig.csv",
+        "summary_by_contig.csv",
+        "alignment_summary_50bpMaxIndel.tsv",
+        "alignment_summary_50bpMaxIndel.tsv.sorted.bed"
+};
+
+
+string get_state(const SampleMetrics& metrics){
+    stringstream state;
+    metrics.write_state(state);
+    return state.str();
+}
+
+
+/// Number of records of a shard (or of the whole BAM if null)
+int64_t count_records(path bam_path, const ShardPlan::Shard* shard){
+    Bam bam_reader(bam_path);
+
+    if (shard != nullptr){
+        bam_reader.set_virtual_offset_range(shard->begin, shard->end);
+    }
+
+    int64_t n = 0;
+    bam_reader.for_alignment_in_bam(false, [&](SamElement&){
+        n++;
+    });
+
+    return n;
+}
+
+
+void compare_outputs(path a, path b, const string& description, int& n_failures){
+    for (auto& name: compared_outputs){
+        gfase::check(gfase::read_file(a / name) == gfase::read_file(b / name), description + ": " + name, n_failures);
+    }
+}
+
+
+int main(){
+    ScratchDirectory scratch("state_merge");
+    path bam_path = gfase::write_test_bam(scratch.directory);
+    int n_failures = 0;
+
+    SampleMetrics::Options options;
+    options.group_keys = {"contig"};
+
+    auto full = gfase::compute_metrics(bam_path, scratch.directory / "full", options);
+    full.write_outputs();
+    string full_state = get_state(full);
+
+    // The plain BED has the lines of the TSV after its two header lines
+    {
+        string tsv = gfase::read_file(scratch.directory / "full" / "alignment_summary_50bpMaxIndel.tsv");
+        string bed = gfase::read_file(scratch.directory / "full" / "alignment_summary_50bpMaxIndel.tsv.sorted.bed");
+        size_t rows_start = tsv.find('\n', tsv.find('\n') + 1) + 1;
+
+        gfase::check(not bed.empty() and tsv.compare(rows_start, string::npos, bed) == 0,
+                     "sorted BED has the rows of the TSV", n_failures);
+    }
+
+    // write_state -> read_state gives the same state and the same outputs
+    {
+        stringstream state(full_state);
+        auto loaded = SampleMetrics::read_state(state, scratch.directory / "loaded");
+        create_directories(scratch.directory / "loaded");
+        loaded.write_summaries(scratch.directory / "loaded");
+
+        gfase::check(get_state(loaded) == full_state, "state read back is identical", n_failures);
+        compare_outputs(scratch.directory / "full", scratch.directory / "loaded", "state read back", n_failures);
+    }
+
+    // Merging the states of several shards gives the same results as one run over the whole BAM. The test BAM spans
+    // a few BGZF blocks, enough for every shard to get records, which is checked so that the merge combines
+    // non-trivial states.
+    {
+        size_t n_shards = 4;
+        auto plan = ShardPlan::create(bam_path, n_shards);
+        gfase::check(plan.size() == n_shards, "plan has the requested number of shards", n_failures);
+
+        vector<string> shard_states;
+        int64_t n_shard_records = 0;
+        for (size_t i=0; i<plan.size(); i++){
+            auto shard = plan.get_shard(i, bam_path);
+            int64_t n = count_records(bam_path, &shard);
+            n_shard_records += n;
+
+            gfase::check(n > 0, "shard " + std::to_string(i) + " has records", n_failures);
+
+            auto metrics = gfase::compute_metrics(bam_path, scratch.directory / ("shard_" + std::to_string(i)), options,
+                                                  &shard);
+            shard_states.emplace_back(get_state(metrics));
+        }
+
+        gfase::check(n_shard_records == count_records(bam_path, nullptr), "shards have every record once",
+                     n_failures);
+
+        stringstream first_state(shard_states[0]);
+        auto merged = SampleMetrics::read_state(first_state, scratch.directory / "merged");
+        for (size_t i=1; i<shard_states.size(); i++){
+            stringstream state(shard_states[i]);
+            merged += SampleMetrics::read_state(state, scratch.directory / "merged");
+        }
+
+        create_directories(scratch.directory / "merged");
+        merged.write_summaries(scratch.directory / "merged");
+
+        gfase::check(get_state(merged) == full_state, "merged state is identical to that of one run", n_failures);
+        compare_outputs(scratch.directory / "full", scratch.directory / "merged", "merged shards", n_failures);
+    }
+
+    if (n_failures > 0){
+        cerr << n_failures << " check(s) failed" << '\n';
+        return 1;
+    }
+
+    cerr << "PASS" << '\n';
+    return 0;
+}
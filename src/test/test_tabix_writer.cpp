@@ -0,0 +1,126 @@
+#include "SampleMetrics.hpp"
+#include "Filesystem.hpp"
+#include "TestData.hpp"
+#include "htslib/include/htslib/tbx.h"
+
+using ghc::filesystem::path;
+using gfase::ScratchDirectory;
+using gfase::SampleMetrics;
+
+#include <stdexcept>
+#include <iostream>
+#include <sstream>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+using std::runtime_error;
+using std::stringstream;
+using std::string;
+using std::vector;
+using std::cerr;
+
+
+/// Lines of the alignment summary TSV (without its headers) on a reference that overlap [start, end)
+vector<string> get_overlapping_rows(const string& tsv, const string& ref_name, int64_t start, int64_t end){
+    vector<string> rows;
+    stringstream lines(tsv);
+    string line;
+
+    while (getline(lines, line)){
+        if (line.empty() or line[0] == '#' or line.compare(0, 5, "track") == 0){
+            continue;
+        }
+
+        stringstream fields(line);
+        string row_ref_name;
+        int64_t row_start;
+        int64_t row_end;
+        fields >> row_ref_name >> row_start >> row_end;
+
+        if (row_ref_name == ref_name and row_start < end and row_end > start){
+            rows.emplace_back(line);
+        }
+    }
+
+    return rows;
+}
+
+
+/// Lines that tabix returns for a region, e.g. "chr1:1000-2000"
+vector<string> query(path bed_path, tbx_t* index, const string& region){
+    vector<string> rows;
+
+    htsFile* file = hts_open(bed_path.string().c_str(), "r");
+    if (file == nullptr){
+        throw runtime_error("ERROR: could not open: " + bed_path.string());
+    }
+
+    hts_itr_t* iterator = tbx_itr_querys(index, region.c_str());
+    if (iterator == nullptr){
+        throw runtime_error("ERROR: could not query region " + region + " of: " + bed_path.string());
+    }
+
+    kstring_t line = {0, 0, nullptr};
+    while (tbx_itr_next(file, index, iterator, &line) >= 0){
+        rows.emplace_back(line.s, line.l);
+    }
+
+    free(line.s);
+    tbx_itr_destroy(iterator);
+    hts_close(file);
+
+    return rows;
+}
+
+
+int main(){
+    ScratchDirectory scratch("tabix_writer");
+    path bam_path = gfase::write_test_bam(scratch.directory);
+    path output_dir = scratch.directory / "output";
+    int n_failures = 0;
+
+    SampleMetrics::Options options;
+    options.write_bed_gz = true;
+    auto metrics = gfase::compute_metrics(bam_path, output_dir, options);
+    metrics.write_summaries(output_dir);
+
+    path bed_path = output_dir / "alignment_summary_50bpMaxIndel.bed.gz";
+    string tsv = gfase::read_file(output_dir / "alignment_summary_50bpMaxIndel.tsv");
+
+    tbx_t* index = tbx_index_load(bed_path.string().c_str());
+    if (not gfase::check(index != nullptr, "index of the bed.gz loads", n_failures)){
+        return 1;
+    }
+
+    int n_names = 0;
+    const char** names = tbx_seqnames(index, &n_names);
+    vector<string> index_names(names, names + n_names);
+    free(names);
+
+    gfase::check(index_names.size() >= 2 and index_names[0] == "chr1" and index_names[1] == "chr2",
+                 "index names the references in header order", n_failures);
+
+    // Region strings are 1-based and inclusive, so this is [999, 2000) in BED coordinates
+    auto expected = get_overlapping_rows(tsv, "chr1", 999, 2000);
+    auto result = query(bed_path, index, "chr1:1000-2000");
+
+    gfase::check(not expected.empty(), "test region has alignments", n_failures);
+    gfase::check(result == expected, "region query returns the overlapping rows of the TSV, in order", n_failures);
+
+    expected = get_overlapping_rows(tsv, "chr2", 0, 10000);
+    result = query(bed_path, index, "chr2");
+
+    gfase::check(not expected.empty(), "second reference has alignments", n_failures);
+    gfase::check(result == expected, "reference query returns all of its rows", n_failures);
+
+    tbx_destroy(index);
+
+    if (n_failures > 0){
+        cerr << n_failures << " check(s) failed" << '\n';
+        return 1;
+    }
+
+    cerr << "PASS" << '\n';
+    return 0;
+}